@@ -11,12 +11,27 @@
 #ifdef __KERNEL__
 #include <linux/string.h>
 #include <linux/slab.h>
+#include <linux/errno.h>
 #else
 #include <string.h>
+#include <errno.h>
 #endif
 
 #include "aesd-circular-buffer.h"
 
+/**
+* @return @param position, a slot index below twice buffer->max_entries, wrapped into the entry array
+*/
+static inline unsigned int aesd_circular_buffer_wrap(const struct aesd_circular_buffer *buffer, unsigned int position)
+{
+    if(buffer->pow2)
+    {
+        return position & (buffer->max_entries - 1);
+    }
+    
+    return position % buffer->max_entries;
+}
+
 /**
  * @param buffer the buffer to search for corresponding offset.  Any necessary locking must be performed by caller.
  * @param char_offset the position to search for in the buffer list, describing the zero referenced
@@ -30,9 +45,11 @@
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
 			size_t char_offset, size_t *entry_offset_byte_rtn )
 {
-    int        cur_total_size = buffer->entry[buffer->out_offs].size;;
-    uint8_t    prev_total_size = 0;
-    uint8_t    position = buffer->out_offs;
+    size_t          head = 0;
+    unsigned int    low = 0;
+    unsigned int    high = 0;
+    unsigned int    mid = 0;
+    unsigned int    position = 0;
 
     
     
@@ -41,35 +58,108 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct
         return NULL;
     }
     
-    // check if ring buffer is empty
-    if( (position == buffer->in_offs) && (buffer->full == false) )
+    // check if ring buffer is empty or char_offset is beyond what it holds
+    if(buffer->count == 0 || char_offset >= buffer->total_bytes)
     {
         return NULL;
     }
     
+    head = buffer->start[buffer->out_offs];
+    high = buffer->count - 1;
     
-    while(char_offset > (cur_total_size-1))    // search through the whole malloced buffer string, last element in string is 0
+    // binary search for the newest entry starting at or before char_offset, counting entries from out_offs
+    while(low < high)
     {
-        prev_total_size = cur_total_size;
-        
-        position = (position+1)%AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;   // next entry[i]
+        mid = low + (high - low + 1) / 2;
         
-        if(position == buffer->out_offs)    // searched whole circular buffer and char_offset is still beyond the current size, which means it is not in the string buffer
+        if(buffer->start[aesd_circular_buffer_wrap(buffer, buffer->out_offs + mid)] - head <= char_offset)
         {
-            return NULL;
+            low = mid;
         }
         
-        cur_total_size += buffer->entry[position].size;
+        else
+        {
+            high = mid - 1;
+        }
     }
+    
+    position = aesd_circular_buffer_wrap(buffer, buffer->out_offs + low);
         
-    *entry_offset_byte_rtn = char_offset - prev_total_size;
+    *entry_offset_byte_rtn = char_offset - (buffer->start[position] - head);
     return &buffer->entry[position];
 }
 
+/**
+* @param buffer the buffer to search.  Any necessary locking must be performed by caller.
+* @param write_cmd the zero referenced entry, counted from the oldest one held
+* @param write_cmd_offset the zero referenced byte within that entry
+* @param char_offset_rtn is set to the position of that byte if all buffer strings were concatenated end to end,
+*      which is what aesd_circular_buffer_find_entry_offset_for_fpos takes
+* @return 0 on success, -EINVAL if the entry or the byte within it is not in the buffer
+*/
+int aesd_circular_buffer_fpos_for_entry(struct aesd_circular_buffer *buffer, unsigned int write_cmd,
+			size_t write_cmd_offset, size_t *char_offset_rtn)
+{
+    unsigned int    position = 0;
+    
+    if(buffer == NULL || write_cmd >= buffer->count)
+    {
+        return -EINVAL;
+    }
+    
+    position = aesd_circular_buffer_wrap(buffer, buffer->out_offs + write_cmd);
+    
+    if(write_cmd_offset >= buffer->entry[position].size)
+    {
+        return -EINVAL;
+    }
+    
+    // O(1) through the prefix-sum index
+    *char_offset_rtn = buffer->start[position] - buffer->start[buffer->out_offs] + write_cmd_offset;
+    
+    return 0;
+}
+
+/**
+* @param buffer the buffer @param entry was returned from.  Any necessary locking must be performed by caller.
+* @return the entry added right after @param entry, or NULL if @param entry is the newest one
+*/
+struct aesd_buffer_entry *aesd_circular_buffer_next_entry(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *entry)
+{
+    unsigned int    position = entry - buffer->entry;
+    
+    position = aesd_circular_buffer_wrap(buffer, position+1);
+    
+    if(position == buffer->in_offs)
+    {
+        return NULL;
+    }
+    
+    return &buffer->entry[position];
+}
+
+/**
+* Removes the oldest entry of @param buffer, which must not be empty
+* @return the buffptr of the removed entry
+*/
+static const char* aesd_circular_buffer_remove_oldest(struct aesd_circular_buffer *buffer)
+{
+    const char*		tmp = buffer->entry[buffer->out_offs].buffptr;
+    
+    buffer->total_bytes -= buffer->entry[buffer->out_offs].size;
+    buffer->entry[buffer->out_offs].buffptr = NULL;
+    buffer->entry[buffer->out_offs].size = 0;
+    buffer->out_offs = aesd_circular_buffer_wrap(buffer, buffer->out_offs+1);
+    buffer->count--;
+    buffer->full = false;
+    
+    return tmp;
+}
+
 /**
 * Adds entry @param add_entry to @param buffer in the location specified in buffer->in_offs.
-* If the buffer was already full, overwrites the oldest entry and advances buffer->out_offs to the
-* new start location.
+* If the buffer already held max_entries entries, the oldest one is removed first and buffer->out_offs
+* advances to the new start location.
 * Any necessary locking must be handled by the caller
 * Any memory referenced in @param add_entry must be allocated by and/or must have a lifetime managed by the caller.
 */
@@ -84,53 +174,120 @@ const char* aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
     
     if(buffer->full == true)
     {   
-        tmp = buffer->entry[buffer->in_offs].buffptr;
+        tmp = aesd_circular_buffer_remove_oldest(buffer);
     }
     
     buffer->entry[buffer->in_offs] = *add_entry;
+    buffer->start[buffer->in_offs] = buffer->end_offset;
+    buffer->end_offset += add_entry->size;
 
-    buffer->in_offs = (buffer->in_offs+1)%AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;    // implement in_offs to next location after new entry is written
+    buffer->in_offs = aesd_circular_buffer_wrap(buffer, buffer->in_offs+1);    // implement in_offs to next location after new entry is written
+    buffer->count++;
+    buffer->total_bytes += add_entry->size;
     
-    if(buffer->full == true)
+    if(buffer->count == buffer->max_entries)    // check the full conditions
     {
-        buffer->out_offs = (buffer->out_offs+1)%AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        buffer->full = true;
     }
     
+    return tmp;
+}
+
+/**
+* Removes the oldest entry of @param buffer while its entries hold more than buffer->max_bytes bytes.
+* The newest entry is always kept, even when it is larger than the budget by itself.
+* Call it until it returns NULL after each aesd_circular_buffer_add_entry()
+* Any necessary locking must be handled by the caller
+* @return the buffptr of the removed entry for the caller to free, NULL if nothing was removed
+*/
+const char* aesd_circular_buffer_trim(struct aesd_circular_buffer *buffer)
+{
+    if(buffer == NULL || buffer->max_bytes == 0 || buffer->count <= 1 || buffer->total_bytes <= buffer->max_bytes)
+    {
+        return NULL;
+    }
     
-    if(buffer->in_offs == buffer->out_offs)    // check the full conditions
+    return aesd_circular_buffer_remove_oldest(buffer);
+}
+
+/**
+* Initializes the circular buffer described by @param buffer to an empty struct keeping at most
+* @param max_entries entries and @param max_bytes bytes, 0 for no byte limit.
+* Each entry gets one slot, an index wraps with a mask when @param max_entries is a power of two
+* @return 0 on success, -EINVAL if @param max_entries is 0 or above AESDCHAR_MAX_ENTRIES_LIMIT,
+* -ENOMEM if the slots can not be allocated
+*/
+int aesd_circular_buffer_init_size(struct aesd_circular_buffer *buffer, unsigned int max_entries, size_t max_bytes)
+{
+    memset(buffer,0,sizeof(struct aesd_circular_buffer));
+    
+    if(max_entries == 0 || max_entries > AESDCHAR_MAX_ENTRIES_LIMIT)
     {
-        buffer->full = true;
+        return -EINVAL;
     }
     
-    return tmp;
+#ifdef __KERNEL__
+    buffer->entry = kcalloc(max_entries, sizeof(struct aesd_buffer_entry), GFP_KERNEL);
+    buffer->start = kcalloc(max_entries, sizeof(size_t), GFP_KERNEL);
+#else
+    buffer->entry = calloc(max_entries, sizeof(struct aesd_buffer_entry));
+    buffer->start = calloc(max_entries, sizeof(size_t));
+#endif
+    
+    if(buffer->entry == NULL || buffer->start == NULL)
+    {
+        aesd_circular_buffer_free(buffer);
+        return -ENOMEM;
+    }
+    
+    buffer->max_entries = max_entries;
+    buffer->pow2 = (max_entries & (max_entries - 1)) == 0;
+    buffer->max_bytes = max_bytes;
+    
+    return 0;
 }
 
 /**
 * Initializes the circular buffer described by @param buffer to an empty struct
+* keeping the last AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries
+* @return 0 on success, -ENOMEM if the slots can not be allocated
 */
-void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
+int aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 {
-    memset(buffer,0,sizeof(struct aesd_circular_buffer));
+    return aesd_circular_buffer_init_size(buffer, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, 0);
 }
 
 
 void aesd_circular_buffer_free(struct aesd_circular_buffer *cbuff)
 {
 	struct aesd_buffer_entry 	*entry;
-	uint8_t               		idx;
+	unsigned int               	idx;
 
-	AESD_CIRCULAR_BUFFER_FOREACH(entry, cbuff, idx) 
+	if(cbuff->entry != NULL)
 	{
-
-		if (entry->buffptr != NULL)
+		AESD_CIRCULAR_BUFFER_FOREACH(entry, cbuff, idx) 
 		{
+
+			if (entry->buffptr != NULL)
+			{
 #ifdef __KERNEL__
 
-		kfree(entry->buffptr);
+			kfree(entry->buffptr);
 #else
 
-		free((void*)entry->buffptr);	
+			free((void*)entry->buffptr);	
 #endif
+			}
 		}
 	}
+
+#ifdef __KERNEL__
+	kfree(cbuff->entry);
+	kfree(cbuff->start);
+#else
+	free(cbuff->entry);
+	free(cbuff->start);
+#endif
+	cbuff->entry = NULL;
+	cbuff->start = NULL;
 }
@@ -18,7 +18,8 @@
 #include <stdbool.h>
 #endif
 
-#define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+#define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10	// entry cap of aesd_circular_buffer_init()
+#define AESDCHAR_MAX_ENTRIES_LIMIT 65536		// largest entry cap accepted by aesd_circular_buffer_init_size()
 
 struct aesd_buffer_entry
 {
@@ -35,20 +36,51 @@ struct aesd_buffer_entry
 struct aesd_circular_buffer
 {
 	/**
-	 * An array of pointers to memory allocated for the most recent write operations
+	 * An array of max_entries slots for the most recent write operations.
+	 * Slots not holding an entry are zeroed
 	 */
-	struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+	struct aesd_buffer_entry  *entry;
+	/**
+	 * Prefix-sum index of entry: the offset of the first byte of each slot's entry in
+	 * everything ever added, so neither adding nor removing an entry changes the others.
+	 * Offsets are only compared relative to the oldest entry and may wrap
+	 */
+	size_t *start;
+	/**
+	 * Offset just past the newest entry in everything ever added, the start of the next one
+	 */
+	size_t end_offset;
+	/**
+	 * Entries kept at most and slots in entry, the oldest is overwritten by the next one past it
+	 */
+	unsigned int max_entries;
+	/**
+	 * max_entries is a power of two, so a slot index wraps with a mask instead of a modulo
+	 */
+	bool pow2;
+	/**
+	 * Bytes kept at most, 0 for no limit. See aesd_circular_buffer_trim()
+	 */
+	size_t max_bytes;
+	/**
+	 * Number of entries held
+	 */
+	unsigned int count;
+	/**
+	 * Bytes held by the entries
+	 */
+	size_t total_bytes;
 	/**
 	 * The current location in the entry structure where the next write should
 	 * be stored.
 	 */
-	uint8_t in_offs;
+	unsigned int in_offs;
 	/**
 	 * The first location in the entry structure to read from
 	 */
-	uint8_t out_offs;
+	unsigned int out_offs;
 	/**
-	 * set to true when the buffer entry structure is full
+	 * set to true when the buffer holds max_entries entries
 	 */
 	bool full;
 };
@@ -56,18 +88,27 @@ struct aesd_circular_buffer
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
 			size_t char_offset, size_t *entry_offset_byte_rtn );
 
+extern int aesd_circular_buffer_fpos_for_entry(struct aesd_circular_buffer *buffer, unsigned int write_cmd,
+			size_t write_cmd_offset, size_t *char_offset_rtn);
+
+extern struct aesd_buffer_entry *aesd_circular_buffer_next_entry(struct aesd_circular_buffer *buffer,
+			struct aesd_buffer_entry *entry);
+
 extern const char* aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
 
-extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
+extern const char* aesd_circular_buffer_trim(struct aesd_circular_buffer *buffer);
+
+extern int aesd_circular_buffer_init_size(struct aesd_circular_buffer *buffer, unsigned int max_entries, size_t max_bytes);
+extern int aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 extern void aesd_circular_buffer_free(struct aesd_circular_buffer *cbuff);
 /**
  * Create a for loop to iterate over each member of the circular buffer.
  * Useful when you've allocated memory for circular buffer entries and need to free it
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is an unsigned int stack allocated value used by this macro for an index
  * Example usage:
- * uint8_t index;
+ * unsigned int index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
@@ -76,7 +117,7 @@ extern void aesd_circular_buffer_free(struct aesd_circular_buffer *cbuff);
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index) \
 	for(index=0, entryptr=&((buffer)->entry[index]); \
-			index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
+			index<(buffer)->max_entries; \
 			index++, entryptr=&((buffer)->entry[index]))
 
 
@@ -0,0 +1,68 @@
+/*
+ * aesd_ioctl.h
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: Dazong Chen
+ *
+ *  @brief Definitions for the ioctl used on aesd char devices, shared by the driver and its users
+ */
+
+#ifndef AESD_IOCTL_H
+#define AESD_IOCTL_H
+
+#ifdef __KERNEL__
+#include <asm-generic/ioctl.h>
+#include <linux/types.h>
+#else
+#include <sys/ioctl.h>
+#include <stdint.h>
+#endif
+
+/**
+ * A structure to be passed by IOCTL from user space to kernel space, describing the type
+ * of seek performed on the aesdchar driver
+ */
+struct aesd_seekto
+{
+	/**
+	 * The zero referenced write command to seek into, 0 is the oldest write the device still holds
+	 */
+	uint32_t write_cmd;
+	/**
+	 * The zero referenced offset within the write
+	 */
+	uint32_t write_cmd_offset;
+};
+
+/**
+ * Filled by AESDCHAR_IOCGETRANGE with what the device holds, counted over every byte of complete writes
+ * since the driver was loaded. Unlike file positions these offsets do not move when entries are evicted
+ */
+struct aesd_range
+{
+	/**
+	 * Bytes evicted so far, the offset of file position 0
+	 */
+	uint64_t head;
+	/**
+	 * Offset just past the newest write, head plus the size of the device
+	 */
+	uint64_t end;
+};
+
+// Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
+#define AESD_IOC_MAGIC 0x16
+
+// Define a write command from the user point of view, use command number 1
+#define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+// Turn tail reads on (1) or off (0) for the file: at the end of the device read() waits for the next record,
+// or fails with EAGAIN with O_NONBLOCK, and poll() reports it readable once a record was written
+#define AESDCHAR_IOCTAIL _IOW(AESD_IOC_MAGIC, 2, uint32_t)
+// Read the range of struct aesd_range, so users can tell how far the device evicted past an offset they kept
+#define AESDCHAR_IOCGETRANGE _IOR(AESD_IOC_MAGIC, 3, struct aesd_range)
+/**
+ * The maximum number of commands supported, used for bounds checking
+ */
+#define AESDCHAR_IOC_MAXNR 3
+
+#endif /* AESD_IOCTL_H */
@@ -32,6 +32,24 @@ struct aesd_dev
 	struct aesd_buffer_entry          buffer_entry;
 	struct aesd_circular_buffer       cbuff;
 	struct mutex                      locker;
+	wait_queue_head_t                 readq;    /* tail readers waiting for the next record	*/
+};
+
+/**
+ * Per open file state, filp->private_data points to it
+ */
+struct aesd_file
+{
+	struct aesd_dev*                  dev;
+	/**
+	 * Set by AESDCHAR_IOCTAIL: reads at the end of the device wait for the next record instead of returning 0
+	 */
+	bool                              tail;
+	/**
+	 * Offset of the oldest byte the device held, counted like cbuff.end_offset, when f_pos was last set.
+	 * A tail reader's f_pos is moved by what was evicted since, so it stays on the same byte
+	 */
+	size_t                            seen_head;
 };
 
 
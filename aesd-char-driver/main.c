@@ -20,13 +20,25 @@
 #include <linux/mutex.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h> // iov_iter
+#include <linux/wait.h>
+#include <linux/poll.h>
 #include "aesd-circular-buffer.h"
 #include "aesdchar.h"
+#include "aesd_ioctl.h"
 
 
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
 
+static unsigned int max_entries = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+module_param(max_entries, uint, 0444);
+MODULE_PARM_DESC(max_entries, "Write operations kept at most (default 10)");
+
+static unsigned long max_bytes = 0;
+module_param(max_bytes, ulong, 0444);
+MODULE_PARM_DESC(max_bytes, "Bytes kept at most, the oldest writes are dropped past it (default 0, no limit)");
+
 MODULE_AUTHOR("Dazong Chen"); /** TODO: fill in your name **/
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -39,9 +51,19 @@ int aesd_open(struct inode *inode, struct file *filp)
 	 * TODO: handle open
 	 */
 	struct aesd_dev* 	dev;
+	struct aesd_file*	file;
 	
 	dev = container_of(inode->i_cdev, struct aesd_dev, cdev);    // find addr of aesd_dev structure and return to pointer
-	filp->private_data = dev;    // stores the pointer in private data;
+	
+	file = kzalloc(sizeof(struct aesd_file), GFP_KERNEL);
+	
+	if(file == NULL)
+	{
+		return -ENOMEM;
+	}
+	
+	file->dev = dev;
+	filp->private_data = file;    // stores the pointer in private data;
 	 
 	return 0;
 }
@@ -52,14 +74,69 @@ int aesd_release(struct inode *inode, struct file *filp)
 	/**
 	 * TODO: handle release
 	 */
+	kfree(filp->private_data);
 	return 0;
 }
 
+// offset of the oldest byte the device holds, counted like cbuff.end_offset
+static size_t aesd_head(struct aesd_dev *dev)
+{
+	return dev->cbuff.end_offset - dev->cbuff.total_bytes;
+}
+
+
+// called with dev->locker held before a read of a tail file
+// keeps *f_pos on the byte it pointed at when writes evicted older records, then waits for a record
+// to be written while *f_pos is at the end of the device, or fails with -EAGAIN if nonblock
+// return 0 with dev->locker still held, or a negative error with it released
+static int aesd_tail_wait(struct aesd_file *file, loff_t *f_pos, bool nonblock)
+{
+	struct aesd_dev*	dev = file->dev;
+	size_t			end = 0;
+	long			moved = 0;
+	
+	while(1)
+	{
+		moved = (long)(aesd_head(dev) - file->seen_head);
+		
+		if(moved != 0)
+		{
+			*f_pos = (*f_pos > moved) ? *f_pos - moved : 0;
+			file->seen_head = aesd_head(dev);
+		}
+		
+		if(*f_pos < dev->cbuff.total_bytes)
+		{
+			return 0;
+		}
+		
+		end = dev->cbuff.end_offset;
+		mutex_unlock(&dev->locker);
+		
+		if(nonblock)
+		{
+			return -EAGAIN;
+		}
+		
+		if(wait_event_interruptible(dev->readq, READ_ONCE(dev->cbuff.end_offset) != end))
+		{
+			return -ERESTARTSYS;
+		}
+		
+		if(mutex_lock_interruptible(&dev->locker))
+		{
+			return -ERESTARTSYS;
+		}
+	}
+}
+
+
 ssize_t aesd_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
 {
 	ssize_t                       retval = 0;
 	size_t                        bytes_to_read = 0;
-	struct aesd_dev*              dev = filp->private_data;
+	struct aesd_file*             file = filp->private_data;
+	struct aesd_dev*              dev = file->dev;
 	struct aesd_buffer_entry*     entry = NULL;
 	size_t                        entry_offset = 0;                       
 	unsigned long                 uncopied_bytes = 0;
@@ -74,37 +151,111 @@ ssize_t aesd_read(struct file *filp, char __user *buf, size_t count, loff_t *f_p
 		return -ERESTARTSYS;
 	}
 	
+	if(file->tail && count > 0)
+	{
+		retval = aesd_tail_wait(file, f_pos, filp->f_flags & O_NONBLOCK);
+		
+		if(retval != 0)
+		{
+			return retval;
+		}
+	}
+	
 	entry = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->cbuff, *f_pos, &entry_offset);
 	
-	if(entry == NULL)
+	// copy from the located entry on through the following ones until buf is full
+	while(entry != NULL && retval < count)
 	{
-		retval = 0;
-		goto out;
+		bytes_to_read = entry->size - entry_offset;	// bytes need to be read in the rest of entry
 		
+		if(bytes_to_read > count - retval)
+		{
+			bytes_to_read = count - retval;
+		}
+		
+		uncopied_bytes = copy_to_user(buf+retval, (entry->buffptr+entry_offset), bytes_to_read);
+		retval += bytes_to_read - uncopied_bytes;
+		
+		if(uncopied_bytes != 0)
+		{
+			PDEBUG("%lu bytes were not copied to user", uncopied_bytes);
+			break;
+		}
+		
+		entry = aesd_circular_buffer_next_entry(&dev->cbuff, entry);
+		entry_offset = 0;
 	}
 	
-	bytes_to_read = entry->size - entry_offset;	// bytes need to be read in the rest of entry
+	if(retval == 0 && uncopied_bytes != 0)
+	{
+		retval = -EFAULT;
+		goto out;
+	}
+	
+	*f_pos += retval;	// update f_pos position
+	
+    out:
+    	mutex_unlock(&dev->locker);
+    	return retval;
+}
+
+
+// readv() and reads through io_uring land here, every segment of the iov_iter is filled in one walk like aesd_read
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	ssize_t                       retval = 0;
+	size_t                        bytes_to_read = 0;
+	size_t                        copied_bytes = 0;
+	struct aesd_file*             file = iocb->ki_filp->private_data;
+	struct aesd_dev*              dev = file->dev;
+	struct aesd_buffer_entry*     entry = NULL;
+	size_t                        entry_offset = 0;
+	
+	PDEBUG("read_iter %zu bytes with offset %lld", iov_iter_count(to), iocb->ki_pos);
+	
+	if(mutex_lock_interruptible(&dev->locker))
+	{
+		return -ERESTARTSYS;
+	}
 	
-	if(bytes_to_read > count)
+	if(file->tail && iov_iter_count(to) > 0)
 	{
-		bytes_to_read = count;
+		retval = aesd_tail_wait(file, &iocb->ki_pos, (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT));
+		
+		if(retval != 0)
+		{
+			return retval;
+		}
 	}
 	
-	uncopied_bytes = copy_to_user(buf, (entry->buffptr+entry_offset), bytes_to_read);
+	entry = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->cbuff, iocb->ki_pos, &entry_offset);
 	
-	if(uncopied_bytes != 0)
+	while(entry != NULL && iov_iter_count(to) > 0)
+	{
+		bytes_to_read = entry->size - entry_offset;
+		copied_bytes = copy_to_iter(entry->buffptr+entry_offset, bytes_to_read, to);
+		retval += copied_bytes;
+		
+		if(copied_bytes < bytes_to_read)	// iterator full or a fault
+		{
+			break;
+		}
+		
+		entry = aesd_circular_buffer_next_entry(&dev->cbuff, entry);
+		entry_offset = 0;
+	}
+	
+	if(retval == 0 && iov_iter_count(to) > 0 && entry != NULL)
 	{
-		PDEBUG("%lu bytes were not copied to user", uncopied_bytes);
 		retval = -EFAULT;
 		goto out;
 	}
 	
-	*f_pos += bytes_to_read;	// update f_pos position
-	retval = bytes_to_read;
+	iocb->ki_pos += retval;
 	
     out:
-    	mutex_unlock(&dev->locker);
-    	return retval;
+	mutex_unlock(&dev->locker);
+	return retval;
 }
 
 
@@ -112,7 +263,8 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
                 loff_t *f_pos)
 {
 	unsigned long                 	uncopied_bytes = 0;
-	struct aesd_dev*              	dev = filp->private_data;
+	struct aesd_file*             	file = filp->private_data;
+	struct aesd_dev*              	dev = file->dev;
 	ssize_t			    	retval = -ENOMEM; 
 	char*                            newline = NULL;
 	char*				discard = NULL;
@@ -174,20 +326,172 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
 			kfree(discard);
 		}
 		
+		// then drop the oldest writes until the byte budget is met
+		while( (discard = (char*)aesd_circular_buffer_trim(&dev->cbuff)) != NULL )
+		{
+			kfree(discard);
+		}
+		
+		wake_up_interruptible(&dev->readq);	// a record is complete for tail readers
+		
 		dev->buffer_entry.size = 0;
 		dev->buffer_entry.buffptr = NULL;
 	}
 	
-	*f_pos = 0;
+	*f_pos = dev->cbuff.total_bytes;	// writes append, the file position follows the end of the device
+	file->seen_head = aesd_head(dev);
     out:
 	mutex_unlock(&dev->locker);
 	return retval;
 }
 
 
+// SEEK_SET, SEEK_CUR and SEEK_END across all bytes the circular buffer holds
+loff_t aesd_llseek(struct file *filp, loff_t off, int whence)
+{
+	struct aesd_file*             file = filp->private_data;
+	struct aesd_dev*              dev = file->dev;
+	loff_t                        retval = 0;
+	
+	PDEBUG("llseek %lld whence %d", off, whence);
+	
+	if(mutex_lock_interruptible(&dev->locker))
+	{
+		return -ERESTARTSYS;
+	}
+	
+	retval = fixed_size_llseek(filp, off, whence, dev->cbuff.total_bytes);
+	file->seen_head = aesd_head(dev);
+	
+	mutex_unlock(&dev->locker);
+	return retval;
+}
+
+
+// AESDCHAR_IOCSEEKTO moves the file position to a byte of a write command
+// AESDCHAR_IOCTAIL turns tail reads on or off for the file
+// AESDCHAR_IOCGETRANGE reports the evicted and the written bytes
+long aesd_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct aesd_file*             file = filp->private_data;
+	struct aesd_dev*              dev = file->dev;
+	struct aesd_seekto            seekto;
+	struct aesd_range             range;
+	uint32_t                      tail = 0;
+	size_t                        char_offset = 0;
+	long                          retval = 0;
+	
+	if(_IOC_TYPE(cmd) != AESD_IOC_MAGIC || _IOC_NR(cmd) > AESDCHAR_IOC_MAXNR)
+	{
+		return -ENOTTY;
+	}
+	
+	switch(cmd)
+	{
+		case AESDCHAR_IOCSEEKTO:
+			if(copy_from_user(&seekto, (const void __user *)arg, sizeof(seekto)) != 0)
+			{
+				return -EFAULT;
+			}
+			
+			PDEBUG("ioctl seekto write %u offset %u", seekto.write_cmd, seekto.write_cmd_offset);
+			
+			if(mutex_lock_interruptible(&dev->locker))
+			{
+				return -ERESTARTSYS;
+			}
+			
+			retval = aesd_circular_buffer_fpos_for_entry(&dev->cbuff, seekto.write_cmd, seekto.write_cmd_offset, &char_offset);
+			
+			if(retval == 0)
+			{
+				filp->f_pos = char_offset;
+				file->seen_head = aesd_head(dev);
+			}
+			break;
+			
+		case AESDCHAR_IOCTAIL:
+			if(copy_from_user(&tail, (const void __user *)arg, sizeof(tail)) != 0)
+			{
+				return -EFAULT;
+			}
+			
+			PDEBUG("ioctl tail %u", tail);
+			
+			if(mutex_lock_interruptible(&dev->locker))
+			{
+				return -ERESTARTSYS;
+			}
+			
+			file->tail = (tail != 0);
+			file->seen_head = aesd_head(dev);
+			break;
+			
+		case AESDCHAR_IOCGETRANGE:
+			if(mutex_lock_interruptible(&dev->locker))
+			{
+				return -ERESTARTSYS;
+			}
+			
+			range.head = aesd_head(dev);
+			range.end = dev->cbuff.end_offset;
+			mutex_unlock(&dev->locker);
+			
+			if(copy_to_user((void __user *)arg, &range, sizeof(range)) != 0)
+			{
+				return -EFAULT;
+			}
+			
+			return 0;
+			
+		default:
+			return -ENOTTY;
+	}
+	
+	mutex_unlock(&dev->locker);
+	return retval;
+}
+
+
+// writes never block, reads of a tail file are ready once f_pos is before the end of the device
+// other files always read without blocking, 0 at the end
+__poll_t aesd_poll(struct file *filp, struct poll_table_struct *wait)
+{
+	struct aesd_file*             file = filp->private_data;
+	struct aesd_dev*              dev = file->dev;
+	__poll_t                      mask = EPOLLOUT | EPOLLWRNORM;
+	loff_t                        pos = 0;
+	size_t                        end = 0;
+	size_t                        seen_head = 0;
+	bool                          tail = false;
+	
+	poll_wait(filp, &dev->readq, wait);
+	
+	// the vfs stores f_pos back after a read without dev->locker, read it once next to the rest
+	mutex_lock(&dev->locker);
+	pos = READ_ONCE(filp->f_pos);
+	end = READ_ONCE(dev->cbuff.end_offset);
+	seen_head = READ_ONCE(file->seen_head);
+	tail = READ_ONCE(file->tail);
+	mutex_unlock(&dev->locker);
+	
+	// f_pos counts from seen_head, what it points at is readable if written before the end
+	if(!tail || (long)(end - (seen_head + pos)) > 0)
+	{
+		mask |= EPOLLIN | EPOLLRDNORM;
+	}
+	
+	return mask;
+}
+
+
 struct file_operations aesd_fops = {
 	.owner =    THIS_MODULE,
 	.read =     aesd_read,
+	.read_iter = aesd_read_iter,
+	.llseek =   aesd_llseek,
+	.unlocked_ioctl = aesd_unlocked_ioctl,
+	.poll =     aesd_poll,
 	.write =    aesd_write,
 	.open =     aesd_open,
 	.release =  aesd_release,
@@ -227,13 +531,22 @@ int aesd_init_module(void)
 	 */
 	
 	mutex_init(&aesd_device.locker);
+	init_waitqueue_head(&aesd_device.readq);
 	
-	aesd_circular_buffer_init(&aesd_device.cbuff);
+	result = aesd_circular_buffer_init_size(&aesd_device.cbuff, max_entries, max_bytes);
+	
+	if( result )
+	{
+		printk(KERN_WARNING "Can't keep %u write operations\n", max_entries);
+		unregister_chrdev_region(dev, 1);
+		return result;
+	}
 	
 	result = aesd_setup_cdev(&aesd_device);
 
 	if( result )
 	{
+		aesd_circular_buffer_free(&aesd_device.cbuff);
 		unregister_chrdev_region(dev, 1);
 	}
 	
@@ -0,0 +1,301 @@
+/**
+ * @file aesd-channel.c
+ * @brief Registry of the named channels of aesdsocket
+ *
+ * Channels are only ever added, so a lookup reads the published count and scans
+ * the entries below it without a lock; the set lock is only taken to create a
+ * channel, after looking again under it.  Each channel is a plain append-only
+ * file whose length is its log offset, and its lock serializes nothing but the
+ * appends to that one file.
+ *
+ * @author Dazong Chen
+ *
+ */
+
+#define _GNU_SOURCE	// memrchr()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <syslog.h>
+#include <sys/stat.h>
+
+#include "aesd-channel.h"
+
+#define AESD_CHANNEL_BLOCK_SIZE	65536	// bytes read per pread() while looking for the last newline of a kept file
+
+
+bool aesd_channel_name_valid(const char *name, size_t len)
+{
+	size_t	i = 0;
+
+	if(len == 0 || len > AESD_CHANNEL_NAME_MAX)
+	{
+		return false;
+	}
+
+	for(i = 0; i < len; i++)
+	{
+		if(!((name[i] >= 'a' && name[i] <= 'z') || (name[i] >= 'A' && name[i] <= 'Z') ||
+		     (name[i] >= '0' && name[i] <= '9') || name[i] == '-' || name[i] == '_'))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+int aesd_channel_set_open(struct aesd_channel_set *set, const char *dir, bool keep, bool use_store,
+			  enum aesd_fanout_policy policy)
+{
+	char		path[PATH_MAX];
+	DIR		*d = NULL;
+	struct dirent	*entry = NULL;
+
+	memset(set, 0, sizeof(struct aesd_channel_set));
+	pthread_mutex_init(&set->lock, NULL);
+
+	set->dir = strdup(dir);
+	set->keep = keep;
+	set->use_store = use_store;
+	set->policy = policy;
+
+	if(set->dir == NULL)
+	{
+		return -1;
+	}
+
+	if(mkdir(dir, 0755) == -1 && errno != EEXIST)
+	{
+		return -1;
+	}
+
+	if(keep)
+	{
+		return 0;
+	}
+
+	d = opendir(dir);
+
+	if(d == NULL)
+	{
+		return -1;
+	}
+
+	// every run starts with empty channels unless they are kept
+	while((entry = readdir(d)) != NULL)
+	{
+		if(aesd_channel_name_valid(entry->d_name, strlen(entry->d_name)))
+		{
+			snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+			unlink(path);
+		}
+	}
+
+	closedir(d);
+
+	return 0;
+}
+
+
+// log offset a kept data file continues at: just past its last newline
+// a record torn by a crash is cut off, like the warm restart of the default log does
+static int aesd_channel_recover(struct aesd_channel *channel)
+{
+	struct stat	st;
+	char		*block = NULL;
+	char		*newline = NULL;
+	off_t		end = 0;
+	off_t		start = 0;
+	ssize_t		nbytes = 0;
+
+	if(fstat(channel->fd, &st) == -1)
+	{
+		return -1;
+	}
+
+	block = malloc(AESD_CHANNEL_BLOCK_SIZE);
+
+	if(block == NULL)
+	{
+		return -1;
+	}
+
+	for(end = st.st_size; end > 0 && newline == NULL; end = start)
+	{
+		start = (end > AESD_CHANNEL_BLOCK_SIZE) ? end - AESD_CHANNEL_BLOCK_SIZE : 0;
+		nbytes = pread(channel->fd, block, end - start, start);
+
+		if(nbytes != end - start)
+		{
+			free(block);
+			return -1;
+		}
+
+		newline = memrchr(block, '\n', nbytes);
+
+		if(newline != NULL)
+		{
+			channel->committed_bytes = start + (newline - block) + 1;
+		}
+	}
+
+	free(block);
+
+	if(channel->committed_bytes < st.st_size)
+	{
+		syslog(LOG_WARNING, "Dropping %lld bytes of a torn record in channel %s",
+		       (long long)(st.st_size - channel->committed_bytes), channel->name);
+
+		return ftruncate(channel->fd, channel->committed_bytes);
+	}
+
+	return 0;
+}
+
+
+// open the data file of a new channel, NULL on error
+static struct aesd_channel *aesd_channel_create(struct aesd_channel_set *set, const char *name, size_t len)
+{
+	struct aesd_channel	*channel = calloc(1, sizeof(struct aesd_channel));
+	char			path[PATH_MAX];
+
+	if(channel == NULL)
+	{
+		return NULL;
+	}
+
+	memcpy(channel->name, name, len);
+	snprintf(path, sizeof(path), "%s/%s", set->dir, channel->name);
+
+	channel->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+	if(channel->fd < 0 || aesd_channel_recover(channel) != 0)
+	{
+		syslog(LOG_ERR, "Channel %s can not be opened: %s", channel->name, strerror(errno));
+
+		if(channel->fd >= 0)
+		{
+			close(channel->fd);
+		}
+
+		free(channel);
+		return NULL;
+	}
+
+	pthread_mutex_init(&channel->lock, NULL);
+	channel->use_store = set->use_store;
+	aesd_record_store_init(&channel->store);
+	aesd_fanout_init(&channel->fanout, set->policy);
+
+	return channel;
+}
+
+
+// the channel named name among the first count channels of set, NULL if there is none
+static struct aesd_channel *aesd_channel_find(struct aesd_channel_set *set, size_t count, const char *name, size_t len)
+{
+	size_t	i = 0;
+
+	for(i = 0; i < count; i++)
+	{
+		if(strlen(set->channels[i]->name) == len && memcmp(set->channels[i]->name, name, len) == 0)
+		{
+			return set->channels[i];
+		}
+	}
+
+	return NULL;
+}
+
+
+struct aesd_channel *aesd_channel_get(struct aesd_channel_set *set, const char *name, size_t len)
+{
+	struct aesd_channel	*channel = NULL;
+
+	if(!aesd_channel_name_valid(name, len))
+	{
+		return NULL;
+	}
+
+	channel = aesd_channel_find(set, __atomic_load_n(&set->count, __ATOMIC_ACQUIRE), name, len);
+
+	if(channel != NULL)
+	{
+		return channel;
+	}
+
+	pthread_mutex_lock(&set->lock);
+
+	// another connection may have created it since the lookup
+	channel = aesd_channel_find(set, set->count, name, len);
+
+	if(channel == NULL && set->count < AESD_CHANNEL_MAX)
+	{
+		channel = aesd_channel_create(set, name, len);
+
+		if(channel != NULL)
+		{
+			set->channels[set->count] = channel;
+			__atomic_store_n(&set->count, set->count + 1, __ATOMIC_RELEASE);
+		}
+	}
+
+	else if(channel == NULL)
+	{
+		syslog(LOG_WARNING, "No room for channel %.*s, %d channels exist already", (int)len, name, AESD_CHANNEL_MAX);
+	}
+
+	pthread_mutex_unlock(&set->lock);
+
+	return channel;
+}
+
+
+size_t aesd_channel_count(struct aesd_channel_set *set)
+{
+	return __atomic_load_n(&set->count, __ATOMIC_ACQUIRE);
+}
+
+
+void aesd_channel_set_close(struct aesd_channel_set *set)
+{
+	struct aesd_channel	*channel = NULL;
+	char			path[PATH_MAX];
+	size_t			i = 0;
+
+	for(i = 0; i < set->count; i++)
+	{
+		channel = set->channels[i];
+
+		if(!set->keep)
+		{
+			snprintf(path, sizeof(path), "%s/%s", set->dir, channel->name);
+			unlink(path);
+		}
+
+		close(channel->fd);
+		aesd_record_store_free(&channel->store);
+		aesd_fanout_destroy(&channel->fanout);
+		pthread_mutex_destroy(&channel->lock);
+		free(channel);
+	}
+
+	if(set->dir != NULL && !set->keep)
+	{
+		rmdir(set->dir);
+	}
+
+	free(set->dir);
+	pthread_mutex_destroy(&set->lock);
+
+	set->dir = NULL;
+	set->count = 0;
+}
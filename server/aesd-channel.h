@@ -0,0 +1,111 @@
+/*
+ * aesd-channel.h
+ *
+ *  Named channels of aesdsocket. Every channel is a separate log with its own
+ *  data file, lock, optional in-memory record store and live tail subscribers,
+ *  so writers and readers of different channels never wait for each other.
+ *  Channels are created on first use and live until the server stops.
+ */
+
+#ifndef AESD_CHANNEL_H
+#define AESD_CHANNEL_H
+
+#include <stddef.h> // size_t
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h> // off_t
+
+#include "aesd-record-store.h"
+#include "aesd-fanout.h"
+
+#define AESD_CHANNEL_NAME_MAX    32    // channel names are 1 to 32 letters, digits, '-' or '_'
+#define AESD_CHANNEL_MAX         64    // channels a set holds at most
+
+struct aesd_channel
+{
+	char name[AESD_CHANNEL_NAME_MAX + 1];
+	/**
+	 * Serializes appends, like locker does for the default log
+	 */
+	pthread_mutex_t lock;
+	/**
+	 * Data file "<set dir>/<name>", opened for appending and read back with positioned reads
+	 */
+	int fd;
+	/**
+	 * Bytes appended to fd so far, protected by lock. Readbacks snapshot it and read up to it without the lock
+	 */
+	off_t committed_bytes;
+	/**
+	 * Readbacks are served from store instead of fd, cleared if the store could not keep up
+	 */
+	bool use_store;
+	/**
+	 * Copy of every record, appended under lock and read without it
+	 */
+	struct aesd_record_store store;
+	/**
+	 * Live tail subscribers, published to under lock
+	 */
+	struct aesd_fanout fanout;
+};
+
+struct aesd_channel_set
+{
+	/**
+	 * Directory holding one data file per channel
+	 */
+	char *dir;
+	/**
+	 * Keep the data files when the set is closed and continue with them when a channel is opened again
+	 */
+	bool keep;
+	/**
+	 * New channels mirror their records in memory, see struct aesd_channel
+	 */
+	bool use_store;
+	enum aesd_fanout_policy policy;
+	/**
+	 * Serializes the creation of channels, lookups do not take it
+	 */
+	pthread_mutex_t lock;
+	/**
+	 * Number of channels, entries below it are never changed once published
+	 */
+	size_t count;
+	struct aesd_channel *channels[AESD_CHANNEL_MAX];
+};
+
+/**
+ * Sets up @param set without channels in the directory @param dir, creating it if needed.
+ * Without @param keep the data files of an earlier run are removed.
+ * The other parameters are described in struct aesd_channel_set
+ * @return 0 on success, -1 on error
+ */
+extern int aesd_channel_set_open(struct aesd_channel_set *set, const char *dir, bool keep, bool use_store,
+				 enum aesd_fanout_policy policy);
+
+/**
+ * @return true if the @param len bytes at @param name are a valid channel name
+ */
+extern bool aesd_channel_name_valid(const char *name, size_t len);
+
+/**
+ * Finds the channel named by the @param len bytes at @param name, creating it on first use.
+ * A kept data file is continued after cutting off a torn last record
+ * @return the channel, or NULL if the name is invalid, the set is full or the data file can not be opened
+ */
+extern struct aesd_channel *aesd_channel_get(struct aesd_channel_set *set, const char *name, size_t len);
+
+/**
+ * @return the number of channels in @param set
+ */
+extern size_t aesd_channel_count(struct aesd_channel_set *set);
+
+/**
+ * Closes every channel of @param set, every subscriber must have been removed.
+ * The data files and the directory are removed unless the set is kept
+ */
+extern void aesd_channel_set_close(struct aesd_channel_set *set);
+
+#endif /* AESD_CHANNEL_H */
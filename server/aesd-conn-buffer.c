@@ -0,0 +1,206 @@
+/**
+ * @file aesd-conn-buffer.c
+ * @brief Pooled, geometrically grown receive buffers for aesdsocket connections
+ *
+ * Doubling the allocation keeps the cost of receiving a record linear in its
+ * size, and recv() always gets a large free region so big records arrive in few
+ * calls.  Newlines are found with memchr() starting where the previous search
+ * stopped, so every received byte is scanned once no matter how the record is
+ * split across recv() calls.  Buffers of finished connections go back to a small
+ * pool, so short connections do not pay for malloc() and page faults each time.
+ *
+ * @author Dazong Chen
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "aesd-conn-buffer.h"
+
+struct aesd_conn_buffer_block
+{
+	char *data;
+	size_t size;
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct aesd_conn_buffer_block pool[AESD_CONN_BUFFER_POOL_SIZE];
+static int pool_count = 0;
+
+
+void aesd_conn_buffer_init(struct aesd_conn_buffer *buffer)
+{
+	memset(buffer, 0, sizeof(struct aesd_conn_buffer));
+}
+
+
+// take the most recently released block, it is the most likely to still be cached
+static int aesd_conn_buffer_acquire(struct aesd_conn_buffer *buffer)
+{
+	pthread_mutex_lock(&pool_lock);
+
+	if(pool_count > 0)
+	{
+		pool_count--;
+		buffer->data = pool[pool_count].data;
+		buffer->size = pool[pool_count].size;
+	}
+
+	pthread_mutex_unlock(&pool_lock);
+
+	if(buffer->data == NULL)
+	{
+		buffer->data = malloc(AESD_CONN_BUFFER_INITIAL_SIZE);
+
+		if(buffer->data == NULL)
+		{
+			return -1;
+		}
+
+		buffer->size = AESD_CONN_BUFFER_INITIAL_SIZE;
+	}
+
+	return 0;
+}
+
+
+int aesd_conn_buffer_reserve(struct aesd_conn_buffer *buffer, size_t space)
+{
+	char	*data = NULL;
+	size_t	size = 0;
+
+	if(buffer->data == NULL && aesd_conn_buffer_acquire(buffer) != 0)
+	{
+		return -1;
+	}
+
+	if(buffer->size - buffer->len >= space)
+	{
+		return 0;
+	}
+
+	// move the unconsumed bytes to the front before growing
+	if(buffer->start > 0)
+	{
+		if(buffer->scanned < buffer->start)
+		{
+			buffer->scanned = buffer->start;
+		}
+
+		memmove(buffer->data, buffer->data + buffer->start, buffer->len - buffer->start);
+		buffer->len -= buffer->start;
+		buffer->scanned -= buffer->start;
+		buffer->start = 0;
+
+		if(buffer->size - buffer->len >= space)
+		{
+			return 0;
+		}
+	}
+
+	size = buffer->size;
+
+	while(size - buffer->len < space)
+	{
+		size *= 2;
+	}
+
+	data = realloc(buffer->data, size);
+
+	if(data == NULL)
+	{
+		return -1;
+	}
+
+	buffer->data = data;
+	buffer->size = size;
+
+	return 0;
+}
+
+
+void aesd_conn_buffer_commit(struct aesd_conn_buffer *buffer, size_t count)
+{
+	buffer->len += count;
+}
+
+
+size_t aesd_conn_buffer_line(struct aesd_conn_buffer *buffer)
+{
+	char	*newline = NULL;
+
+	if(buffer->data == NULL)
+	{
+		return 0;
+	}
+
+	if(buffer->scanned < buffer->start)
+	{
+		buffer->scanned = buffer->start;
+	}
+
+	newline = memchr(buffer->data + buffer->scanned, '\n', buffer->len - buffer->scanned);
+
+	if(newline == NULL)
+	{
+		buffer->scanned = buffer->len;
+		return 0;
+	}
+
+	// stay on the newline, asking again costs nothing until the line is consumed
+	buffer->scanned = newline - buffer->data;
+
+	return buffer->scanned - buffer->start + 1;
+}
+
+
+void aesd_conn_buffer_consume(struct aesd_conn_buffer *buffer, size_t count)
+{
+	buffer->start += count;
+
+	// nothing left, the next recv() can start at the front again
+	if(buffer->start == buffer->len)
+	{
+		buffer->start = 0;
+		buffer->len = 0;
+		buffer->scanned = 0;
+	}
+}
+
+
+void aesd_conn_buffer_release(struct aesd_conn_buffer *buffer)
+{
+	if(buffer->data != NULL && buffer->size <= AESD_CONN_BUFFER_POOL_KEEP)
+	{
+		pthread_mutex_lock(&pool_lock);
+
+		if(pool_count < AESD_CONN_BUFFER_POOL_SIZE)
+		{
+			pool[pool_count].data = buffer->data;
+			pool[pool_count].size = buffer->size;
+			pool_count++;
+			buffer->data = NULL;
+		}
+
+		pthread_mutex_unlock(&pool_lock);
+	}
+
+	free(buffer->data);
+	aesd_conn_buffer_init(buffer);
+}
+
+
+void aesd_conn_buffer_pool_free(void)
+{
+	pthread_mutex_lock(&pool_lock);
+
+	while(pool_count > 0)
+	{
+		pool_count--;
+		free(pool[pool_count].data);
+	}
+
+	pthread_mutex_unlock(&pool_lock);
+}
@@ -0,0 +1,81 @@
+/*
+ * aesd-conn-buffer.h
+ *
+ *  Receive buffer of one aesdsocket connection. Buffers grow geometrically,
+ *  are recycled through a shared pool when the connection ends, and find
+ *  line endings by scanning every received byte once.
+ */
+
+#ifndef AESD_CONN_BUFFER_H
+#define AESD_CONN_BUFFER_H
+
+#include <stddef.h> // size_t
+
+#define AESD_CONN_BUFFER_INITIAL_SIZE    16384        // bytes allocated for a new buffer
+#define AESD_CONN_BUFFER_MIN_SPACE       4096         // free bytes guaranteed to a recv() by aesd_conn_buffer_reserve
+#define AESD_CONN_BUFFER_POOL_SIZE       64           // released buffers kept for the next connections
+#define AESD_CONN_BUFFER_POOL_KEEP       (1 << 20)    // larger buffers are freed instead of pooled
+
+struct aesd_conn_buffer
+{
+	/**
+	 * Received bytes, NULL until the first aesd_conn_buffer_reserve
+	 */
+	char *data;
+	/**
+	 * Number of bytes allocated for data
+	 */
+	size_t size;
+	/**
+	 * Offset of the first byte not consumed yet
+	 */
+	size_t start;
+	/**
+	 * Offset just past the last received byte, data + len is where the next recv() writes
+	 */
+	size_t len;
+	/**
+	 * Offset the next newline search starts from, the bytes from start up to it hold no newline
+	 */
+	size_t scanned;
+};
+
+/**
+ * Initializes @param buffer to an empty buffer without allocating it
+ */
+extern void aesd_conn_buffer_init(struct aesd_conn_buffer *buffer);
+
+/**
+ * Makes room for at least @param space more bytes at data + len, taking a pooled buffer,
+ * dropping consumed bytes or doubling the allocation as needed
+ * @return 0 on success, -1 if memory could not be allocated
+ */
+extern int aesd_conn_buffer_reserve(struct aesd_conn_buffer *buffer, size_t space);
+
+/**
+ * Marks @param count bytes written at data + len as received
+ */
+extern void aesd_conn_buffer_commit(struct aesd_conn_buffer *buffer, size_t count);
+
+/**
+ * @return the length of the line at data + start including its newline, or 0 if no newline
+ * has been received yet. Only bytes not searched by an earlier call are scanned
+ */
+extern size_t aesd_conn_buffer_line(struct aesd_conn_buffer *buffer);
+
+/**
+ * Drops @param count bytes from the start of the unconsumed data
+ */
+extern void aesd_conn_buffer_consume(struct aesd_conn_buffer *buffer, size_t count);
+
+/**
+ * Returns the memory of @param buffer to the pool (or frees it) and empties the buffer
+ */
+extern void aesd_conn_buffer_release(struct aesd_conn_buffer *buffer);
+
+/**
+ * Frees every pooled buffer, no buffer may be released afterwards
+ */
+extern void aesd_conn_buffer_pool_free(void);
+
+#endif /* AESD_CONN_BUFFER_H */
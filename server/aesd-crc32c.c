@@ -0,0 +1,213 @@
+/**
+ * @file aesd-crc32c.c
+ * @brief CRC32C with the CPU's crc32 instructions where available
+ *
+ * The implementation is picked once, on the first call.  The hardware versions
+ * feed eight bytes per instruction; CPUs without them fall back to slicing-by-8,
+ * which looks up eight tables per eight input bytes instead of one table per byte.
+ *
+ * @author Dazong Chen
+ *
+ */
+
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#include "aesd-crc32c.h"
+
+#define AESD_CRC32C_POLY	0x82f63b78	// Castagnoli polynomial, bit reflected
+
+typedef uint32_t (*aesd_crc32c_fn)(uint32_t crc, const unsigned char *buf, size_t len);
+
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static aesd_crc32c_fn crc_fn = NULL;
+static const char *crc_name = NULL;
+static uint32_t crc_table[8][256];
+
+
+static uint32_t aesd_crc32c_sw(uint32_t crc, const unsigned char *buf, size_t len)
+{
+	uint64_t	word = 0;
+
+	while(len > 0 && ((uintptr_t)buf & 7) != 0)
+	{
+		crc = crc_table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+
+	while(len >= 8)
+	{
+		memcpy(&word, buf, 8);
+		word ^= crc;	// little endian, the low four bytes carry the running crc
+
+		crc = crc_table[7][word & 0xff] ^
+		      crc_table[6][(word >> 8) & 0xff] ^
+		      crc_table[5][(word >> 16) & 0xff] ^
+		      crc_table[4][(word >> 24) & 0xff] ^
+		      crc_table[3][(word >> 32) & 0xff] ^
+		      crc_table[2][(word >> 40) & 0xff] ^
+		      crc_table[1][(word >> 48) & 0xff] ^
+		      crc_table[0][word >> 56];
+
+		buf += 8;
+		len -= 8;
+	}
+
+	while(len > 0)
+	{
+		crc = crc_table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+
+	return crc;
+}
+
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t aesd_crc32c_hw(uint32_t crc, const unsigned char *buf, size_t len)
+{
+	uint64_t	crc64 = crc;
+	uint64_t	word = 0;
+
+	while(len > 0 && ((uintptr_t)buf & 7) != 0)
+	{
+		crc64 = _mm_crc32_u8((uint32_t)crc64, *buf++);
+		len--;
+	}
+
+	while(len >= 8)
+	{
+		memcpy(&word, buf, 8);
+		crc64 = _mm_crc32_u64(crc64, word);
+		buf += 8;
+		len -= 8;
+	}
+
+	while(len > 0)
+	{
+		crc64 = _mm_crc32_u8((uint32_t)crc64, *buf++);
+		len--;
+	}
+
+	return (uint32_t)crc64;
+}
+
+static int aesd_crc32c_hw_supported(void)
+{
+	return __builtin_cpu_supports("sse4.2");
+}
+
+#elif defined(__aarch64__)
+__attribute__((target("+crc")))
+static uint32_t aesd_crc32c_hw(uint32_t crc, const unsigned char *buf, size_t len)
+{
+	uint64_t	word = 0;
+
+	while(len > 0 && ((uintptr_t)buf & 7) != 0)
+	{
+		crc = __crc32cb(crc, *buf++);
+		len--;
+	}
+
+	while(len >= 8)
+	{
+		memcpy(&word, buf, 8);
+		crc = __crc32cd(crc, word);
+		buf += 8;
+		len -= 8;
+	}
+
+	while(len > 0)
+	{
+		crc = __crc32cb(crc, *buf++);
+		len--;
+	}
+
+	return crc;
+}
+
+static int aesd_crc32c_hw_supported(void)
+{
+	return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+
+#endif
+
+
+static void aesd_crc32c_init(void)
+{
+	uint32_t	crc = 0;
+	int		i = 0;
+	int		j = 0;
+
+	for(i = 0; i < 256; i++)
+	{
+		crc = i;
+
+		for(j = 0; j < 8; j++)
+		{
+			crc = (crc & 1) ? (crc >> 1) ^ AESD_CRC32C_POLY : crc >> 1;
+		}
+
+		crc_table[0][i] = crc;
+	}
+
+	// table k advances a byte through k more zero bytes
+	for(i = 0; i < 256; i++)
+	{
+		for(j = 1; j < 8; j++)
+		{
+			crc_table[j][i] = crc_table[0][crc_table[j - 1][i] & 0xff] ^ (crc_table[j - 1][i] >> 8);
+		}
+	}
+
+	crc_fn = aesd_crc32c_sw;
+	crc_name = "slicing-by-8";
+
+#if defined(__x86_64__)
+	if(aesd_crc32c_hw_supported())
+	{
+		crc_fn = aesd_crc32c_hw;
+		crc_name = "sse4.2";
+	}
+#elif defined(__aarch64__)
+	if(aesd_crc32c_hw_supported())
+	{
+		crc_fn = aesd_crc32c_hw;
+		crc_name = "armv8 crc";
+	}
+#endif
+}
+
+
+uint32_t aesd_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&crc_once, aesd_crc32c_init);
+
+	return ~crc_fn(~crc, buf, len);
+}
+
+
+uint32_t aesd_crc32c_fallback(uint32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&crc_once, aesd_crc32c_init);
+
+	return ~aesd_crc32c_sw(~crc, buf, len);
+}
+
+
+const char *aesd_crc32c_impl(void)
+{
+	pthread_once(&crc_once, aesd_crc32c_init);
+
+	return crc_name;
+}
@@ -0,0 +1,31 @@
+/*
+ * aesd-crc32c.h
+ *
+ *  CRC32C (Castagnoli) checksums of aesdsocket records. The SSE4.2 crc32
+ *  instruction on x86-64 or the ARMv8 CRC32 extension is used when the CPU
+ *  has it, a table driven slicing-by-8 implementation otherwise.
+ */
+
+#ifndef AESD_CRC32C_H
+#define AESD_CRC32C_H
+
+#include <stddef.h> // size_t
+#include <stdint.h>
+
+/**
+ * @return the CRC32C of @param len bytes at @param buf, continuing from @param crc
+ * (0 for the first block of a message)
+ */
+extern uint32_t aesd_crc32c(uint32_t crc, const void *buf, size_t len);
+
+/**
+ * @return the same CRC32C as aesd_crc32c, always computed with the slicing-by-8 fallback
+ */
+extern uint32_t aesd_crc32c_fallback(uint32_t crc, const void *buf, size_t len);
+
+/**
+ * @return the name of the implementation aesd_crc32c uses on this CPU
+ */
+extern const char *aesd_crc32c_impl(void);
+
+#endif /* AESD_CRC32C_H */
@@ -0,0 +1,300 @@
+/**
+ * @file aesd-fanout.c
+ * @brief Reference counted fan-out of appended records to live tail subscribers
+ *
+ * A published record is copied once.  Every subscriber gets a pointer to the copy
+ * in its own ring, which has a single producer (the publisher, serialized by the
+ * caller's log lock) and a single consumer (the connection sending to the
+ * subscriber), so neither side takes a lock to move its end.  The last subscriber
+ * to finish sending a record frees it.
+ *
+ * A subscriber is only woken through its eventfd when a record lands in its empty
+ * ring; while the ring is not empty it is still sending and picks the record up
+ * when it looks at the tail again.
+ *
+ * @author Dazong Chen
+ *
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "aesd-fanout.h"
+
+#define AESD_FANOUT_MASK	(AESD_FANOUT_QUEUE_RECORDS - 1)
+
+
+static void aesd_fanout_record_put(struct aesd_fanout_record *record)
+{
+	if(__atomic_sub_fetch(&record->refs, 1, __ATOMIC_ACQ_REL) == 0)
+	{
+		free(record);
+	}
+}
+
+
+static void aesd_fanout_wake(struct aesd_fanout_subscriber *subscriber)
+{
+	uint64_t	one = 1;
+
+	// only fails once the counter is about to overflow, the subscriber is awake then anyway
+	if(write(subscriber->event_fd, &one, sizeof(one)) != sizeof(one))
+	{
+		syslog(LOG_DEBUG, "Subscriber wake-up skipped: %s", strerror(errno));
+	}
+}
+
+
+void aesd_fanout_init(struct aesd_fanout *fanout, enum aesd_fanout_policy policy)
+{
+	fanout->policy = policy;
+	pthread_mutex_init(&fanout->lock, NULL);
+	LIST_INIT(&fanout->subscribers);
+}
+
+
+struct aesd_fanout_subscriber *aesd_fanout_subscribe(struct aesd_fanout *fanout)
+{
+	struct aesd_fanout_subscriber	*subscriber = calloc(1, sizeof(struct aesd_fanout_subscriber));
+
+	if(subscriber == NULL)
+	{
+		return NULL;
+	}
+
+	subscriber->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if(subscriber->event_fd == -1)
+	{
+		free(subscriber);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&fanout->lock);
+	LIST_INSERT_HEAD(&fanout->subscribers, subscriber, entries);
+	pthread_mutex_unlock(&fanout->lock);
+
+	return subscriber;
+}
+
+
+void aesd_fanout_unsubscribe(struct aesd_fanout *fanout, struct aesd_fanout_subscriber *subscriber)
+{
+	size_t	head = 0;
+
+	pthread_mutex_lock(&fanout->lock);
+	LIST_REMOVE(subscriber, entries);
+	pthread_mutex_unlock(&fanout->lock);
+
+	// the publisher no longer sees the ring, whatever it queued is released here
+	for(head = subscriber->head; head != subscriber->tail; head++)
+	{
+		aesd_fanout_record_put(subscriber->queue[head & AESD_FANOUT_MASK]);
+	}
+
+	if(subscriber->dropped > 0)
+	{
+		syslog(LOG_INFO, "Subscriber left after %lu records were dropped for it", subscriber->dropped);
+	}
+
+	close(subscriber->event_fd);
+	free(subscriber);
+}
+
+
+// queue record for one subscriber, NULL when the copy could not be allocated
+// return false if the record was dropped or the subscriber cut off
+static bool aesd_fanout_queue(struct aesd_fanout *fanout, struct aesd_fanout_subscriber *subscriber,
+			      struct aesd_fanout_record *record)
+{
+	size_t	head = __atomic_load_n(&subscriber->head, __ATOMIC_ACQUIRE);
+	size_t	tail = subscriber->tail;
+	size_t	queued = __atomic_load_n(&subscriber->queued_bytes, __ATOMIC_RELAXED);
+
+	if(subscriber->cut_off)
+	{
+		return false;
+	}
+
+	if(record == NULL || tail - head == AESD_FANOUT_QUEUE_RECORDS ||
+	   (tail != head && queued + record->len > AESD_FANOUT_QUEUE_BYTES))
+	{
+		if(fanout->policy == AESD_FANOUT_DROP)
+		{
+			subscriber->dropped++;
+			return false;
+		}
+
+		__atomic_store_n(&subscriber->cut_off, true, __ATOMIC_RELEASE);
+		aesd_fanout_wake(subscriber);
+		return false;
+	}
+
+	__atomic_add_fetch(&record->refs, 1, __ATOMIC_RELAXED);
+	subscriber->queue[tail & AESD_FANOUT_MASK] = record;
+	__atomic_add_fetch(&subscriber->queued_bytes, record->len, __ATOMIC_RELAXED);
+	__atomic_store_n(&subscriber->tail, tail + 1, __ATOMIC_RELEASE);
+
+	if(tail == head)
+	{
+		aesd_fanout_wake(subscriber);
+	}
+
+	return true;
+}
+
+
+size_t aesd_fanout_publish(struct aesd_fanout *fanout, const char *buf, size_t len)
+{
+	struct aesd_fanout_subscriber	*subscriber = NULL;
+	struct aesd_fanout_record	*record = NULL;
+	size_t				dropped = 0;
+
+	if(len == 0)
+	{
+		return 0;
+	}
+
+	pthread_mutex_lock(&fanout->lock);
+
+	if(LIST_EMPTY(&fanout->subscribers))
+	{
+		pthread_mutex_unlock(&fanout->lock);
+		return 0;
+	}
+
+	// the publisher holds one reference until every queue has its own
+	record = malloc(sizeof(struct aesd_fanout_record) + len);
+
+	if(record != NULL)
+	{
+		record->refs = 1;
+		record->len = len;
+		memcpy(record->data, buf, len);
+	}
+
+	LIST_FOREACH(subscriber, &fanout->subscribers, entries)
+	{
+		if(!aesd_fanout_queue(fanout, subscriber, record))
+		{
+			dropped++;
+		}
+	}
+
+	pthread_mutex_unlock(&fanout->lock);
+
+	if(record != NULL)
+	{
+		aesd_fanout_record_put(record);
+	}
+
+	return dropped;
+}
+
+
+// drop the references of the records nbytes fully covers, starting nbytes into the record at head
+static void aesd_fanout_advance(struct aesd_fanout_subscriber *subscriber, size_t nbytes)
+{
+	struct aesd_fanout_record	*record = NULL;
+	size_t				head = subscriber->head;
+	size_t				left = 0;
+
+	while(nbytes > 0)
+	{
+		record = subscriber->queue[head & AESD_FANOUT_MASK];
+		left = record->len - subscriber->sent;
+
+		if(nbytes < left)
+		{
+			subscriber->sent += nbytes;
+			break;
+		}
+
+		nbytes -= left;
+		subscriber->sent = 0;
+		head++;
+
+		__atomic_sub_fetch(&subscriber->queued_bytes, record->len, __ATOMIC_RELAXED);
+		aesd_fanout_record_put(record);
+	}
+
+	// the slots are free for the publisher once head moves past them
+	__atomic_store_n(&subscriber->head, head, __ATOMIC_RELEASE);
+}
+
+
+int aesd_fanout_send(struct aesd_fanout_subscriber *subscriber, int fd, int flags)
+{
+	struct aesd_fanout_record	*record = NULL;
+	struct iovec			iov[AESD_FANOUT_SEND_RECORDS];
+	struct msghdr			msg;
+	uint64_t			events = 0;
+	size_t				head = 0;
+	size_t				tail = 0;
+	size_t				count = 0;
+	ssize_t				nbytes = 0;
+
+	// cleared before the ring is looked at, a record queued after the look wakes the subscriber again
+	if(read(subscriber->event_fd, &events, sizeof(events)) == -1 && errno != EAGAIN)
+	{
+		return -1;
+	}
+
+	while(1)
+	{
+		if(__atomic_load_n(&subscriber->cut_off, __ATOMIC_ACQUIRE))
+		{
+			errno = ENOBUFS;
+			return -1;
+		}
+
+		head = subscriber->head;
+		tail = __atomic_load_n(&subscriber->tail, __ATOMIC_ACQUIRE);
+
+		if(head == tail)
+		{
+			return 1;
+		}
+
+		for(count = 0; head != tail && count < AESD_FANOUT_SEND_RECORDS; head++, count++)
+		{
+			record = subscriber->queue[head & AESD_FANOUT_MASK];
+			iov[count].iov_base = record->data;
+			iov[count].iov_len = record->len;
+		}
+
+		iov[0].iov_base = (char *)iov[0].iov_base + subscriber->sent;
+		iov[0].iov_len -= subscriber->sent;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+
+		nbytes = sendmsg(fd, &msg, flags | MSG_NOSIGNAL);
+
+		if(nbytes == -1)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+		}
+
+		aesd_fanout_advance(subscriber, nbytes);
+	}
+}
+
+
+void aesd_fanout_destroy(struct aesd_fanout *fanout)
+{
+	pthread_mutex_destroy(&fanout->lock);
+}
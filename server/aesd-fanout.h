@@ -0,0 +1,119 @@
+/*
+ * aesd-fanout.h
+ *
+ *  Live tail of the aesdsocket log. Every appended record is copied once into a
+ *  reference counted buffer and queued for each subscriber, which sends it at
+ *  its own pace. A subscriber that falls too far behind has records dropped or
+ *  is disconnected, so a slow reader never holds back the writers or the other
+ *  readers.
+ */
+
+#ifndef AESD_FANOUT_H
+#define AESD_FANOUT_H
+
+#include <stddef.h> // size_t
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/queue.h>
+
+#define AESD_FANOUT_QUEUE_RECORDS    1024         // records queued per subscriber, a power of two
+#define AESD_FANOUT_QUEUE_BYTES      (8 << 20)    // bytes queued per subscriber, a single larger record still fits an empty queue
+#define AESD_FANOUT_SEND_RECORDS     64           // records gathered per sendmsg()
+
+enum aesd_fanout_policy
+{
+	AESD_FANOUT_DISCONNECT,		// a subscriber whose queue is full is cut off, it can catch up with a since command
+	AESD_FANOUT_DROP		// records that do not fit a subscriber's queue are skipped for it
+};
+
+struct aesd_fanout_record
+{
+	/**
+	 * One reference per queue holding the record, freed when the last one is sent
+	 */
+	unsigned int refs;
+	size_t len;
+	char data[];
+};
+
+struct aesd_fanout_subscriber
+{
+	/**
+	 * Readable whenever records were queued into an empty queue or the subscriber was cut off
+	 */
+	int event_fd;
+	/**
+	 * Next queue slot to send, only moved by the subscriber
+	 */
+	size_t head;
+	/**
+	 * Next free queue slot, only moved by the publisher
+	 */
+	size_t tail;
+	/**
+	 * Bytes of the queued records, including the part of the head record already sent
+	 */
+	size_t queued_bytes;
+	/**
+	 * Bytes of the record at head already sent
+	 */
+	size_t sent;
+	/**
+	 * Records skipped under AESD_FANOUT_DROP
+	 */
+	unsigned long dropped;
+	/**
+	 * Set under AESD_FANOUT_DISCONNECT once the queue overflowed, nothing is queued afterwards
+	 */
+	bool cut_off;
+	struct aesd_fanout_record *queue[AESD_FANOUT_QUEUE_RECORDS];
+	LIST_ENTRY(aesd_fanout_subscriber) entries;
+};
+
+struct aesd_fanout
+{
+	enum aesd_fanout_policy policy;
+	/**
+	 * Protects the subscriber list, publishers must be serialized by the caller
+	 */
+	pthread_mutex_t lock;
+	LIST_HEAD(aesd_fanout_list, aesd_fanout_subscriber) subscribers;
+};
+
+/**
+ * Sets up @param fanout without subscribers, full queues are handled according to @param policy
+ */
+extern void aesd_fanout_init(struct aesd_fanout *fanout, enum aesd_fanout_policy policy);
+
+/**
+ * Adds a subscriber that receives every record published from now on. The caller has to
+ * serialize this with aesd_fanout_publish to know which record is the first one it gets
+ * @return the subscriber, or NULL on error
+ */
+extern struct aesd_fanout_subscriber *aesd_fanout_subscribe(struct aesd_fanout *fanout);
+
+/**
+ * Removes @param subscriber from @param fanout, releases the records still queued for it and frees it
+ */
+extern void aesd_fanout_unsubscribe(struct aesd_fanout *fanout, struct aesd_fanout_subscriber *subscriber);
+
+/**
+ * Queues a copy of the @param len bytes at @param buf for every subscriber, the copy is shared by all of them
+ * @return the number of subscribers the record was dropped for or that were cut off
+ */
+extern size_t aesd_fanout_publish(struct aesd_fanout *fanout, const char *buf, size_t len);
+
+/**
+ * Sends the records queued for @param subscriber to @param fd, with @param flags added to every sendmsg().
+ * Clears subscriber->event_fd first, so call it every time that descriptor becomes readable
+ * @return 1 once the queue is empty, 0 if the socket would block with records left and -1 if the
+ * socket failed or the subscriber was cut off
+ */
+extern int aesd_fanout_send(struct aesd_fanout_subscriber *subscriber, int fd, int flags);
+
+/**
+ * Releases @param fanout, every subscriber must have been removed
+ */
+extern void aesd_fanout_destroy(struct aesd_fanout *fanout);
+
+#endif /* AESD_FANOUT_H */
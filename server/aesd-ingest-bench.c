@@ -0,0 +1,226 @@
+/***********************************************************
+* Author: Dazong Chen
+* Date: 10.17.2026
+* Ingest microbenchmark for aesdsocket receive buffers
+*
+* Feeds records of 1 KB to 100 MB through the pooled connection buffer the
+* way aesdsocket receives them, one recv() sized chunk at a time, and through
+* the previous scheme (500 byte recv(), strchr() over every chunk and a copy
+* into a buffer grown 500 bytes at a time) for comparison.
+* No sockets are involved, the numbers are the buffer handling cost alone.
+***********************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "aesd-conn-buffer.h"
+
+
+#define       RECV_SIZE              65536                 // bytes a recv() typically returns on a busy loopback socket
+#define       LEGACY_BUFFER_SIZE     500                   // recv() size and growth step of the previous scheme
+#define       LEGACY_MAX_RECORD      (1024 * 1024)         // the quadratic scheme takes minutes past this
+#define       BENCH_BYTES            (256 * 1024 * 1024)   // bytes ingested per measurement, at least one record
+#define       MAX_RECORD             (100 * 1024 * 1024)
+
+
+static const size_t record_sizes[] = { 1024, 10 * 1024, 100 * 1024, 1024 * 1024, 10 * 1024 * 1024, MAX_RECORD };
+
+
+static uint64_t now_ns(void);
+static int ingest_pooled(const char* record, size_t len);
+static int ingest_legacy(const char* record, size_t len);
+
+
+int main(int argc, char *argv[])
+{
+    char*           record = NULL;
+    size_t          len = 0;
+    size_t          runs = 0;
+    size_t          legacy_runs = 0;
+    size_t          run = 0;
+    size_t          i = 0;
+    uint64_t        start = 0;
+    double          pooled_ns = 0;
+    double          legacy_ns = 0;
+
+    record = malloc(MAX_RECORD);
+
+    if(record == NULL)
+    {
+        printf("failed to allocate records\n");
+        return -1;
+    }
+
+    memset(record, 'x', MAX_RECORD);
+
+    printf("%12s %8s %16s %12s %16s %12s\n", "record_bytes", "runs", "pooled_us/rec", "pooled_MB/s", "legacy_us/rec", "legacy_MB/s");
+
+    for(i = 0; i < sizeof(record_sizes)/sizeof(record_sizes[0]); i++)
+    {
+        len = record_sizes[i];
+        record[len-1] = '\n';
+        runs = (BENCH_BYTES / len > 0) ? BENCH_BYTES / len : 1;
+
+        start = now_ns();
+
+        for(run = 0; run < runs; run++)
+        {
+            if(ingest_pooled(record, len) != 0)
+            {
+                printf("pooled ingest failed\n");
+                return -1;
+            }
+        }
+
+        pooled_ns = (double)(now_ns() - start) / runs;
+        legacy_ns = 0;
+
+        if(len <= LEGACY_MAX_RECORD)
+        {
+            // the legacy scheme is far slower, a tenth of the runs is plenty
+            legacy_runs = (runs / 10 > 0) ? runs / 10 : 1;
+            start = now_ns();
+
+            for(run = 0; run < legacy_runs; run++)
+            {
+                if(ingest_legacy(record, len) != 0)
+                {
+                    printf("legacy ingest failed\n");
+                    return -1;
+                }
+            }
+
+            legacy_ns = (double)(now_ns() - start) / legacy_runs;
+        }
+
+        record[len-1] = 'x';
+
+        if(legacy_ns > 0)
+        {
+            printf("%12zu %8zu %16.2f %12.1f %16.2f %12.1f\n", len, runs, pooled_ns / 1e3, len * 1e3 / pooled_ns,
+                   legacy_ns / 1e3, len * 1e3 / legacy_ns);
+        }
+
+        else
+        {
+            printf("%12zu %8zu %16.2f %12.1f %16s %12s\n", len, runs, pooled_ns / 1e3, len * 1e3 / pooled_ns, "skipped", "-");
+        }
+    }
+
+    free(record);
+    aesd_conn_buffer_pool_free();
+
+    return 0;
+}
+
+
+// one connection receiving one record the way aesdsocket does now
+static int ingest_pooled(const char* record, size_t len)
+{
+    struct aesd_conn_buffer    buffer;
+    size_t                     received = 0;
+    size_t                     chunk = 0;
+    size_t                     line_len = 0;
+
+    aesd_conn_buffer_init(&buffer);
+
+    while(line_len == 0 && received < len)
+    {
+        if(aesd_conn_buffer_reserve(&buffer, AESD_CONN_BUFFER_MIN_SPACE) != 0)
+        {
+            return -1;
+        }
+
+        chunk = buffer.size - buffer.len;
+
+        if(chunk > RECV_SIZE)
+        {
+            chunk = RECV_SIZE;
+        }
+
+        if(chunk > len - received)
+        {
+            chunk = len - received;
+        }
+
+        memcpy(buffer.data + buffer.len, record + received, chunk);    // stands in for recv()
+        aesd_conn_buffer_commit(&buffer, chunk);
+        received += chunk;
+
+        line_len = aesd_conn_buffer_line(&buffer);
+    }
+
+    aesd_conn_buffer_consume(&buffer, line_len);
+    aesd_conn_buffer_release(&buffer);
+
+    return (line_len == len) ? 0 : -1;
+}
+
+
+// one connection receiving one record the way send_receive_packet used to
+static int ingest_legacy(const char* record, size_t len)
+{
+    char      buf[LEGACY_BUFFER_SIZE];
+    char*     read_buf = malloc(LEGACY_BUFFER_SIZE);
+    char*     tmp = NULL;
+    size_t    read_size = LEGACY_BUFFER_SIZE;
+    size_t    read_len = 0;
+    size_t    chunk = 0;
+    int       newline = 0;
+
+    if(read_buf == NULL)
+    {
+        return -1;
+    }
+
+    while(!newline && read_len < len)
+    {
+        chunk = LEGACY_BUFFER_SIZE - 1;
+
+        if(chunk > len - read_len)
+        {
+            chunk = len - read_len;
+        }
+
+        memcpy(buf, record + read_len, chunk);    // stands in for recv()
+        buf[chunk] = 0;
+        newline = (strchr(buf, '\n') != NULL);
+
+        // grown one step at a time, the old contents copied into a fresh allocation each time
+        if(read_len + chunk >= read_size)
+        {
+            tmp = malloc(read_size + LEGACY_BUFFER_SIZE);
+
+            if(tmp == NULL)
+            {
+                free(read_buf);
+                return -1;
+            }
+
+            memcpy(tmp, read_buf, read_size);
+            free(read_buf);
+            read_buf = tmp;
+            read_size += LEGACY_BUFFER_SIZE;
+        }
+
+        memcpy(read_buf + read_len, buf, chunk);
+        read_len += chunk;
+    }
+
+    free(read_buf);
+
+    return newline ? 0 : -1;
+}
+
+
+static uint64_t now_ns(void)
+{
+    struct timespec    ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
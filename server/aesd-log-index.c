@@ -0,0 +1,299 @@
+/**
+ * @file aesd-log-index.c
+ * @brief Sidecar record index with per-record CRC32C for aesdsocket warm restarts
+ *
+ * The index file is a small header followed by one aesd_log_index_entry per append.
+ * Writers stage the entries of the appends they commit together and write them with
+ * one write() before acknowledging any, so an entry exists for every byte a client
+ * was told about, with the boundaries the appender wrote.  Recovery trusts every
+ * entry before the newest one, checks the CRC32C of that one and cuts whatever the
+ * data file holds past it, so its cost does not depend on the size of the log.
+ *
+ * @author Dazong Chen
+ *
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/stat.h>
+
+#include "aesd-log-index.h"
+#include "aesd-crc32c.h"
+
+#define AESD_LOG_INDEX_BLOCK_SIZE	65536	// bytes of the data file read per pread() while recovering
+
+
+static int aesd_log_index_push(struct aesd_log_index *index, off_t offset, size_t size, uint32_t crc)
+{
+	index->pending[index->pending_count].offset = offset;
+	index->pending[index->pending_count].size = size;
+	index->pending[index->pending_count].crc = crc;
+	index->pending_count++;
+	index->count++;
+	index->end = offset + size;
+
+	if(index->pending_count == AESD_LOG_INDEX_PENDING)
+	{
+		return aesd_log_index_flush(index);
+	}
+
+	return 0;
+}
+
+
+int aesd_log_index_flush(struct aesd_log_index *index)
+{
+	const char	*buf = (const char *)index->pending;
+	size_t		len = index->pending_count * sizeof(struct aesd_log_index_entry);
+	ssize_t		nbytes = 0;
+
+	while(len > 0)
+	{
+		nbytes = write(index->fd, buf, len);
+
+		if(nbytes == -1)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+
+			return -1;
+		}
+
+		buf += nbytes;
+		len -= nbytes;
+	}
+
+	index->pending_count = 0;
+
+	return 0;
+}
+
+
+int aesd_log_index_add(struct aesd_log_index *index, const char *buf, size_t len)
+{
+	size_t	size = 0;
+
+	while(len > 0)
+	{
+		size = (len > index->max_record) ? index->max_record : len;
+
+		if(aesd_log_index_push(index, index->end, size, aesd_crc32c(0, buf, size)) != 0)
+		{
+			return -1;
+		}
+
+		buf += size;
+		len -= size;
+	}
+
+	return 0;
+}
+
+
+// CRC32C of size bytes of the data file starting at file offset offset
+// return 0 on success, -1 if the data file is shorter or can not be read
+static int aesd_log_index_crc(int data_fd, off_t offset, size_t size, char *block, uint32_t *crc)
+{
+	ssize_t	nbytes = 0;
+	size_t	to_read = 0;
+
+	*crc = 0;
+
+	while(size > 0)
+	{
+		to_read = (size > AESD_LOG_INDEX_BLOCK_SIZE) ? AESD_LOG_INDEX_BLOCK_SIZE : size;
+		nbytes = pread(data_fd, block, to_read, offset);
+
+		if(nbytes == -1 && errno == EINTR)
+		{
+			continue;
+		}
+
+		if(nbytes <= 0)
+		{
+			return -1;
+		}
+
+		*crc = aesd_crc32c(*crc, block, nbytes);
+		offset += nbytes;
+		size -= nbytes;
+	}
+
+	return 0;
+}
+
+
+// index a data file written without an index, e.g. before warm restarts were enabled
+// its append boundaries are unknown, so everything it holds is kept as entries of the longest size one covers
+static int aesd_log_index_adopt(struct aesd_log_index *index, int data_fd, off_t data_size, char *block)
+{
+	off_t		offset = 0;
+	size_t		size = 0;
+	uint32_t	crc = 0;
+
+	if(data_size > 0)
+	{
+		syslog(LOG_NOTICE, "Indexing %lld bytes written without an index", (long long)data_size);
+	}
+
+	while(offset < data_size)
+	{
+		size = (data_size - offset > (off_t)index->max_record) ? index->max_record : (size_t)(data_size - offset);
+
+		if(aesd_log_index_crc(data_fd, offset, size, block, &crc) != 0 ||
+		   aesd_log_index_push(index, index->base + offset, size, crc) != 0)
+		{
+			return -1;
+		}
+
+		offset += size;
+	}
+
+	return aesd_log_index_flush(index);
+}
+
+
+// the newest entry of the index file whose record is intact in the data file
+// entries past it are dropped from the file, they describe data that never made it to disk
+static int aesd_log_index_checkpoint(struct aesd_log_index *index, int data_fd, off_t data_size, char *block)
+{
+	struct aesd_log_index_header	header;
+	struct aesd_log_index_entry	entry;
+	struct stat			st;
+	size_t				count = 0;
+	uint32_t			crc = 0;
+	bool				valid = false;
+
+	if(fstat(index->fd, &st) == -1)
+	{
+		return -1;
+	}
+
+	valid = (st.st_size >= (off_t)sizeof(header) && pread(index->fd, &header, sizeof(header), 0) == sizeof(header) &&
+		 memcmp(header.magic, AESD_LOG_INDEX_MAGIC, sizeof(header.magic)) == 0 && header.base == (uint64_t)index->base);
+
+	if(valid)
+	{
+		count = (st.st_size - sizeof(header)) / sizeof(struct aesd_log_index_entry);
+	}
+
+	while(count > 0)
+	{
+		if(pread(index->fd, &entry, sizeof(entry), sizeof(header) + (count - 1) * sizeof(entry)) != sizeof(entry))
+		{
+			return -1;
+		}
+
+		if(entry.offset >= (uint64_t)index->base && entry.offset - index->base + entry.size <= (uint64_t)data_size &&
+		   aesd_log_index_crc(data_fd, entry.offset - index->base, entry.size, block, &crc) == 0 && crc == entry.crc)
+		{
+			break;
+		}
+
+		syslog(LOG_WARNING, "Index entry %zu does not match the data file, dropped", count - 1);
+		count--;
+	}
+
+	if(count > 0)
+	{
+		index->end = entry.offset + entry.size;
+	}
+
+	else
+	{
+		index->end = index->base;
+
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, AESD_LOG_INDEX_MAGIC, sizeof(header.magic));
+		header.base = index->base;
+
+		// the file is opened with O_APPEND, an empty file puts the header at the front
+		if(ftruncate(index->fd, 0) == -1 || write(index->fd, &header, sizeof(header)) != sizeof(header))
+		{
+			return -1;
+		}
+	}
+
+	index->count = count;
+
+	if(ftruncate(index->fd, sizeof(header) + count * sizeof(struct aesd_log_index_entry)) == -1)
+	{
+		return -1;
+	}
+
+	return valid ? 0 : aesd_log_index_adopt(index, data_fd, data_size, block);
+}
+
+
+// every append is indexed before it is acknowledged or read back, so the bytes after the newest
+// intact entry belong to an append the server did not finish, a torn write or one whose entry never
+// reached the index file. Both are cut from the data file
+static int aesd_log_index_truncate(struct aesd_log_index *index, int data_fd, off_t data_size)
+{
+	off_t	end = index->end - index->base;
+
+	if(end < data_size)
+	{
+		syslog(LOG_WARNING, "Dropping %lld bytes of an unfinished append", (long long)(data_size - end));
+
+		return ftruncate(data_fd, end);
+	}
+
+	return 0;
+}
+
+
+int aesd_log_index_open(struct aesd_log_index *index, const char *path, int data_fd, off_t base)
+{
+	struct stat	st;
+	char		*block = NULL;
+	int		rc = -1;
+
+	memset(index, 0, sizeof(struct aesd_log_index));
+	index->base = base;
+	index->end = base;
+	index->max_record = AESD_LOG_INDEX_MAX_RECORD;
+	index->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	block = malloc(AESD_LOG_INDEX_BLOCK_SIZE);
+
+	if(index->fd >= 0 && block != NULL && fstat(data_fd, &st) == 0 &&
+	   aesd_log_index_checkpoint(index, data_fd, st.st_size, block) == 0 &&
+	   aesd_log_index_truncate(index, data_fd, st.st_size) == 0)
+	{
+		rc = 0;
+	}
+
+	free(block);
+
+	if(rc != 0 && index->fd >= 0)
+	{
+		close(index->fd);
+		index->fd = -1;
+	}
+
+	return rc;
+}
+
+
+void aesd_log_index_close(struct aesd_log_index *index)
+{
+	if(index->fd < 0)
+	{
+		return;
+	}
+
+	if(aesd_log_index_flush(index) != 0)
+	{
+		syslog(LOG_ERR, "Index checkpoint failed: %s", strerror(errno));
+	}
+
+	close(index->fd);
+	index->fd = -1;
+}
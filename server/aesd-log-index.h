@@ -0,0 +1,108 @@
+/*
+ * aesd-log-index.h
+ *
+ *  Sidecar index of an aesdsocket data file, kept for warm restarts. Every
+ *  append to the data file gets a fixed size entry with its log offset, size
+ *  and CRC32C. The entries of the appends committed together are written with
+ *  one write() before any of them is acknowledged or read back, so on restart
+ *  only the newest entry is verified and the bytes after it, an append the
+ *  server did not finish, are cut.
+ */
+
+#ifndef AESD_LOG_INDEX_H
+#define AESD_LOG_INDEX_H
+
+#include <stddef.h> // size_t
+#include <stdint.h>
+#include <sys/types.h> // off_t
+
+#define AESD_LOG_INDEX_MAGIC             "AESDIDX1"    // first bytes of every index file
+#define AESD_LOG_INDEX_PENDING           256           // entries staged between two flushes, more are written early
+#define AESD_LOG_INDEX_MAX_RECORD        UINT32_MAX    // longest append one entry covers
+
+struct aesd_log_index_entry
+{
+	/**
+	 * Log offset of the first byte of the record
+	 */
+	uint64_t offset;
+	/**
+	 * Number of bytes in the record
+	 */
+	uint32_t size;
+	/**
+	 * CRC32C of the record bytes
+	 */
+	uint32_t crc;
+};
+
+struct aesd_log_index_header
+{
+	char magic[8];
+	/**
+	 * Log offset of the first byte of the data file
+	 */
+	uint64_t base;
+};
+
+struct aesd_log_index
+{
+	/**
+	 * Index file, -1 while the index is closed
+	 */
+	int fd;
+	/**
+	 * Log offset of the first byte of the data file
+	 */
+	off_t base;
+	/**
+	 * Log offset just past the last indexed record
+	 */
+	off_t end;
+	/**
+	 * Entries not appended to the index file yet
+	 */
+	struct aesd_log_index_entry pending[AESD_LOG_INDEX_PENDING];
+	/**
+	 * Number of entries in pending
+	 */
+	size_t pending_count;
+	/**
+	 * Longest append one entry covers, AESD_LOG_INDEX_MAX_RECORD unless lowered after
+	 * aesd_log_index_open(). Longer appends are indexed as several entries
+	 */
+	size_t max_record;
+	/**
+	 * Number of entries, written or pending
+	 */
+	size_t count;
+};
+
+/**
+ * Opens or creates the index at @param path for the data file @param data_fd, whose first byte is
+ * at log offset @param base. The newest entry is verified against its CRC32C, walking back over
+ * entries the data file does not match, and the data file is truncated to the end of the newest
+ * intact entry: the bytes after it were never flushed to the index, so never acknowledged.
+ * @return 0 on success, -1 on error. index->end is the log offset the next append starts at
+ */
+extern int aesd_log_index_open(struct aesd_log_index *index, const char *path, int data_fd, off_t base);
+
+/**
+ * Indexes the @param len bytes at @param buf just appended to the data file. The entry stays pending
+ * until aesd_log_index_flush(), which has to be called before the append is acknowledged
+ * @return 0 on success, -1 if a full set of pending entries could not be written to the index file
+ */
+extern int aesd_log_index_add(struct aesd_log_index *index, const char *buf, size_t len);
+
+/**
+ * Appends the pending entries of @param index to its file, the appends they cover survive a restart
+ * @return 0 on success, -1 on error
+ */
+extern int aesd_log_index_flush(struct aesd_log_index *index);
+
+/**
+ * Flushes and closes @param index
+ */
+extern void aesd_log_index_close(struct aesd_log_index *index);
+
+#endif /* AESD_LOG_INDEX_H */
@@ -0,0 +1,200 @@
+/**
+ * @file aesd-match.c
+ * @brief Vectorized substring search used by the filtered readbacks
+ *
+ * One vector compare of the first pattern byte and one of the last pattern byte,
+ * loaded pattern length - 1 bytes further, leave a bit mask of the positions where
+ * both match.  Only those candidates are checked with memcmp(), so ordinary text is
+ * skipped 16 or 32 bytes per step no matter how long the pattern is.  The bytes
+ * after the last full vector are left to memmem().
+ *
+ * @author Dazong Chen
+ *
+ */
+
+#define _GNU_SOURCE	// memmem()
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "aesd-match.h"
+
+typedef const char *(*aesd_match_fn)(const struct aesd_match *match, const char *buf, size_t len);
+
+static pthread_once_t match_once = PTHREAD_ONCE_INIT;
+static aesd_match_fn match_fn = NULL;
+static const char *match_name = NULL;
+
+
+int aesd_match_init(struct aesd_match *match, const char *pattern, size_t len)
+{
+	if(len == 0 || len > AESD_MATCH_MAX_PATTERN)
+	{
+		return -1;
+	}
+
+	match->len = len;
+	memcpy(match->pattern, pattern, len);
+
+	return 0;
+}
+
+
+static const char *aesd_match_sw(const struct aesd_match *match, const char *buf, size_t len)
+{
+	return memmem(buf, len, match->pattern, match->len);
+}
+
+
+#if defined(__x86_64__)
+// SSE2 is part of x86-64, this is the baseline when AVX2 is missing
+static const char *aesd_match_sse2(const struct aesd_match *match, const char *buf, size_t len)
+{
+	const __m128i	first = _mm_set1_epi8(match->pattern[0]);
+	const __m128i	last = _mm_set1_epi8(match->pattern[match->len - 1]);
+	__m128i		eq_first;
+	__m128i		eq_last;
+	unsigned int	mask = 0;
+	unsigned int	bit = 0;
+	size_t		i = 0;
+
+	for(i = 0; i + match->len - 1 + 16 <= len; i += 16)
+	{
+		eq_first = _mm_cmpeq_epi8(first, _mm_loadu_si128((const __m128i *)(buf + i)));
+		eq_last = _mm_cmpeq_epi8(last, _mm_loadu_si128((const __m128i *)(buf + i + match->len - 1)));
+		mask = _mm_movemask_epi8(_mm_and_si128(eq_first, eq_last));
+
+		while(mask != 0)
+		{
+			bit = __builtin_ctz(mask);
+
+			if(memcmp(buf + i + bit + 1, match->pattern + 1, match->len - 2) == 0)
+			{
+				return buf + i + bit;
+			}
+
+			mask &= mask - 1;
+		}
+	}
+
+	return aesd_match_sw(match, buf + i, len - i);
+}
+
+
+__attribute__((target("avx2")))
+static const char *aesd_match_avx2(const struct aesd_match *match, const char *buf, size_t len)
+{
+	const __m256i	first = _mm256_set1_epi8(match->pattern[0]);
+	const __m256i	last = _mm256_set1_epi8(match->pattern[match->len - 1]);
+	__m256i		eq_first;
+	__m256i		eq_last;
+	uint32_t	mask = 0;
+	unsigned int	bit = 0;
+	size_t		i = 0;
+
+	for(i = 0; i + match->len - 1 + 32 <= len; i += 32)
+	{
+		eq_first = _mm256_cmpeq_epi8(first, _mm256_loadu_si256((const __m256i *)(buf + i)));
+		eq_last = _mm256_cmpeq_epi8(last, _mm256_loadu_si256((const __m256i *)(buf + i + match->len - 1)));
+		mask = _mm256_movemask_epi8(_mm256_and_si256(eq_first, eq_last));
+
+		while(mask != 0)
+		{
+			bit = __builtin_ctz(mask);
+
+			if(memcmp(buf + i + bit + 1, match->pattern + 1, match->len - 2) == 0)
+			{
+				return buf + i + bit;
+			}
+
+			mask &= mask - 1;
+		}
+	}
+
+	return aesd_match_sw(match, buf + i, len - i);
+}
+
+#elif defined(__aarch64__)
+// NEON has no movemask, narrowing the compare result leaves a nibble per byte instead of a bit
+static const char *aesd_match_neon(const struct aesd_match *match, const char *buf, size_t len)
+{
+	const uint8x16_t	first = vdupq_n_u8(match->pattern[0]);
+	const uint8x16_t	last = vdupq_n_u8(match->pattern[match->len - 1]);
+	uint8x16_t		eq;
+	uint64_t		mask = 0;
+	unsigned int		bit = 0;
+	size_t			i = 0;
+
+	for(i = 0; i + match->len - 1 + 16 <= len; i += 16)
+	{
+		eq = vandq_u8(vceqq_u8(first, vld1q_u8((const uint8_t *)(buf + i))),
+			      vceqq_u8(last, vld1q_u8((const uint8_t *)(buf + i + match->len - 1))));
+		mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+
+		while(mask != 0)
+		{
+			bit = __builtin_ctzll(mask) >> 2;
+
+			if(memcmp(buf + i + bit + 1, match->pattern + 1, match->len - 2) == 0)
+			{
+				return buf + i + bit;
+			}
+
+			mask &= ~(0xfULL << (bit * 4));
+		}
+	}
+
+	return aesd_match_sw(match, buf + i, len - i);
+}
+
+#endif
+
+
+static void aesd_match_select(void)
+{
+	match_fn = aesd_match_sw;
+	match_name = "memmem";
+
+#if defined(__x86_64__)
+	match_fn = aesd_match_sse2;
+	match_name = "sse2";
+
+	if(__builtin_cpu_supports("avx2"))
+	{
+		match_fn = aesd_match_avx2;
+		match_name = "avx2";
+	}
+#elif defined(__aarch64__)
+	match_fn = aesd_match_neon;
+	match_name = "neon";
+#endif
+}
+
+
+const char *aesd_match_find(const struct aesd_match *match, const char *buf, size_t len)
+{
+	// a single byte has nothing to confirm, memchr() is vectorized already
+	if(match->len == 1)
+	{
+		return memchr(buf, match->pattern[0], len);
+	}
+
+	pthread_once(&match_once, aesd_match_select);
+
+	return match_fn(match, buf, len);
+}
+
+
+const char *aesd_match_impl(void)
+{
+	pthread_once(&match_once, aesd_match_select);
+
+	return match_name;
+}
@@ -0,0 +1,43 @@
+/*
+ * aesd-match.h
+ *
+ *  Substring search for the filtered readbacks of aesdsocket. Candidate
+ *  positions are found 16 or 32 bytes at a time by comparing the first and the
+ *  last byte of the pattern with SSE2/AVX2 on x86-64 or NEON on ARMv8, only
+ *  those are compared in full. Other CPUs fall back to memmem().
+ */
+
+#ifndef AESD_MATCH_H
+#define AESD_MATCH_H
+
+#include <stddef.h> // size_t
+
+#define AESD_MATCH_MAX_PATTERN    256    // longest pattern accepted by aesd_match_init
+
+struct aesd_match
+{
+	/**
+	 * Number of bytes in pattern
+	 */
+	size_t len;
+	char pattern[AESD_MATCH_MAX_PATTERN];
+};
+
+/**
+ * Prepares @param match to look for the @param len bytes at @param pattern
+ * @return 0 on success, -1 if @param len is 0 or longer than AESD_MATCH_MAX_PATTERN
+ */
+extern int aesd_match_init(struct aesd_match *match, const char *pattern, size_t len);
+
+/**
+ * @return the first occurrence of the pattern of @param match in the @param len bytes at @param buf,
+ * or NULL if there is none
+ */
+extern const char *aesd_match_find(const struct aesd_match *match, const char *buf, size_t len);
+
+/**
+ * @return the name of the implementation aesd_match_find uses on this CPU
+ */
+extern const char *aesd_match_impl(void);
+
+#endif /* AESD_MATCH_H */
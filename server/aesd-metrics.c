@@ -0,0 +1,394 @@
+/**
+ * @file aesd-metrics.c
+ * @brief Per-thread sharded counters and log-linear latency histograms for aesdsocket
+ *
+ * Every recording thread owns a shard, so the hot path is a thread local lookup
+ * and a relaxed store with no lock and no shared cache line.  Shards are linked
+ * on a registry list and only summed by aesd_metrics_dump().  The shard of an
+ * exited thread keeps its counts and is handed to the next new thread, so short
+ * lived threads do not grow the registry.
+ *
+ * Histogram buckets follow the HDR histogram layout: values below
+ * 2^AESD_METRICS_SUB_BUCKET_BITS get a bucket each, every larger power of two is
+ * split into 2^AESD_METRICS_SUB_BUCKET_BITS linear sub-buckets.
+ *
+ * @author Dazong Chen
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "aesd-metrics.h"
+
+#define AESD_METRICS_SUB_BUCKETS    (1U << AESD_METRICS_SUB_BUCKET_BITS)
+
+struct aesd_metrics_shard
+{
+	struct aesd_metrics_shard *next;	// registry list, shards are never removed
+	struct aesd_metrics_shard *next_free;	// shards of exited threads waiting for a new owner
+	uint64_t counters[AESD_METRICS_COUNTER_COUNT];
+	uint64_t sums[AESD_METRICS_HISTOGRAM_COUNT];
+	uint64_t buckets[AESD_METRICS_HISTOGRAM_COUNT][AESD_METRICS_BUCKETS];
+};
+
+struct aesd_metrics_info
+{
+	const char *name;
+	const char *help;
+};
+
+static const struct aesd_metrics_info histogram_info[AESD_METRICS_HISTOGRAM_COUNT] =
+{
+	{ "aesdsocket_accept_to_first_byte_seconds", "Time from accept() to the first bytes received on the connection" },
+	{ "aesdsocket_recv_to_newline_seconds", "Time from the first bytes of a line to its newline" },
+	{ "aesdsocket_lock_wait_seconds", "Time spent waiting for the log lock" },
+	{ "aesdsocket_write_seconds", "Time spent writing records to the log" },
+	{ "aesdsocket_readback_seconds", "Time from the start to the end of a readback" },
+	{ "aesdsocket_send_seconds", "Time spent in one send(), sendfile() or sendmsg() to a client" },
+};
+
+static const struct aesd_metrics_info counter_info[AESD_METRICS_COUNTER_COUNT] =
+{
+	{ "aesdsocket_connections_total", "Accepted connections" },
+	{ "aesdsocket_received_bytes_total", "Bytes received from clients" },
+	{ "aesdsocket_records_total", "Records appended to the log" },
+	{ "aesdsocket_readbacks_total", "Completed readbacks" },
+	{ "aesdsocket_readback_bytes_total", "Bytes sent by readbacks" },
+	{ "aesdsocket_dropped_datagrams_total", "Datagrams dropped for being cut short or not ending with a newline" },
+	{ "aesdsocket_fanout_drops_total", "Records dropped for a live tail subscriber, or subscribers cut off, after falling behind" },
+	{ "aesdsocket_filter_scanned_bytes_total", "Log bytes scanned for the pattern of filtered readbacks" },
+};
+
+static const struct aesd_metrics_info gauge_info[AESD_METRICS_GAUGE_COUNT] =
+{
+	{ "aesdsocket_active_connections", "Connections currently open" },
+	{ "aesdsocket_stored_bytes", "Committed length of the log" },
+	{ "aesdsocket_readback_size_bytes", "Bytes sent by the most recent readback" },
+	{ "aesdsocket_retained_bytes", "Bytes of the log kept by the segment retention" },
+	{ "aesdsocket_subscribers", "Live tail subscribers" },
+	{ "aesdsocket_channels", "Named channels in use" },
+};
+
+bool aesd_metrics_enabled = false;
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct aesd_metrics_shard *shards = NULL;
+static struct aesd_metrics_shard *free_shards = NULL;
+static pthread_key_t shard_key;
+static __thread struct aesd_metrics_shard *local_shard = NULL;
+static int64_t gauges[AESD_METRICS_GAUGE_COUNT];
+
+
+// thread exit, the shard keeps its counts and waits for the next thread
+static void aesd_metrics_release_shard(void *arg)
+{
+	struct aesd_metrics_shard	*shard = arg;
+
+	pthread_mutex_lock(&registry_lock);
+	shard->next_free = free_shards;
+	free_shards = shard;
+	pthread_mutex_unlock(&registry_lock);
+}
+
+
+void aesd_metrics_enable(void)
+{
+	if(pthread_key_create(&shard_key, aesd_metrics_release_shard) == 0)
+	{
+		aesd_metrics_enabled = true;
+	}
+}
+
+
+// first recording from this thread, reuse a released shard or register a new one
+static struct aesd_metrics_shard *aesd_metrics_shard(void)
+{
+	struct aesd_metrics_shard	*shard = local_shard;
+
+	if(shard != NULL)
+	{
+		return shard;
+	}
+
+	pthread_mutex_lock(&registry_lock);
+
+	if(free_shards != NULL)
+	{
+		shard = free_shards;
+		free_shards = shard->next_free;
+	}
+
+	else
+	{
+		shard = calloc(1, sizeof(struct aesd_metrics_shard));
+
+		if(shard != NULL)
+		{
+			shard->next = shards;
+			shards = shard;
+		}
+	}
+
+	pthread_mutex_unlock(&registry_lock);
+
+	if(shard != NULL)
+	{
+		pthread_setspecific(shard_key, shard);
+		local_shard = shard;
+	}
+
+	return shard;
+}
+
+
+// only the owning thread writes a shard, a relaxed store is enough for aesd_metrics_dump() to read it
+static inline void aesd_metrics_increment(uint64_t *value, uint64_t delta)
+{
+	__atomic_store_n(value, *value + delta, __ATOMIC_RELAXED);
+}
+
+
+unsigned int aesd_metrics_bucket(uint64_t value)
+{
+	unsigned int	msb = 0;
+
+	if(value < AESD_METRICS_SUB_BUCKETS)
+	{
+		return value;
+	}
+
+	msb = 63 - __builtin_clzll(value);
+
+	if(msb >= AESD_METRICS_MAX_VALUE_BITS)
+	{
+		return AESD_METRICS_BUCKETS - 1;
+	}
+
+	// the bits below the leading one pick the linear sub-bucket
+	return ((msb - AESD_METRICS_SUB_BUCKET_BITS + 1) << AESD_METRICS_SUB_BUCKET_BITS) +
+		((value >> (msb - AESD_METRICS_SUB_BUCKET_BITS)) & (AESD_METRICS_SUB_BUCKETS - 1));
+}
+
+
+uint64_t aesd_metrics_bucket_max(unsigned int bucket)
+{
+	unsigned int	magnitude = bucket >> AESD_METRICS_SUB_BUCKET_BITS;
+	uint64_t	sub_bucket = bucket & (AESD_METRICS_SUB_BUCKETS - 1);
+
+	if(magnitude == 0)
+	{
+		return sub_bucket;
+	}
+
+	return ((AESD_METRICS_SUB_BUCKETS + sub_bucket + 1) << (magnitude - 1)) - 1;
+}
+
+
+void aesd_metrics_record(enum aesd_metrics_histogram histogram, uint64_t value)
+{
+	struct aesd_metrics_shard	*shard = NULL;
+
+	if(!aesd_metrics_enabled || (shard = aesd_metrics_shard()) == NULL)
+	{
+		return;
+	}
+
+	aesd_metrics_increment(&shard->buckets[histogram][aesd_metrics_bucket(value)], 1);
+	aesd_metrics_increment(&shard->sums[histogram], value);
+}
+
+
+void aesd_metrics_record_since(enum aesd_metrics_histogram histogram, uint64_t start)
+{
+	if(start != 0)
+	{
+		aesd_metrics_record(histogram, aesd_metrics_clock() - start);
+	}
+}
+
+
+void aesd_metrics_add(enum aesd_metrics_counter counter, uint64_t value)
+{
+	struct aesd_metrics_shard	*shard = NULL;
+
+	if(!aesd_metrics_enabled || (shard = aesd_metrics_shard()) == NULL)
+	{
+		return;
+	}
+
+	aesd_metrics_increment(&shard->counters[counter], value);
+}
+
+
+void aesd_metrics_gauge_add(enum aesd_metrics_gauge gauge, int64_t delta)
+{
+	if(aesd_metrics_enabled)
+	{
+		__atomic_add_fetch(&gauges[gauge], delta, __ATOMIC_RELAXED);
+	}
+}
+
+
+void aesd_metrics_gauge_set(enum aesd_metrics_gauge gauge, int64_t value)
+{
+	if(aesd_metrics_enabled)
+	{
+		__atomic_store_n(&gauges[gauge], value, __ATOMIC_RELAXED);
+	}
+}
+
+
+// sum one histogram over every shard and print it with cumulative buckets, empty buckets are skipped
+static void aesd_metrics_print_histogram(FILE *out, enum aesd_metrics_histogram histogram)
+{
+	struct aesd_metrics_shard	*shard = NULL;
+	uint64_t			count = 0;
+	uint64_t			sum = 0;
+	uint64_t			bucket_count = 0;
+	unsigned int			bucket = 0;
+
+	fprintf(out, "# HELP %s %s\n", histogram_info[histogram].name, histogram_info[histogram].help);
+	fprintf(out, "# TYPE %s histogram\n", histogram_info[histogram].name);
+
+	for(bucket = 0; bucket < AESD_METRICS_BUCKETS; bucket++)
+	{
+		bucket_count = 0;
+
+		for(shard = shards; shard != NULL; shard = shard->next)
+		{
+			bucket_count += __atomic_load_n(&shard->buckets[histogram][bucket], __ATOMIC_RELAXED);
+		}
+
+		if(bucket_count == 0)
+		{
+			continue;
+		}
+
+		count += bucket_count;
+		fprintf(out, "%s_bucket{le=\"%.9g\"} %llu\n", histogram_info[histogram].name,
+			aesd_metrics_bucket_max(bucket) / 1e9, (unsigned long long)count);
+	}
+
+	for(shard = shards; shard != NULL; shard = shard->next)
+	{
+		sum += __atomic_load_n(&shard->sums[histogram], __ATOMIC_RELAXED);
+	}
+
+	fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", histogram_info[histogram].name, (unsigned long long)count);
+	fprintf(out, "%s_sum %.9f\n", histogram_info[histogram].name, sum / 1e9);
+	fprintf(out, "%s_count %llu\n", histogram_info[histogram].name, (unsigned long long)count);
+}
+
+
+int aesd_metrics_dump(int fd)
+{
+	struct aesd_metrics_shard	*shard = NULL;
+	FILE				*out = NULL;
+	char				*text = NULL;
+	size_t				text_len = 0;
+	size_t				sent = 0;
+	ssize_t				nbytes = 0;
+	uint64_t			total = 0;
+	int				i = 0;
+	int				rc = 0;
+
+	out = open_memstream(&text, &text_len);
+
+	if(out == NULL)
+	{
+		return -1;
+	}
+
+	pthread_mutex_lock(&registry_lock);
+
+	for(i = 0; i < AESD_METRICS_COUNTER_COUNT; i++)
+	{
+		total = 0;
+
+		for(shard = shards; shard != NULL; shard = shard->next)
+		{
+			total += __atomic_load_n(&shard->counters[i], __ATOMIC_RELAXED);
+		}
+
+		fprintf(out, "# HELP %s %s\n", counter_info[i].name, counter_info[i].help);
+		fprintf(out, "# TYPE %s counter\n", counter_info[i].name);
+		fprintf(out, "%s %llu\n", counter_info[i].name, (unsigned long long)total);
+	}
+
+	for(i = 0; i < AESD_METRICS_GAUGE_COUNT; i++)
+	{
+		fprintf(out, "# HELP %s %s\n", gauge_info[i].name, gauge_info[i].help);
+		fprintf(out, "# TYPE %s gauge\n", gauge_info[i].name);
+		fprintf(out, "%s %lld\n", gauge_info[i].name, (long long)__atomic_load_n(&gauges[i], __ATOMIC_RELAXED));
+	}
+
+	for(i = 0; i < AESD_METRICS_HISTOGRAM_COUNT; i++)
+	{
+		aesd_metrics_print_histogram(out, i);
+	}
+
+	pthread_mutex_unlock(&registry_lock);
+
+	if(fclose(out) != 0)
+	{
+		free(text);
+		return -1;
+	}
+
+	while(sent < text_len)
+	{
+		nbytes = write(fd, text + sent, text_len - sent);
+
+		if(nbytes == -1)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+
+			rc = -1;
+			break;
+		}
+
+		sent += nbytes;
+	}
+
+	free(text);
+
+	return rc;
+}
+
+
+void aesd_metrics_free(void)
+{
+	struct aesd_metrics_shard	*shard = NULL;
+
+	if(!aesd_metrics_enabled)
+	{
+		return;
+	}
+
+	aesd_metrics_enabled = false;
+
+	pthread_mutex_lock(&registry_lock);
+
+	while(shards != NULL)
+	{
+		shard = shards;
+		shards = shard->next;
+		free(shard);
+	}
+
+	free_shards = NULL;
+	pthread_mutex_unlock(&registry_lock);
+
+	// the calling thread's shard is gone, keep its destructor from touching it
+	pthread_setspecific(shard_key, NULL);
+	local_shard = NULL;
+	pthread_key_delete(shard_key);
+}
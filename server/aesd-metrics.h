@@ -0,0 +1,131 @@
+/*
+ * aesd-metrics.h
+ *
+ *  Low overhead counters, gauges and latency histograms for aesdsocket.
+ *  Counters and histograms are sharded per thread, so recording never takes a lock
+ *  or bounces a cache line between threads. Shards are only summed when the metrics
+ *  are dumped in text exposition format.
+ */
+
+#ifndef AESD_METRICS_H
+#define AESD_METRICS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#define AESD_METRICS_SUB_BUCKET_BITS   4     // 16 linear sub-buckets per power of two, at most 6.25% error
+#define AESD_METRICS_MAX_VALUE_BITS    40    // larger values (about 18 minutes in nanoseconds) land in the last bucket
+#define AESD_METRICS_BUCKETS           ((AESD_METRICS_MAX_VALUE_BITS - AESD_METRICS_SUB_BUCKET_BITS + 1) << AESD_METRICS_SUB_BUCKET_BITS)
+
+enum aesd_metrics_histogram
+{
+	AESD_METRICS_ACCEPT_TO_FIRST_BYTE,	// accept() until the first bytes of the connection are received
+	AESD_METRICS_RECV_TO_NEWLINE,		// first bytes of a line until its newline is received
+	AESD_METRICS_LOCK_WAIT,			// waiting for locker
+	AESD_METRICS_WRITE,			// write()/writev() of records to OUTPUT_FILE
+	AESD_METRICS_READBACK,			// start to end of one readback
+	AESD_METRICS_SEND,			// one send()/sendfile()/sendmsg() to a client
+	AESD_METRICS_HISTOGRAM_COUNT
+};
+
+enum aesd_metrics_counter
+{
+	AESD_METRICS_CONNECTIONS,		// accepted connections
+	AESD_METRICS_RECEIVED_BYTES,
+	AESD_METRICS_RECORDS,			// records appended to OUTPUT_FILE
+	AESD_METRICS_READBACKS,
+	AESD_METRICS_READBACK_BYTES,
+	AESD_METRICS_DROPPED_DATAGRAMS,		// datagrams cut short or not ending with a newline
+	AESD_METRICS_FANOUT_DROPS,		// records not queued for a live tail subscriber that fell behind
+	AESD_METRICS_FILTER_SCANNED_BYTES,	// log bytes looked at by filtered readbacks, their sent bytes count as readback bytes
+	AESD_METRICS_COUNTER_COUNT
+};
+
+enum aesd_metrics_gauge
+{
+	AESD_METRICS_ACTIVE_CONNECTIONS,
+	AESD_METRICS_STORED_BYTES,		// committed length of OUTPUT_FILE
+	AESD_METRICS_READBACK_SIZE,		// bytes sent by the most recent readback
+	AESD_METRICS_RETAINED_BYTES,		// bytes kept by the segmented log retention
+	AESD_METRICS_SUBSCRIBERS,		// live tail subscribers
+	AESD_METRICS_CHANNELS,			// named channels
+	AESD_METRICS_GAUGE_COUNT
+};
+
+/**
+ * Nothing is recorded until aesd_metrics_enable() is called
+ */
+extern bool aesd_metrics_enabled;
+
+/**
+ * Starts recording, must be called before the threads that record are created
+ */
+extern void aesd_metrics_enable(void);
+
+/**
+ * @return the current CLOCK_MONOTONIC time in nanoseconds, or 0 when metrics are disabled
+ * so a disabled build pays one branch instead of a clock read
+ */
+static inline uint64_t aesd_metrics_clock(void)
+{
+	struct timespec ts;
+
+	if(!aesd_metrics_enabled)
+	{
+		return 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Adds @param value nanoseconds to @param histogram in the calling thread's shard
+ */
+extern void aesd_metrics_record(enum aesd_metrics_histogram histogram, uint64_t value);
+
+/**
+ * Records the time elapsed since @param start, taken with aesd_metrics_clock().
+ * Does nothing when @param start is 0
+ */
+extern void aesd_metrics_record_since(enum aesd_metrics_histogram histogram, uint64_t start);
+
+/**
+ * Adds @param value to @param counter in the calling thread's shard
+ */
+extern void aesd_metrics_add(enum aesd_metrics_counter counter, uint64_t value);
+
+/**
+ * Adds @param delta to @param gauge, gauges are shared by all threads
+ */
+extern void aesd_metrics_gauge_add(enum aesd_metrics_gauge gauge, int64_t delta);
+
+/**
+ * Sets @param gauge to @param value
+ */
+extern void aesd_metrics_gauge_set(enum aesd_metrics_gauge gauge, int64_t value);
+
+/**
+ * @return the index of the histogram bucket counting @param value
+ */
+extern unsigned int aesd_metrics_bucket(uint64_t value);
+
+/**
+ * @return the largest value counted by histogram bucket @param bucket
+ */
+extern uint64_t aesd_metrics_bucket_max(unsigned int bucket);
+
+/**
+ * Sums every shard and writes all metrics to @param fd in text exposition format
+ * @return 0 on success, -1 if the text could not be built or written
+ */
+extern int aesd_metrics_dump(int fd);
+
+/**
+ * Releases every shard, no thread may record afterwards
+ */
+extern void aesd_metrics_free(void);
+
+#endif /* AESD_METRICS_H */
@@ -0,0 +1,231 @@
+/**
+ * @file aesd-record-store.c
+ * @brief In-memory append-only record store used to serve aesdsocket readbacks
+ *
+ * Records are copied back to back into large data segments, so a readback walks
+ * memory sequentially.  Segments and index chunks are never moved once published,
+ * which lets readers walk the store without taking the writer's lock: a reader only
+ * needs a record count (or byte length) that was published before it started.
+ *
+ * @author Dazong Chen
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "aesd-record-store.h"
+
+struct aesd_record_segment
+{
+	struct aesd_record_segment *next;	// previously filled segment
+	size_t size;				// bytes available in data
+	size_t used;				// bytes already holding records
+	char data[];
+};
+
+struct aesd_record_retired
+{
+	struct aesd_record_retired *next;
+	struct aesd_record_entry **chunks;
+};
+
+
+void aesd_record_store_init(struct aesd_record_store *store)
+{
+	memset(store, 0, sizeof(struct aesd_record_store));
+}
+
+
+// make sure index chunk number chunk exists, growing the directory if needed
+static int aesd_record_store_reserve(struct aesd_record_store *store, size_t chunk)
+{
+	struct aesd_record_entry	**chunks = NULL;
+	struct aesd_record_retired	*retired = NULL;
+	size_t				chunks_size = 0;
+
+	if(chunk >= store->chunks_size)
+	{
+		chunks_size = (store->chunks_size == 0) ? 16 : store->chunks_size * 2;
+		chunks = calloc(chunks_size, sizeof(struct aesd_record_entry *));
+		retired = malloc(sizeof(struct aesd_record_retired));
+
+		if(chunks == NULL || retired == NULL)
+		{
+			free(chunks);
+			free(retired);
+			return -1;
+		}
+
+		if(store->chunks_size > 0)
+		{
+			memcpy(chunks, store->chunks, store->chunks_size * sizeof(struct aesd_record_entry *));
+		}
+
+		// readers may still hold the old directory, keep it until the store is freed
+		retired->chunks = store->chunks;
+		retired->next = store->retired;
+		store->retired = retired;
+
+		__atomic_store_n(&store->chunks, chunks, __ATOMIC_RELEASE);
+		store->chunks_size = chunks_size;
+	}
+
+	if(store->chunks[chunk] == NULL)
+	{
+		store->chunks[chunk] = malloc(AESD_RECORD_STORE_CHUNK_ENTRIES * sizeof(struct aesd_record_entry));
+
+		if(store->chunks[chunk] == NULL)
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+
+long aesd_record_store_append(struct aesd_record_store *store, const char *buf, size_t len)
+{
+	struct aesd_record_segment	*segment = store->segment;
+	struct aesd_record_entry	*entry = NULL;
+	size_t				seq = store->count;
+	size_t				segment_size = AESD_RECORD_STORE_SEGMENT_SIZE;
+	char				*dest = NULL;
+
+	if(aesd_record_store_reserve(store, seq / AESD_RECORD_STORE_CHUNK_ENTRIES) != 0)
+	{
+		return -1;
+	}
+
+	// records never span segments, start a new one when this record does not fit
+	if(segment == NULL || (segment->size - segment->used) < len)
+	{
+		if(len > segment_size)
+		{
+			segment_size = len;
+		}
+
+		segment = malloc(sizeof(struct aesd_record_segment) + segment_size);
+
+		if(segment == NULL)
+		{
+			return -1;
+		}
+
+		segment->size = segment_size;
+		segment->used = 0;
+		segment->next = store->segment;
+		store->segment = segment;
+	}
+
+	dest = segment->data + segment->used;
+	memcpy(dest, buf, len);
+	segment->used += len;
+
+	entry = &store->chunks[seq / AESD_RECORD_STORE_CHUNK_ENTRIES][seq % AESD_RECORD_STORE_CHUNK_ENTRIES];
+	entry->data = dest;
+	entry->size = len;
+	entry->offset = store->bytes;
+
+	store->bytes += len;
+
+	// publish last, a reader that sees the new count also sees the entry and its bytes
+	__atomic_store_n(&store->count, seq + 1, __ATOMIC_RELEASE);
+
+	return seq;
+}
+
+
+const struct aesd_record_entry *aesd_record_store_get(const struct aesd_record_store *store, size_t seq)
+{
+	struct aesd_record_entry	**chunks = NULL;
+
+	if(seq >= aesd_record_store_count(store))
+	{
+		return NULL;
+	}
+
+	chunks = __atomic_load_n(&store->chunks, __ATOMIC_ACQUIRE);
+
+	return &chunks[seq / AESD_RECORD_STORE_CHUNK_ENTRIES][seq % AESD_RECORD_STORE_CHUNK_ENTRIES];
+}
+
+
+size_t aesd_record_store_find(const struct aesd_record_store *store, off_t offset)
+{
+	const struct aesd_record_entry	*entry = NULL;
+	size_t				count = aesd_record_store_count(store);
+	size_t				low = 0;
+	size_t				high = count;	// first record starting past offset lies in [low, high]
+	size_t				mid = 0;
+
+	while(low < high)
+	{
+		mid = low + (high - low) / 2;
+		entry = aesd_record_store_get(store, mid);
+
+		if(entry->offset <= offset)
+		{
+			low = mid + 1;
+		}
+
+		else
+		{
+			high = mid;
+		}
+	}
+
+	// low is the first record starting past offset, the one before it holds offset
+	if(low == 0)
+	{
+		return 0;
+	}
+
+	entry = aesd_record_store_get(store, low - 1);
+
+	if(offset >= entry->offset + (off_t)entry->size)
+	{
+		return count;
+	}
+
+	return low - 1;
+}
+
+
+size_t aesd_record_store_count(const struct aesd_record_store *store)
+{
+	return __atomic_load_n(&store->count, __ATOMIC_ACQUIRE);
+}
+
+
+void aesd_record_store_free(struct aesd_record_store *store)
+{
+	struct aesd_record_segment	*segment = NULL;
+	struct aesd_record_retired	*retired = NULL;
+	size_t				i = 0;
+
+	for(i = 0; i < store->chunks_size; i++)
+	{
+		free(store->chunks[i]);
+	}
+
+	free(store->chunks);
+
+	while(store->segment != NULL)
+	{
+		segment = store->segment;
+		store->segment = segment->next;
+		free(segment);
+	}
+
+	while(store->retired != NULL)
+	{
+		retired = store->retired;
+		store->retired = retired->next;
+		free(retired->chunks);
+		free(retired);
+	}
+
+	aesd_record_store_init(store);
+}
@@ -0,0 +1,102 @@
+/*
+ * aesd-record-store.h
+ *
+ *  In-memory, append-only copy of every record aesdsocket writes to OUTPUT_FILE.
+ *  Record bytes are packed into large data segments and a chunked index maps
+ *  each record sequence number to its bytes and its offset in the log.
+ */
+
+#ifndef AESD_RECORD_STORE_H
+#define AESD_RECORD_STORE_H
+
+#include <stddef.h> // size_t
+#include <stdbool.h>
+#include <sys/types.h> // off_t
+
+#define AESD_RECORD_STORE_SEGMENT_SIZE    (1 << 20)    // bytes per data segment, larger records get a segment of their own
+#define AESD_RECORD_STORE_CHUNK_ENTRIES   1024         // index entries per index chunk
+
+struct aesd_record_entry
+{
+	/**
+	 * Record bytes, stored inside a data segment and never moved or modified
+	 */
+	const char *data;
+	/**
+	 * Number of bytes in the record
+	 */
+	size_t size;
+	/**
+	 * Offset of the first byte of the record if all records were concatenated end to end
+	 */
+	off_t offset;
+};
+
+struct aesd_record_segment;
+struct aesd_record_retired;
+
+struct aesd_record_store
+{
+	/**
+	 * Directory of index chunks, each holding AESD_RECORD_STORE_CHUNK_ENTRIES entries.
+	 * Replaced (never modified in place) when it needs to grow
+	 */
+	struct aesd_record_entry **chunks;
+	/**
+	 * Number of slots in chunks
+	 */
+	size_t chunks_size;
+	/**
+	 * Number of published records
+	 */
+	size_t count;
+	/**
+	 * Number of published bytes
+	 */
+	off_t bytes;
+	/**
+	 * Most recent data segment, records are appended here. Segments are chained for aesd_record_store_free
+	 */
+	struct aesd_record_segment *segment;
+	/**
+	 * Directories replaced while readers may still use them, released by aesd_record_store_free
+	 */
+	struct aesd_record_retired *retired;
+};
+
+/**
+ * Initializes the store described by @param store to an empty store
+ */
+extern void aesd_record_store_init(struct aesd_record_store *store);
+
+/**
+ * Copies @param len bytes of @param buf into @param store as a new record.
+ * Writers must be serialized by the caller, readers may run concurrently.
+ * @return the sequence number of the new record, or -1 if memory could not be allocated
+ */
+extern long aesd_record_store_append(struct aesd_record_store *store, const char *buf, size_t len);
+
+/**
+ * @return the record with sequence number @param seq, or NULL if it has not been published yet.
+ * The returned entry stays valid until aesd_record_store_free
+ */
+extern const struct aesd_record_entry *aesd_record_store_get(const struct aesd_record_store *store, size_t seq);
+
+/**
+ * @return the sequence number of the published record holding byte @param offset of the log,
+ * or aesd_record_store_count() if @param offset is at or past the end of the published records.
+ * Found with a binary search over the record offsets
+ */
+extern size_t aesd_record_store_find(const struct aesd_record_store *store, off_t offset);
+
+/**
+ * @return the number of published records
+ */
+extern size_t aesd_record_store_count(const struct aesd_record_store *store);
+
+/**
+ * Releases every segment, index chunk and directory owned by @param store
+ */
+extern void aesd_record_store_free(struct aesd_record_store *store);
+
+#endif /* AESD_RECORD_STORE_H */
@@ -0,0 +1,506 @@
+/**
+ * @file aesd-segment-log.c
+ * @brief Segmented, rotating data log for the aesdsocket file backend
+ *
+ * The log is a series of segment files in one directory.  Only the newest segment
+ * is appended to; once it holds segment_size bytes the next record starts a new
+ * one.  Log offsets keep counting across segments, so clients see one continuous
+ * log whose beginning moves forward as old segments are deleted.  Deleting a whole
+ * segment is a single unlink(), and a reader keeps its own descriptor, so deletion
+ * never waits for readbacks still streaming the segment.
+ *
+ * When the log is kept across restarts, the newest segment carries a sidecar
+ * index (see aesd-log-index.h) and only that segment is checked on startup; older
+ * segments were sealed, their index checkpointed, when the log rotated past them.
+ *
+ * @author Dazong Chen
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <syslog.h>
+#include <sys/stat.h>
+
+#include "aesd-segment-log.h"
+
+
+// path of the file with suffix (AESD_SEGMENT_LOG_DATA or AESD_SEGMENT_LOG_INDEX) of the segment starting at log offset base
+static void aesd_segment_log_path(const struct aesd_segment_log *log, off_t base, const char *suffix, char *path, size_t size)
+{
+	snprintf(path, size, "%s/%020lld%s", log->dir, (long long)base, suffix);
+}
+
+
+// true for the names aesd_segment_log_path() gives files with suffix, base receives the segment's log offset
+static bool aesd_segment_log_parse(const char *name, const char *suffix, off_t *base)
+{
+	size_t	i = 0;
+
+	*base = 0;
+
+	for(i = 0; i < 20; i++)
+	{
+		if(name[i] < '0' || name[i] > '9')
+		{
+			return false;
+		}
+
+		*base = *base * 10 + (name[i] - '0');
+	}
+
+	return strcmp(name + 20, suffix) == 0;
+}
+
+
+static int aesd_segment_log_compare(const void *a, const void *b)
+{
+	off_t	base_a = *(const off_t *)a;
+	off_t	base_b = *(const off_t *)b;
+
+	return (base_a > base_b) - (base_a < base_b);
+}
+
+
+// start a new segment at log offset base as the newest entry of the directory, log->lock must be held
+static int aesd_segment_log_add(struct aesd_segment_log *log, int fd, off_t base)
+{
+	struct aesd_segment	*segments = NULL;
+	size_t			capacity = 0;
+
+	if(log->count == log->capacity)
+	{
+		capacity = (log->capacity == 0) ? 16 : log->capacity * 2;
+		segments = realloc(log->segments, capacity * sizeof(struct aesd_segment));
+
+		if(segments == NULL)
+		{
+			return -1;
+		}
+
+		log->segments = segments;
+		log->capacity = capacity;
+	}
+
+	log->segments[log->count].fd = fd;
+	log->segments[log->count].base = base;
+	log->segments[log->count].size = 0;
+	log->segments[log->count].last_write = time(NULL);
+	log->count++;
+
+	return 0;
+}
+
+
+static int aesd_segment_log_create(struct aesd_segment_log *log, off_t base)
+{
+	char	path[PATH_MAX];
+	int	fd = -1;
+
+	aesd_segment_log_path(log, base, AESD_SEGMENT_LOG_DATA, path, sizeof(path));
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+
+	if(fd < 0 || !log->keep)
+	{
+		return fd;
+	}
+
+	aesd_segment_log_path(log, base, AESD_SEGMENT_LOG_INDEX, path, sizeof(path));
+	unlink(path);
+
+	if(aesd_log_index_open(&log->index, path, fd, base) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+// unlink both files of the segment starting at log offset base
+static void aesd_segment_log_unlink(const struct aesd_segment_log *log, off_t base)
+{
+	char	path[PATH_MAX];
+
+	aesd_segment_log_path(log, base, AESD_SEGMENT_LOG_DATA, path, sizeof(path));
+	unlink(path);
+	aesd_segment_log_path(log, base, AESD_SEGMENT_LOG_INDEX, path, sizeof(path));
+	unlink(path);
+}
+
+
+// rebuild the segment directory from the files of an earlier run
+// sealed segments are taken as they are, only the newest one is verified against its index
+static int aesd_segment_log_load(struct aesd_segment_log *log, const off_t *bases, size_t count)
+{
+	char		path[PATH_MAX];
+	struct stat	st;
+	size_t		i = 0;
+	int		fd = -1;
+
+	for(i = 0; i < count; i++)
+	{
+		aesd_segment_log_path(log, bases[i], AESD_SEGMENT_LOG_DATA, path, sizeof(path));
+		fd = open(path, O_RDWR | O_APPEND | O_CLOEXEC);
+
+		if(fd < 0 || fstat(fd, &st) == -1 || aesd_segment_log_add(log, fd, bases[i]) != 0)
+		{
+			if(fd >= 0)
+			{
+				close(fd);
+			}
+
+			return -1;
+		}
+
+		log->segments[log->count - 1].size = st.st_size;
+		log->segments[log->count - 1].last_write = st.st_mtime;
+	}
+
+	aesd_segment_log_path(log, bases[count - 1], AESD_SEGMENT_LOG_INDEX, path, sizeof(path));
+
+	if(aesd_log_index_open(&log->index, path, fd, bases[count - 1]) != 0)
+	{
+		return -1;
+	}
+
+	log->segments[log->count - 1].size = log->index.end - bases[count - 1];
+
+	return 0;
+}
+
+
+int aesd_segment_log_open(struct aesd_segment_log *log, const char *dir, off_t segment_size,
+			  off_t retain_bytes, time_t retain_seconds, bool sync_on_rotate, bool keep)
+{
+	DIR		*d = NULL;
+	struct dirent	*entry = NULL;
+	off_t		*bases = NULL;
+	off_t		*grown = NULL;
+	off_t		base = 0;
+	size_t		count = 0;
+	size_t		capacity = 0;
+	int		fd = -1;
+	int		rc = 0;
+
+	memset(log, 0, sizeof(struct aesd_segment_log));
+	pthread_mutex_init(&log->lock, NULL);
+
+	log->dir = strdup(dir);
+	log->segment_size = segment_size;
+	log->retain_bytes = retain_bytes;
+	log->retain_seconds = retain_seconds;
+	log->sync_on_rotate = sync_on_rotate;
+	log->keep = keep;
+	log->index.fd = -1;
+
+	if(log->dir == NULL)
+	{
+		return -1;
+	}
+
+	if(mkdir(dir, 0755) == -1 && errno != EEXIST)
+	{
+		return -1;
+	}
+
+	d = opendir(dir);
+
+	if(d == NULL)
+	{
+		return -1;
+	}
+
+	// a kept log continues where the last run stopped, otherwise every run starts with an empty log
+	while((entry = readdir(d)) != NULL)
+	{
+		if(keep && aesd_segment_log_parse(entry->d_name, AESD_SEGMENT_LOG_DATA, &base))
+		{
+			if(count == capacity)
+			{
+				capacity = (capacity == 0) ? 16 : capacity * 2;
+				grown = realloc(bases, capacity * sizeof(off_t));
+
+				if(grown == NULL)
+				{
+					rc = -1;
+					break;
+				}
+
+				bases = grown;
+			}
+
+			bases[count++] = base;
+		}
+
+		else if(!keep && (aesd_segment_log_parse(entry->d_name, AESD_SEGMENT_LOG_DATA, &base) ||
+				  aesd_segment_log_parse(entry->d_name, AESD_SEGMENT_LOG_INDEX, &base)))
+		{
+			aesd_segment_log_unlink(log, base);
+		}
+	}
+
+	closedir(d);
+
+	if(rc == 0 && count > 0)
+	{
+		qsort(bases, count, sizeof(off_t), aesd_segment_log_compare);
+		rc = aesd_segment_log_load(log, bases, count);
+	}
+
+	free(bases);
+
+	if(rc != 0 || count > 0)
+	{
+		return rc;
+	}
+
+	fd = aesd_segment_log_create(log, 0);
+
+	if(fd < 0 || aesd_segment_log_add(log, fd, 0) != 0)
+	{
+		if(fd >= 0)
+		{
+			close(fd);
+		}
+
+		return -1;
+	}
+
+	return 0;
+}
+
+
+int aesd_segment_log_writer(struct aesd_segment_log *log, size_t len)
+{
+	struct aesd_segment	newest;
+	off_t			base = 0;
+	int			fd = -1;
+
+	// aesd_segment_log_expire may move the directory, but writers are serialized,
+	// so nobody else can rotate or delete the newest segment meanwhile
+	pthread_mutex_lock(&log->lock);
+	newest = log->segments[log->count - 1];
+	pthread_mutex_unlock(&log->lock);
+
+	if(newest.size == 0 || newest.size + (off_t)len <= log->segment_size)
+	{
+		return newest.fd;
+	}
+
+	if(log->sync_on_rotate && fdatasync(newest.fd) == -1)
+	{
+		syslog(LOG_ERR, "fdatasync() of segment %lld failed: %s", (long long)newest.base, strerror(errno));
+	}
+
+	// seal the full segment, a restart trusts its size without looking at it again
+	if(log->keep)
+	{
+		aesd_log_index_close(&log->index);
+	}
+
+	base = newest.base + newest.size;
+	fd = aesd_segment_log_create(log, base);
+
+	if(fd < 0)
+	{
+		// an oversized segment is better than losing the record
+		syslog(LOG_ERR, "Creating segment %lld failed: %s", (long long)base, strerror(errno));
+		return newest.fd;
+	}
+
+	pthread_mutex_lock(&log->lock);
+
+	if(aesd_segment_log_add(log, fd, base) != 0)
+	{
+		pthread_mutex_unlock(&log->lock);
+		close(fd);
+		return newest.fd;
+	}
+
+	pthread_mutex_unlock(&log->lock);
+
+	return fd;
+}
+
+
+void aesd_segment_log_commit(struct aesd_segment_log *log, const char *buf, size_t len)
+{
+	pthread_mutex_lock(&log->lock);
+	log->segments[log->count - 1].size += len;
+	log->segments[log->count - 1].last_write = time(NULL);
+	pthread_mutex_unlock(&log->lock);
+
+	if(log->keep && log->index.fd >= 0 && aesd_log_index_add(&log->index, buf, len) != 0)
+	{
+		syslog(LOG_ERR, "Index checkpoint of segment %lld failed: %s", (long long)log->index.base, strerror(errno));
+	}
+}
+
+
+void aesd_segment_log_flush(struct aesd_segment_log *log)
+{
+	if(log->keep && log->index.fd >= 0 && aesd_log_index_flush(&log->index) != 0)
+	{
+		syslog(LOG_ERR, "Index checkpoint of segment %lld failed: %s", (long long)log->index.base, strerror(errno));
+	}
+}
+
+
+off_t aesd_segment_log_end(struct aesd_segment_log *log)
+{
+	off_t	end = 0;
+
+	pthread_mutex_lock(&log->lock);
+	end = log->segments[log->count - 1].base + log->segments[log->count - 1].size;
+	pthread_mutex_unlock(&log->lock);
+
+	return end;
+}
+
+
+int aesd_segment_log_reader(struct aesd_segment_log *log, off_t offset, off_t *base, off_t *end)
+{
+	size_t	low = 0;
+	size_t	high = 0;
+	size_t	mid = 0;
+	int	fd = -1;
+
+	pthread_mutex_lock(&log->lock);
+
+	// first segment ending after offset
+	high = log->count;
+
+	while(low < high)
+	{
+		mid = low + (high - low) / 2;
+
+		if(log->segments[mid].base + log->segments[mid].size <= offset)
+		{
+			low = mid + 1;
+		}
+
+		else
+		{
+			high = mid;
+		}
+	}
+
+	if(low < log->count)
+	{
+		fd = dup(log->segments[low].fd);
+		*base = log->segments[low].base;
+		*end = log->segments[low].base + log->segments[low].size;
+	}
+
+	pthread_mutex_unlock(&log->lock);
+
+	return fd;
+}
+
+
+off_t aesd_segment_log_retained(struct aesd_segment_log *log)
+{
+	off_t	retained = 0;
+
+	pthread_mutex_lock(&log->lock);
+	retained = log->segments[log->count - 1].base + log->segments[log->count - 1].size - log->segments[0].base;
+	pthread_mutex_unlock(&log->lock);
+
+	return retained;
+}
+
+
+// true if the oldest segment falls outside the retention, log->lock must be held
+static bool aesd_segment_log_expired(const struct aesd_segment_log *log, time_t now)
+{
+	const struct aesd_segment	*oldest = &log->segments[0];
+	const struct aesd_segment	*newest = &log->segments[log->count - 1];
+
+	if(log->count < 2)
+	{
+		return false;
+	}
+
+	if(log->retain_bytes > 0 && newest->base + newest->size - oldest->base > log->retain_bytes)
+	{
+		return true;
+	}
+
+	return log->retain_seconds > 0 && now - oldest->last_write >= log->retain_seconds;
+}
+
+
+size_t aesd_segment_log_expire(struct aesd_segment_log *log, time_t now)
+{
+	struct aesd_segment	oldest;
+	size_t			deleted = 0;
+
+	while(1)
+	{
+		pthread_mutex_lock(&log->lock);
+
+		if(!aesd_segment_log_expired(log, now))
+		{
+			pthread_mutex_unlock(&log->lock);
+			break;
+		}
+
+		oldest = log->segments[0];
+		log->count--;
+		memmove(&log->segments[0], &log->segments[1], log->count * sizeof(struct aesd_segment));
+
+		pthread_mutex_unlock(&log->lock);
+
+		// readers hold their own descriptors, the data stays readable for them until they close it
+		aesd_segment_log_unlink(log, oldest.base);
+		close(oldest.fd);
+
+		syslog(LOG_DEBUG, "Deleted segment %lld of %lld bytes", (long long)oldest.base, (long long)oldest.size);
+		deleted++;
+	}
+
+	return deleted;
+}
+
+
+void aesd_segment_log_close(struct aesd_segment_log *log)
+{
+	size_t	i = 0;
+
+	if(log->keep)
+	{
+		aesd_log_index_close(&log->index);
+	}
+
+	for(i = 0; i < log->count; i++)
+	{
+		if(!log->keep)
+		{
+			aesd_segment_log_unlink(log, log->segments[i].base);
+		}
+
+		close(log->segments[i].fd);
+	}
+
+	if(log->dir != NULL && !log->keep)
+	{
+		rmdir(log->dir);
+	}
+
+	free(log->segments);
+	free(log->dir);
+	pthread_mutex_destroy(&log->lock);
+
+	log->segments = NULL;
+	log->dir = NULL;
+	log->count = 0;
+	log->capacity = 0;
+}
@@ -0,0 +1,152 @@
+/*
+ * aesd-segment-log.h
+ *
+ *  Segmented data log of the aesdsocket file backend. Records are appended to
+ *  the newest of a series of segment files, each named after the log offset of
+ *  its first byte. Segments that fall out of the configured retention are
+ *  deleted as a whole, so the log no longer grows with the uptime.
+ *  A kept log survives restarts, its newest segment is indexed for a fast restart.
+ */
+
+#ifndef AESD_SEGMENT_LOG_H
+#define AESD_SEGMENT_LOG_H
+
+#include <stddef.h> // size_t
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h> // off_t
+
+#include "aesd-log-index.h"
+
+#define AESD_SEGMENT_LOG_DATA     ".log"    // suffix of segment data files, named "<20 digit base offset>.log"
+#define AESD_SEGMENT_LOG_INDEX    ".idx"    // suffix of the sidecar index of a kept segment
+
+struct aesd_segment
+{
+	/**
+	 * Open segment file, appended to while the segment is the newest one
+	 */
+	int fd;
+	/**
+	 * Log offset of the first byte of the segment
+	 */
+	off_t base;
+	/**
+	 * Number of bytes written to the segment
+	 */
+	off_t size;
+	/**
+	 * Wall clock time of the last write, retention by age starts counting here
+	 */
+	time_t last_write;
+};
+
+struct aesd_segment_log
+{
+	/**
+	 * Directory holding the segment files
+	 */
+	char *dir;
+	/**
+	 * The newest segment is rotated once it holds this many bytes, records never span segments
+	 */
+	off_t segment_size;
+	/**
+	 * Oldest segments are deleted while the log holds more than this many bytes, 0 to keep them
+	 */
+	off_t retain_bytes;
+	/**
+	 * Segments last written this many seconds ago are deleted, 0 to keep them
+	 */
+	time_t retain_seconds;
+	/**
+	 * fdatasync() a segment when it is rotated
+	 */
+	bool sync_on_rotate;
+	/**
+	 * Keep the segments when the log is closed and continue with them when it is opened again
+	 */
+	bool keep;
+	/**
+	 * Sidecar index of the newest segment of a kept log, only used by writers
+	 */
+	struct aesd_log_index index;
+	/**
+	 * Protects the segment directory below. Writers must be serialized by the caller
+	 * and may hold their own lock while taking this one
+	 */
+	pthread_mutex_t lock;
+	/**
+	 * Segment directory ordered by base offset, the last entry is the segment being written
+	 */
+	struct aesd_segment *segments;
+	/**
+	 * Number of entries in segments
+	 */
+	size_t count;
+	/**
+	 * Number of slots allocated for segments
+	 */
+	size_t capacity;
+};
+
+/**
+ * Sets up @param log in the directory @param dir, creating it if needed. With @param keep the
+ * segments of an earlier run are loaded and the newest one is recovered through its index,
+ * otherwise they are removed and the log starts with an empty segment at log offset 0.
+ * The other parameters are described in struct aesd_segment_log
+ * @return 0 on success, -1 on error
+ */
+extern int aesd_segment_log_open(struct aesd_segment_log *log, const char *dir, off_t segment_size,
+				 off_t retain_bytes, time_t retain_seconds, bool sync_on_rotate, bool keep);
+
+/**
+ * @return the descriptor the next @param len bytes must be appended to, rotating to a new segment
+ * first if the newest one is full. The bytes count once passed to aesd_segment_log_commit
+ */
+extern int aesd_segment_log_writer(struct aesd_segment_log *log, size_t len);
+
+/**
+ * Adds the @param len bytes at @param buf, appended to the descriptor returned by
+ * aesd_segment_log_writer, to the log and to the index of a kept log
+ */
+extern void aesd_segment_log_commit(struct aesd_segment_log *log, const char *buf, size_t len);
+
+/**
+ * Writes the index entries of the appends committed since the last call to the index of a kept log,
+ * before they are acknowledged. Writers must be serialized like for aesd_segment_log_commit
+ */
+extern void aesd_segment_log_flush(struct aesd_segment_log *log);
+
+/**
+ * @return the log offset the next appended byte gets
+ */
+extern off_t aesd_segment_log_end(struct aesd_segment_log *log);
+
+/**
+ * Opens the oldest retained segment holding bytes at or after log offset @param offset for reading.
+ * @param base and @param end receive the log offsets of its first byte and of the byte after its
+ * last committed one; @param base is past @param offset when the bytes before it were deleted.
+ * The descriptor stays readable after the segment is deleted and must be closed by the caller
+ * @return the descriptor, or -1 if no byte at or after @param offset is stored
+ */
+extern int aesd_segment_log_reader(struct aesd_segment_log *log, off_t offset, off_t *base, off_t *end);
+
+/**
+ * @return the number of bytes currently retained
+ */
+extern off_t aesd_segment_log_retained(struct aesd_segment_log *log);
+
+/**
+ * Deletes the segments outside the retention at time @param now. The newest segment is always kept
+ * @return the number of segments deleted
+ */
+extern size_t aesd_segment_log_expire(struct aesd_segment_log *log, time_t now);
+
+/**
+ * Closes every segment of @param log, and removes them and the directory unless the log is kept
+ */
+extern void aesd_segment_log_close(struct aesd_segment_log *log);
+
+#endif /* AESD_SEGMENT_LOG_H */
@@ -0,0 +1,134 @@
+#!/bin/sh
+# Benchmark scenarios for aesdsocket, run against the file or the char device backend
+# Every scenario starts a fresh aesdsocket, drives it with aesdload and prints the
+# throughput and latency summary, so regressions show up as numbers.
+#
+# Usage : ./aesdload-scenarios.sh {file|device} [extra aesdsocket options]
+# The device backend needs the aesdchar module loaded, see ../aesd-char-driver/aesdchar_load
+
+cd `dirname $0`
+
+backend=$1
+
+if [ $# -gt 0 ]; then
+    shift
+fi
+
+case "$backend" in
+    file)
+         use_device=0
+         lossy=
+         ;;
+
+    device)
+         use_device=1
+         # the driver only keeps the last writes, concurrent records may be gone before their readback
+         lossy=-l
+         if [ ! -c /dev/aesdchar ]; then
+             echo "/dev/aesdchar not found, load the driver with ../aesd-char-driver/aesdchar_load"
+             exit 1
+         fi
+         ;;
+
+    *)
+         echo "Usage : $0 {file|device} [extra aesdsocket options]"
+         exit 1
+esac
+
+extra_options="$*"
+
+make clean > /dev/null
+make CFLAGS="-O2 -g -Wall -Werror -DUSE_AESD_CHAR_DEVICE=${use_device}" aesdsocket aesdload > /dev/null || exit 1
+
+rc=0
+
+# run_scenario <name> <aesdsocket options> <aesdload options>
+run_scenario()
+{
+    echo "== $1 ($backend backend)"
+
+    ./aesdsocket $2 ${extra_options} > /dev/null &
+    server_pid=$!
+    sleep 1
+
+    ./aesdload $3 || rc=1
+
+    kill -INT ${server_pid}
+    wait ${server_pid}
+}
+
+run_scenario "many tiny clients" "" "-c 64 -n 50 -s 32 ${lossy}"
+run_scenario "few huge records" "" "-c 2 -n 8 -s 1048576 ${lossy}"
+
+# the log is never truncated while the server runs, so every round reads back more history
+echo "== growing history ($backend backend)"
+./aesdsocket ${extra_options} > /dev/null &
+server_pid=$!
+sleep 1
+
+for round in 1 2 3 4 5
+do
+    echo "-- round ${round}"
+    ./aesdload -c 4 -n 250 -s 256 ${lossy} || rc=1
+done
+
+kill -INT ${server_pid}
+wait ${server_pid}
+
+# same rounds on a segmented log keeping 256 KB, the readback stops growing once the retention is reached
+if [ "$backend" = "file" ]; then
+    echo "== retained history ($backend backend)"
+    ./aesdsocket -L 65536 -R 262144 ${extra_options} > /dev/null &
+    server_pid=$!
+    sleep 1
+    
+    for round in 1 2 3 4 5
+    do
+        echo "-- round ${round}"
+        ./aesdload -c 4 -n 250 -s 256 -l || rc=1
+        sleep 1
+    done
+    
+    kill -INT ${server_pid}
+    wait ${server_pid}
+fi
+
+run_scenario "pipelined keep-alive" "-k ack" "-m ack -c 16 -n 5000 -s 64"
+# the same records in length-prefixed frames, one write and one reply per frame
+run_scenario "binary frames of 1" "" "-m binary -f 1 -c 16 -n 5000 -s 64"
+run_scenario "binary frames of 64" "" "-m binary -f 64 -c 16 -n 5000 -s 64"
+run_scenario "paced clients" "" "-c 8 -n 100 -s 128 -r 50 ${lossy}"
+
+# the same records over every transport: TCP and Unix stream connections, UDP and Unix datagrams
+# datagrams get no reply, aesdload reports how many reached the log. UDP drops once the socket buffer is full
+unix_stream=/var/tmp/aesdsocket.sock
+unix_dgram=/var/tmp/aesdsocket.dgram
+run_scenario "tcp transport" "-k ack" "-m ack -c 8 -n 5000 -s 64"
+run_scenario "unix stream transport" "-k ack -U ${unix_stream}" "-m ack -c 8 -n 5000 -s 64 -U ${unix_stream}"
+run_scenario "udp transport" "-D 9000" "-m dgram -c 8 -n 5000 -s 64"
+run_scenario "unix datagram transport" "-D ${unix_dgram}" "-m dgram -c 8 -n 5000 -s 64 -U ${unix_dgram}"
+
+# live tail fan-out, every record is sent to 200 subscribers from one shared copy
+run_scenario "200 live tail subscribers" "-m epoll -k ack" "-m ack -c 4 -n 5000 -s 64 -t 200"
+run_scenario "200 live tail subscribers, binary frames" "-m epoll" "-m binary -f 64 -c 4 -n 50000 -s 64 -t 200"
+
+# a grep query only returns the 32 records holding sequence number 4242 out of 320000, compared with the full readback
+run_scenario "filtered readback" "-m epoll -k ack" "-m ack -c 16 -n 20000 -s 128 -g 4242"
+
+# scaling curve of the SO_REUSEPORT reactors, from one reactor up to one per CPU
+# aesdload runs on the same machine, so the curve flattens before the server saturates
+cpus=`nproc`
+acceptors=1
+
+while [ ${acceptors} -le ${cpus} ]
+do
+    run_scenario "${acceptors} of ${cpus} reactors" "-a ${acceptors} -k ack" "-m ack -c 64 -n 2000 -s 64"
+
+    if [ ${acceptors} -lt ${cpus} ] && [ $((acceptors * 2)) -gt ${cpus} ]; then
+        acceptors=${cpus}
+    else
+        acceptors=$((acceptors * 2))
+    fi
+done
+
+exit $rc
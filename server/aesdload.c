@@ -0,0 +1,1092 @@
+/***********************************************************
+* Author: Dazong Chen
+* Date: 10.17.2026
+* Load generator for aesdsocket
+*
+* Opens N concurrent clients to the server, sends records of a configurable
+* size at a configurable rate, validates every reply and reports throughput
+* and p50/p99/p999 latency. The binary mode batches records into the
+* length-prefixed frames of aesdsocket. Clients connect over TCP or a Unix
+* socket, the datagram mode sends every record as one UDP or Unix datagram.
+* Live tail subscribers can watch the run and report how much of it reached them.
+* A grep query after the run is compared with a full readback of the log.
+***********************************************************/
+#define _GNU_SOURCE    // memmem(), htobe64()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/un.h>
+#include <endian.h>
+#include <pthread.h>
+#include <time.h>
+
+
+#define       PORT                   9000       // default aesdsocket port
+#define       CLIENT_COUNT           8
+#define       RECORD_COUNT           100        // records sent by every client
+#define       RECORD_SIZE            64         // bytes per record, newline included
+#define       RECV_CHUNK             65536
+#define       ACK_SIZE               32
+#define       FRAME_RECORDS          1          // records per binary frame
+#define       FRAME_MAX_RECORDS      1024       // aesdsocket rejects larger frames
+#define       BINARY_MAGIC           "AESDBIN1" // switches an aesdsocket connection to frames
+#define       BINARY_MAGIC_LEN       8
+#define       FRAME_HEADER_SIZE      8          // record count and data length, 32 bit each in network byte order
+#define       SINCE_COMMAND          "AESDSOCKET_SINCE:0\n"    // reads back the whole log followed by "CURSOR:<n>\n"
+#define       SETTLE_WAIT_MS         100        // pause between delivery checks of the datagram mode
+#define       SETTLE_TRIES           20
+#define       SUBSCRIBE_COMMAND      "AESDSOCKET_SUBSCRIBE\n"
+#define       GREP_COMMAND           "AESDSOCKET_GREP:"    // "AESDSOCKET_GREP:<pattern>\n" reads back the matching records and the cursor
+#define       GREP_MAX_PATTERN       256
+
+
+typedef enum
+{
+    LOAD_MODE_READBACK,    // one connection per record, the server replies with the whole log and closes
+    LOAD_MODE_ACK,         // one keep-alive connection per client, every record answered by "ACK <n>\n" (aesdsocket -k ack)
+    LOAD_MODE_BINARY,      // one connection per client sending frames of frame_records records, each answered by the log length
+    LOAD_MODE_DGRAM        // one datagram per record, no reply (aesdsocket -D). Delivery is checked through a readback
+
+}load_mode_t;
+
+
+typedef struct
+{
+    pthread_t       thread;
+    int             client_id;
+    uint64_t*       latency_ns;    // one entry per record sent
+    size_t          sent;          // records answered
+    size_t          errors;        // records with a missing, short or invalid reply
+    uint64_t        sent_bytes;
+    uint64_t        received_bytes;
+    char*           record;        // the record being sent, or the whole frame in the binary mode
+    char*           reply;         // readback staging, grown to the largest readback
+    size_t          reply_size;
+
+}client_t;
+
+
+// live tail subscriber counting the records of this run it receives
+typedef struct
+{
+    pthread_t       thread;
+    int             sock;
+    size_t          records;       // complete lines of record_size bytes starting with a client number
+    uint64_t        bytes;
+    size_t          line_len;      // bytes of the current line received so far
+    bool            line_tagged;   // the current line starts with a digit
+    bool            closed;        // the server ended the subscription
+
+}subscriber_t;
+
+
+static void* client_thread(void* arg);
+static int connect_server(int type);
+static bool send_all(int sock, const char* buf, size_t len);
+static bool run_readback(client_t* client, size_t len);
+static bool run_ack(client_t* client, int sock, size_t len, long long* last_ack);
+static bool run_binary(client_t* client, int sock, size_t seq, size_t count, long long* last_ack);
+static size_t count_records(const char* command, size_t* bytes);
+static int subscribe_server(void);
+static void* subscriber_thread(void* arg);
+static uint64_t now_ns(void);
+static void sleep_until(uint64_t deadline);
+static int compare_latency(const void* a, const void* b);
+static double percentile(const uint64_t* sorted, size_t count, double p);
+
+
+const char*           host = "127.0.0.1";
+int                   port = PORT;
+int                   client_count = CLIENT_COUNT;
+size_t                record_count = RECORD_COUNT;
+size_t                record_size = RECORD_SIZE;
+size_t                frame_records = FRAME_RECORDS;
+double                rate = 0;                        // records per second per client, 0 to send back to back
+load_mode_t           load_mode = LOAD_MODE_READBACK;
+bool                  lossy = false;                   // the backend may have evicted a record before its readback
+const char*           unix_path = NULL;                // connect to this Unix socket instead of host and port
+int                   subscriber_count = 0;            // live tail subscribers watching the run
+bool                  subscribers_stopping = false;    // main is shutting the subscriptions down
+const char*           grep_pattern = NULL;             // query the log for this pattern after the run
+struct sockaddr_in    server_addr;
+struct sockaddr_un    unix_addr;
+
+
+int main(int argc, char *argv[])
+{
+    client_t*         clients = NULL;
+    subscriber_t*     subscribers = NULL;
+    uint64_t*         latency = NULL;
+    uint64_t          start = 0;
+    uint64_t          elapsed = 0;
+    uint64_t          sent_bytes = 0;
+    uint64_t          received_bytes = 0;
+    size_t            total = 0;
+    size_t            errors = 0;
+    size_t            delivered = 0;
+    size_t            logged = 0;          // records of record_size already in the log before the run
+    size_t            last = 0;
+    size_t            tail_min = 0;
+    size_t            tail_max = 0;
+    uint64_t          tail_bytes = 0;
+    int               cut_off = 0;
+    double            seconds = 0;
+    char              grep_command[sizeof(GREP_COMMAND) + GREP_MAX_PATTERN + 1];
+    size_t            grep_records = 0;
+    size_t            grep_bytes = 0;
+    uint64_t          grep_ns = 0;
+    size_t            full_records = 0;
+    size_t            full_bytes = 0;
+    uint64_t          full_ns = 0;
+    int               opt;
+    int               i = 0;
+    int               j = 0;
+
+    // -H and -p select the server, -c clients each send -n records of -s bytes at -r records per second
+    // -m picks readback (one connection per record), ack (pipelined keep-alive, aesdsocket -k ack)
+    // binary (frames of -f records on one connection) or dgram (fire and forget datagrams, aesdsocket -D)
+    // -U connects to a Unix stream socket, or sends datagrams to a Unix datagram socket, instead of -H and -p
+    // -t subscribes that many live tails before the run and reports how many of its records each received
+    // -g sends a grep query for the pattern after the run and compares it with a full readback
+    // -l accepts readbacks that no longer hold the record, /dev/aesdchar only keeps the last writes
+    while((opt = getopt(argc, argv, "H:p:c:n:s:r:m:f:U:t:g:l")) != -1)
+    {
+        switch(opt)
+        {
+            case 'H':
+                host = optarg;
+                break;
+
+            case 'p':
+                port = atoi(optarg);
+                break;
+
+            case 'c':
+                client_count = atoi(optarg);
+                break;
+
+            case 'n':
+                record_count = strtoul(optarg, NULL, 10);
+                break;
+
+            case 's':
+                record_size = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'r':
+                rate = strtod(optarg, NULL);
+                break;
+
+            case 'm':
+                if(strcmp(optarg, "readback") == 0)
+                {
+                    load_mode = LOAD_MODE_READBACK;
+                }
+
+                else if(strcmp(optarg, "ack") == 0)
+                {
+                    load_mode = LOAD_MODE_ACK;
+                }
+
+                else if(strcmp(optarg, "binary") == 0)
+                {
+                    load_mode = LOAD_MODE_BINARY;
+                }
+
+                else if(strcmp(optarg, "dgram") == 0)
+                {
+                    load_mode = LOAD_MODE_DGRAM;
+                }
+
+                else
+                {
+                    printf("Unknown mode %s, expected readback, ack, binary or dgram\n", optarg);
+                    return -1;
+                }
+                break;
+
+            case 'f':
+                frame_records = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'U':
+                unix_path = optarg;
+                break;
+
+            case 't':
+                subscriber_count = atoi(optarg);
+                break;
+
+            case 'g':
+                grep_pattern = optarg;
+                break;
+
+            case 'l':
+                lossy = true;
+                break;
+
+            default:
+                printf("Usage: %s [-H host] [-p port] [-c clients] [-n records] [-s record_size] [-r rate] [-m readback|ack|binary|dgram] [-f frame_records] [-U unix_path] [-t subscribers] [-g pattern] [-l]\n", argv[0]);
+                return -1;
+        }
+    }
+
+    // room for the "<client> <seq> " tag that makes every record unique
+    if(client_count <= 0 || record_count == 0 || record_size < 24)
+    {
+        printf("Clients and records must be positive and records at least 24 bytes\n");
+        return -1;
+    }
+
+    if(frame_records == 0 || frame_records > FRAME_MAX_RECORDS)
+    {
+        printf("Frames hold 1 to %d records\n", FRAME_MAX_RECORDS);
+        return -1;
+    }
+
+    // a Unix datagram socket only takes datagrams, the subscribers would need the stream socket
+    if(subscriber_count < 0 || (subscriber_count > 0 && load_mode == LOAD_MODE_DGRAM && unix_path != NULL))
+    {
+        printf("Subscribers must not be negative and need a stream socket\n");
+        return -1;
+    }
+
+    if(grep_pattern != NULL && (*grep_pattern == '\0' || strlen(grep_pattern) > GREP_MAX_PATTERN))
+    {
+        printf("Grep patterns hold 1 to %d bytes\n", GREP_MAX_PATTERN);
+        return -1;
+    }
+
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+
+    if(inet_pton(AF_INET, host, &server_addr.sin_addr) != 1)
+    {
+        printf("Invalid IPv4 address %s\n", host);
+        return -1;
+    }
+
+    if(unix_path != NULL && strlen(unix_path) >= sizeof(unix_addr.sun_path))
+    {
+        printf("Socket path %s is too long\n", unix_path);
+        return -1;
+    }
+
+    if(unix_path != NULL)
+    {
+        unix_addr.sun_family = AF_UNIX;
+        strcpy(unix_addr.sun_path, unix_path);
+    }
+
+    clients = calloc(client_count, sizeof(client_t));
+
+    if(clients == NULL)
+    {
+        printf("failed to allocate clients\n");
+        return -1;
+    }
+
+    if(load_mode == LOAD_MODE_DGRAM)
+    {
+        logged = count_records(SINCE_COMMAND, NULL);
+    }
+
+    subscribers = calloc(subscriber_count > 0 ? subscriber_count : 1, sizeof(subscriber_t));
+
+    if(subscribers == NULL)
+    {
+        printf("failed to allocate subscribers\n");
+        free(clients);
+        return -1;
+    }
+
+    // every subscription is confirmed by its cursor before the first record is sent
+    for(i = 0; i < subscriber_count; i++)
+    {
+        subscribers[i].sock = subscribe_server();
+
+        if(subscribers[i].sock == -1 || pthread_create(&subscribers[i].thread, NULL, subscriber_thread, &subscribers[i]) != 0)
+        {
+            printf("failed to subscribe %d\n", i);
+
+            if(subscribers[i].sock >= 0)
+            {
+                close(subscribers[i].sock);
+            }
+
+            subscriber_count = i;
+            break;
+        }
+    }
+
+    start = now_ns();
+
+    for(i = 0; i < client_count; i++)
+    {
+        clients[i].client_id = i;
+
+        if(pthread_create(&clients[i].thread, NULL, client_thread, &clients[i]) != 0)
+        {
+            printf("failed to create client %d\n", i);
+            client_count = i;
+            break;
+        }
+    }
+
+    for(i = 0; i < client_count; i++)
+    {
+        pthread_join(clients[i].thread, NULL);
+        total += clients[i].sent;
+    }
+
+    elapsed = now_ns() - start;
+    latency = malloc(sizeof(uint64_t) * (total > 0 ? total : 1));
+    total = 0;
+
+    for(i = 0; i < client_count; i++)
+    {
+        if(latency != NULL)
+        {
+            memcpy(latency+total, clients[i].latency_ns, sizeof(uint64_t) * clients[i].sent);
+        }
+
+        total += clients[i].sent;
+        errors += clients[i].errors;
+        sent_bytes += clients[i].sent_bytes;
+        received_bytes += clients[i].received_bytes;
+
+        free(clients[i].latency_ns);
+        free(clients[i].record);
+        free(clients[i].reply);
+    }
+
+    seconds = elapsed / 1e9;
+
+    // nothing answers a datagram, readbacks tell how many made it into the log
+    // the receiver may still be appending, so wait until the count settles
+    for(i = 0; load_mode == LOAD_MODE_DGRAM && i < SETTLE_TRIES; i++)
+    {
+        sleep_until(now_ns() + SETTLE_WAIT_MS * 1000000ULL);
+        last = delivered;
+        delivered = count_records(SINCE_COMMAND, NULL);
+        delivered = (delivered > logged) ? delivered - logged : 0;
+
+        if(delivered == total || (i > 0 && delivered == last))
+        {
+            break;
+        }
+    }
+
+    // the subscribers may still be receiving the end of the run
+    for(i = 0; subscriber_count > 0 && i < SETTLE_TRIES; i++)
+    {
+        last = tail_min;
+        tail_min = (size_t)-1;
+
+        for(j = 0; j < subscriber_count; j++)
+        {
+            if(!__atomic_load_n(&subscribers[j].closed, __ATOMIC_ACQUIRE) &&
+               __atomic_load_n(&subscribers[j].records, __ATOMIC_RELAXED) < tail_min)
+            {
+                tail_min = __atomic_load_n(&subscribers[j].records, __ATOMIC_RELAXED);
+            }
+        }
+
+        if(tail_min == (size_t)-1 || tail_min >= total || (i > 0 && tail_min == last))
+        {
+            break;
+        }
+
+        sleep_until(now_ns() + SETTLE_WAIT_MS * 1000000ULL);
+    }
+
+    tail_min = (size_t)-1;
+    __atomic_store_n(&subscribers_stopping, true, __ATOMIC_RELEASE);
+
+    for(i = 0; i < subscriber_count; i++)
+    {
+        shutdown(subscribers[i].sock, SHUT_RDWR);
+        pthread_join(subscribers[i].thread, NULL);
+        close(subscribers[i].sock);
+
+        tail_bytes += subscribers[i].bytes;
+        tail_min = (subscribers[i].records < tail_min) ? subscribers[i].records : tail_min;
+        tail_max = (subscribers[i].records > tail_max) ? subscribers[i].records : tail_max;
+        cut_off += subscribers[i].closed;
+    }
+
+    // both queries return the records of record_size, the grep one only those matching
+    if(grep_pattern != NULL)
+    {
+        snprintf(grep_command, sizeof(grep_command), "%s%s\n", GREP_COMMAND, grep_pattern);
+
+        grep_ns = now_ns();
+        grep_records = count_records(grep_command, &grep_bytes);
+        grep_ns = now_ns() - grep_ns;
+
+        full_ns = now_ns();
+        full_records = count_records(SINCE_COMMAND, &full_bytes);
+        full_ns = now_ns() - full_ns;
+    }
+
+    printf("clients %d records %zu record_size %zu mode %s transport %s errors %zu\n", client_count, total, record_size,
+           (load_mode == LOAD_MODE_DGRAM) ? "dgram" : (load_mode == LOAD_MODE_BINARY) ? "binary" :
+           (load_mode == LOAD_MODE_ACK) ? "ack" : "readback", (unix_path != NULL) ? "unix" :
+           (load_mode == LOAD_MODE_DGRAM) ? "udp" : "tcp", errors);
+
+    if(load_mode == LOAD_MODE_BINARY)
+    {
+        printf("frame_records %zu\n", frame_records);
+    }
+
+    if(load_mode == LOAD_MODE_DGRAM)
+    {
+        printf("delivered %zu of %zu datagrams\n", delivered, total);
+    }
+
+    if(subscriber_count > 0)
+    {
+        printf("subscribers %d received min %zu max %zu of %zu records, %d cut off, fan-out %.2f MB/s\n", subscriber_count,
+               tail_min, tail_max, total, cut_off, tail_bytes / 1e6 / (elapsed / 1e9));
+    }
+
+    if(grep_pattern != NULL)
+    {
+        printf("grep \"%s\" %zu records %.2f MB in %.2f ms, full readback %zu records %.2f MB in %.2f ms\n", grep_pattern,
+               grep_records, grep_bytes / 1e6, grep_ns / 1e6, full_records, full_bytes / 1e6, full_ns / 1e6);
+    }
+
+    printf("throughput %.1f records/s sent %.2f MB/s received %.2f MB/s\n",
+           total / seconds, sent_bytes / 1e6 / seconds, received_bytes / 1e6 / seconds);
+
+    if(latency != NULL && total > 0)
+    {
+        qsort(latency, total, sizeof(uint64_t), compare_latency);
+        printf("latency us p50 %.1f p99 %.1f p999 %.1f max %.1f\n", percentile(latency, total, 0.50) / 1e3,
+               percentile(latency, total, 0.99) / 1e3, percentile(latency, total, 0.999) / 1e3, latency[total-1] / 1e3);
+    }
+
+    free(latency);
+    free(clients);
+    free(subscribers);
+
+    return (errors == 0 && total == (size_t)client_count * record_count) ? 0 : 1;
+}
+
+
+// send record_count records, latency runs from the scheduled send time to the complete reply
+// so a stalled server is not hidden by the client waiting before its next send.
+// Every record of a binary frame gets the latency of the frame
+static void* client_thread(void* arg)
+{
+    client_t*     client = arg;
+    uint64_t      interval = (rate > 0) ? (uint64_t)(1e9 / rate) : 0;
+    uint64_t      scheduled = 0;
+    uint64_t      latency = 0;
+    long long     last_ack = 0;
+    size_t        seq = 0;
+    size_t        batch = 1;
+    size_t        i = 0;
+    int           tag_len = 0;
+    int           sock = -1;
+    bool          ok = true;
+
+    client->latency_ns = malloc(sizeof(uint64_t) * record_count);
+    client->record = malloc((load_mode == LOAD_MODE_BINARY) ?
+                            FRAME_HEADER_SIZE + frame_records * (sizeof(uint32_t) + record_size) : record_size);
+
+    if(client->latency_ns == NULL || client->record == NULL)
+    {
+        client->errors = record_count;
+        return NULL;
+    }
+
+    if(load_mode != LOAD_MODE_READBACK && (sock = connect_server((load_mode == LOAD_MODE_DGRAM) ? SOCK_DGRAM : SOCK_STREAM)) == -1)
+    {
+        client->errors = record_count;
+        return NULL;
+    }
+
+    if(load_mode == LOAD_MODE_BINARY && !send_all(sock, BINARY_MAGIC, BINARY_MAGIC_LEN))
+    {
+        client->errors = record_count;
+        close(sock);
+        return NULL;
+    }
+
+    memset(client->record, 'a' + client->client_id % 26, record_size);
+    client->record[record_size-1] = '\n';
+
+    scheduled = now_ns();
+
+    for(seq = 0; seq < record_count; seq += batch)
+    {
+        batch = (load_mode == LOAD_MODE_BINARY && record_count - seq < frame_records) ? record_count - seq :
+                (load_mode == LOAD_MODE_BINARY) ? frame_records : 1;
+
+
+        if(interval > 0)
+        {
+            sleep_until(scheduled);
+        }
+
+        else
+        {
+            scheduled = now_ns();
+        }
+
+        if(load_mode == LOAD_MODE_BINARY)
+        {
+            ok = run_binary(client, sock, seq, batch, &last_ack);
+        }
+
+        else
+        {
+            // unique prefix, padded with the client letter up to record_size
+            tag_len = snprintf(client->record, record_size, "%d %zu ", client->client_id, seq);
+            client->record[tag_len] = 'a' + client->client_id % 26;
+
+            if(load_mode == LOAD_MODE_ACK)
+            {
+                ok = run_ack(client, sock, record_size, &last_ack);
+            }
+
+            else if(load_mode == LOAD_MODE_DGRAM)
+            {
+                ok = (send(sock, client->record, record_size, 0) == (ssize_t)record_size);
+            }
+
+            else
+            {
+                ok = run_readback(client, record_size);
+            }
+        }
+
+        if(!ok)
+        {
+            client->errors += batch;
+
+            // the stream is out of step, nothing after this can be trusted
+            if(load_mode == LOAD_MODE_ACK || load_mode == LOAD_MODE_BINARY)
+            {
+                client->errors += record_count - seq - batch;
+                break;
+            }
+
+            continue;
+        }
+
+        latency = now_ns() - scheduled;
+
+        for(i = 0; i < batch; i++)
+        {
+            client->latency_ns[client->sent++] = latency;
+        }
+
+        client->sent_bytes += record_size * batch;
+        scheduled += interval * batch;
+    }
+
+    if(sock >= 0)
+    {
+        close(sock);
+    }
+
+    return NULL;
+}
+
+
+// a socket of type (SOCK_STREAM or SOCK_DGRAM) connected to the server, over TCP/UDP or the Unix socket
+static int connect_server(int type)
+{
+    int    sock = socket((unix_path != NULL) ? AF_UNIX : AF_INET, type, 0);
+    int    option = 1;
+    int    rc = -1;
+
+    if(sock == -1)
+    {
+        perror("socket() failed");
+        return -1;
+    }
+
+    if(unix_path != NULL)
+    {
+        rc = connect(sock, (struct sockaddr*)&unix_addr, sizeof(unix_addr));
+    }
+
+    else
+    {
+        rc = connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr));
+    }
+
+    if(rc == -1)
+    {
+        perror("connect() failed");
+        close(sock);
+        return -1;
+    }
+
+    if(unix_path == NULL && type == SOCK_STREAM)
+    {
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option));
+    }
+
+    return sock;
+}
+
+
+static bool send_all(int sock, const char* buf, size_t len)
+{
+    ssize_t    nbytes = 0;
+
+    while(len > 0)
+    {
+        nbytes = send(sock, buf, len, MSG_NOSIGNAL);
+
+        if(nbytes == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            return false;
+        }
+
+        buf += nbytes;
+        len -= nbytes;
+    }
+
+    return true;
+}
+
+
+// one connection per record: send it, read the whole log back until the server closes
+// the readback must end on a line and hold the record, unless the backend is lossy
+static bool run_readback(client_t* client, size_t len)
+{
+    ssize_t    nbytes = 0;
+    size_t     reply_len = 0;
+    char*      tmp = NULL;
+    bool       rc = false;
+    int        sock = connect_server(SOCK_STREAM);
+
+    if(sock == -1)
+    {
+        return false;
+    }
+
+    if(!send_all(sock, client->record, len))
+    {
+        close(sock);
+        return false;
+    }
+
+    while(1)
+    {
+        if(client->reply_size - reply_len < RECV_CHUNK)
+        {
+            tmp = realloc(client->reply, client->reply_size + RECV_CHUNK + client->reply_size / 2);
+
+            if(tmp == NULL)
+            {
+                close(sock);
+                return false;
+            }
+
+            client->reply = tmp;
+            client->reply_size += RECV_CHUNK + client->reply_size / 2;
+        }
+
+        nbytes = recv(sock, client->reply+reply_len, client->reply_size-reply_len, 0);
+
+        if(nbytes == 0)
+        {
+            break;
+        }
+
+        if(nbytes == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            close(sock);
+            return false;
+        }
+
+        reply_len += nbytes;
+    }
+
+    close(sock);
+    client->received_bytes += reply_len;
+
+    if(reply_len > 0 && client->reply[reply_len-1] == '\n')
+    {
+        rc = lossy || (memmem(client->reply, reply_len, client->record, len) != NULL);
+    }
+
+    return rc;
+}
+
+
+// keep-alive: send the record and wait for its "ACK <log length>\n"
+// every ACK must cover at least the record, and the log never shrinks
+static bool run_ack(client_t* client, int sock, size_t len, long long* last_ack)
+{
+    char         ack[ACK_SIZE];
+    size_t       ack_len = 0;
+    ssize_t      nbytes = 0;
+    long long    value = 0;
+
+    if(!send_all(sock, client->record, len))
+    {
+        return false;
+    }
+
+    // ACKs are tiny and one is outstanding at a time, read up to the newline
+    while(ack_len == 0 || ack[ack_len-1] != '\n')
+    {
+        if(ack_len == sizeof(ack) - 1)
+        {
+            return false;
+        }
+
+        nbytes = recv(sock, ack+ack_len, 1, 0);
+
+        if(nbytes <= 0)
+        {
+            if(nbytes == -1 && errno == EINTR)
+            {
+                continue;
+            }
+
+            return false;
+        }
+
+        ack_len += nbytes;
+    }
+
+    ack[ack_len] = 0;
+    client->received_bytes += ack_len;
+
+    if(sscanf(ack, "ACK %lld", &value) != 1 || value < (long long)len || value < *last_ack)
+    {
+        return false;
+    }
+
+    *last_ack = value;
+
+    return true;
+}
+
+
+// binary: send records seq to seq + count - 1 as one frame and wait for the 8 byte log length answering it
+//   u32 record count, u32 data length, u32 length of each record, the records back to back
+static bool run_binary(client_t* client, int sock, size_t seq, size_t count, long long* last_ack)
+{
+    uint32_t     header[2];
+    uint32_t     record_len = htonl(record_size);
+    uint64_t     ack = 0;
+    size_t       ack_len = 0;
+    size_t       i = 0;
+    ssize_t      nbytes = 0;
+    long long    value = 0;
+    char*        data = client->record + FRAME_HEADER_SIZE + count * sizeof(uint32_t);
+    int          tag_len = 0;
+
+    header[0] = htonl(count);
+    header[1] = htonl(count * record_size);
+    memcpy(client->record, header, FRAME_HEADER_SIZE);
+
+    for(i = 0; i < count; i++)
+    {
+        memcpy(client->record + FRAME_HEADER_SIZE + i * sizeof(uint32_t), &record_len, sizeof(uint32_t));
+
+        memset(data, 'a' + client->client_id % 26, record_size);
+        tag_len = snprintf(data, record_size, "%d %zu ", client->client_id, seq + i);
+        data[tag_len] = 'a' + client->client_id % 26;
+        data[record_size-1] = '\n';
+        data += record_size;
+    }
+
+    if(!send_all(sock, client->record, data - client->record))
+    {
+        return false;
+    }
+
+    while(ack_len < sizeof(ack))
+    {
+        nbytes = recv(sock, (char*)&ack + ack_len, sizeof(ack) - ack_len, 0);
+
+        if(nbytes <= 0)
+        {
+            if(nbytes == -1 && errno == EINTR)
+            {
+                continue;
+            }
+
+            return false;
+        }
+
+        ack_len += nbytes;
+    }
+
+    client->received_bytes += ack_len;
+    value = be64toh(ack);
+
+    if(value < (long long)(count * record_size) || value < *last_ack)
+    {
+        return false;
+    }
+
+    *last_ack = value;
+
+    return true;
+}
+
+
+// a stream connection subscribed to the live tail, the "CURSOR:<n>\n" answer has been read
+static int subscribe_server(void)
+{
+    char       c = 0;
+    ssize_t    nbytes = 0;
+    int        sock = connect_server(SOCK_STREAM);
+
+    if(sock == -1)
+    {
+        return -1;
+    }
+
+    if(!send_all(sock, SUBSCRIBE_COMMAND, strlen(SUBSCRIBE_COMMAND)))
+    {
+        close(sock);
+        return -1;
+    }
+
+    // byte by byte, the records that follow belong to the subscriber thread
+    while(c != '\n')
+    {
+        nbytes = recv(sock, &c, 1, 0);
+
+        if(nbytes <= 0 && !(nbytes == -1 && errno == EINTR))
+        {
+            close(sock);
+            return -1;
+        }
+    }
+
+    return sock;
+}
+
+
+// count the records of the run as they arrive, until the server cuts the subscriber off or main shuts it down
+static void* subscriber_thread(void* arg)
+{
+    subscriber_t*    subscriber = arg;
+    char*            buf = malloc(RECV_CHUNK);
+    char*            line = NULL;
+    char*            newline = NULL;
+    ssize_t          nbytes = 0;
+
+    while(buf != NULL && (nbytes = recv(subscriber->sock, buf, RECV_CHUNK, 0)) != 0)
+    {
+        if(nbytes == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            break;
+        }
+
+        subscriber->bytes += nbytes;
+
+        for(line = buf; line < buf + nbytes; line = newline + 1)
+        {
+            if(subscriber->line_len == 0)
+            {
+                subscriber->line_tagged = (*line >= '0' && *line <= '9');
+            }
+
+            newline = memchr(line, '\n', buf + nbytes - line);
+
+            if(newline == NULL)
+            {
+                subscriber->line_len += buf + nbytes - line;
+                break;
+            }
+
+            if(subscriber->line_len + (newline - line + 1) == record_size && subscriber->line_tagged)
+            {
+                __atomic_add_fetch(&subscriber->records, 1, __ATOMIC_RELAXED);
+            }
+
+            subscriber->line_len = 0;
+        }
+    }
+
+    // the shutdown by main ends recv() as well, only an earlier end counts as a cut off
+    __atomic_store_n(&subscriber->closed, !__atomic_load_n(&subscribers_stopping, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+    free(buf);
+
+    return NULL;
+}
+
+
+// number of records in the reply to command: lines of record_size bytes starting with a client number
+// read back over TCP with a since or grep command, whatever transport the run uses. bytes receives the reply length
+static size_t count_records(const char* command, size_t* bytes)
+{
+    client_t       reader;
+    size_t         count = 0;
+    size_t         len = 0;
+    ssize_t        nbytes = 0;
+    char*          line = NULL;
+    char*          newline = NULL;
+    char*          tmp = NULL;
+    int            sock = -1;
+    const char*    saved_path = unix_path;
+
+    memset(&reader, 0, sizeof(reader));
+
+    unix_path = NULL;
+    sock = connect_server(SOCK_STREAM);
+    unix_path = saved_path;
+
+    if(sock == -1 || !send_all(sock, command, strlen(command)))
+    {
+        if(sock >= 0)
+        {
+            close(sock);
+        }
+
+        return 0;
+    }
+
+    // the readback ends with the "CURSOR:<n>\n" line, keep-alive servers do not close
+    while(1)
+    {
+        if(len > 0 && reader.reply[len-1] == '\n')
+        {
+            newline = memrchr(reader.reply, '\n', len - 1);
+            line = (newline != NULL) ? newline + 1 : reader.reply;
+
+            if(reader.reply + len - line > 7 && memcmp(line, "CURSOR:", 7) == 0)
+            {
+                break;
+            }
+        }
+
+        if(reader.reply_size - len < RECV_CHUNK)
+        {
+            tmp = realloc(reader.reply, reader.reply_size + RECV_CHUNK + reader.reply_size / 2);
+
+            if(tmp == NULL)
+            {
+                break;
+            }
+
+            reader.reply = tmp;
+            reader.reply_size += RECV_CHUNK + reader.reply_size / 2;
+        }
+
+        nbytes = recv(sock, reader.reply + len, reader.reply_size - len, 0);
+
+        if(nbytes <= 0)
+        {
+            break;
+        }
+
+        len += nbytes;
+    }
+
+    close(sock);
+
+    for(line = reader.reply; line < reader.reply + len; line = newline + 1)
+    {
+        newline = memchr(line, '\n', reader.reply + len - line);
+
+        if(newline == NULL)
+        {
+            break;
+        }
+
+        if((size_t)(newline - line + 1) == record_size && *line >= '0' && *line <= '9')
+        {
+            count++;
+        }
+    }
+
+    free(reader.reply);
+
+    if(bytes != NULL)
+    {
+        *bytes = len;
+    }
+
+    return count;
+}
+
+
+static uint64_t now_ns(void)
+{
+    struct timespec    ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static void sleep_until(uint64_t deadline)
+{
+    struct timespec    ts;
+
+    ts.tv_sec = deadline / 1000000000ULL;
+    ts.tv_nsec = deadline % 1000000000ULL;
+
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    {
+    }
+}
+
+
+static int compare_latency(const void* a, const void* b)
+{
+    uint64_t    x = *(const uint64_t*)a;
+    uint64_t    y = *(const uint64_t*)b;
+
+    return (x > y) - (x < y);
+}
+
+
+// nearest rank percentile of an ascending array
+static double percentile(const uint64_t* sorted, size_t count, double p)
+{
+    size_t    rank = (size_t)(p * count + 0.999999);
+
+    if(rank == 0)
+    {
+        rank = 1;
+    }
+
+    if(rank > count)
+    {
+        rank = count;
+    }
+
+    return sorted[rank-1];
+}
@@ -7,6 +7,8 @@
 * https://github.com/cu-ecen-aeld/aesd-lectures/blob/master/lecture9/timer_thread.c
 * https://github.com/stockrt/queue.h/blob/master/sample.c
 ***********************************************************/
+#define _GNU_SOURCE    // accept4(), CPU affinity, memrchr()
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -18,6 +20,7 @@
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <endian.h>
 #include <sys/wait.h>
 #include <signal.h>
 
@@ -27,9 +30,32 @@
 
 #include <sys/queue.h>
 #include <pthread.h>
+#include <sched.h>
 #include <time.h>
 
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <poll.h>
+
+#include "aesd-record-store.h"
+#include "aesd-metrics.h"
+#include "aesd-conn-buffer.h"
+#include "aesd-segment-log.h"
+#include "aesd-log-index.h"
+#include "aesd-crc32c.h"
+#include "aesd-fanout.h"
+#include "aesd-match.h"
+#include "aesd-channel.h"
+#include "../aesd-char-driver/aesd_ioctl.h"
+
+#ifndef USE_AESD_CHAR_DEVICE
 #define USE_AESD_CHAR_DEVICE 1
+#endif
 
 
 #if USE_AESD_CHAR_DEVICE
@@ -45,38 +71,216 @@
 
 #define       MAX_CONNECTION         10         // number of connections to which the queue of pending connections for sockfd may grow.
 #define       BUFFER_SIZE            500
+#define       WORKER_COUNT           8          // default number of pre-spawned workers in thread mode
+#define       CONN_QUEUE_SIZE        32         // default number of accepted connections waiting for a worker
+#define       QUEUE_WAIT_MS          200        // how often a full queue re-checks shut_down_flag
+#define       MAX_EPOLL_EVENTS       64         // events handled per epoll_wait() in epoll mode
+#define       READBACK_BLOCK_SIZE    65536      // bytes staged per send() when OUTPUT_FILE can not be sendfile()d
+#define       READBACK_SENDFILE_MAX  (1 << 30)  // bytes requested per sendfile() call
+#define       READBACK_IOV_MAX       256        // records gathered per sendmsg() when reading back from the record store
+#define       READBACK_TO_EOF        ((off_t)(~0ULL >> (65 - sizeof(off_t) * 8)))    // largest off_t, a limit only EOF ends
+#define       REPLY_SIZE             48         // room for "ACK <log length>\n", "CURSOR:<log offset>\n" or "CHANNEL:<name>\n"
+#define       SINCE_COMMAND          "AESDSOCKET_SINCE:"    // "AESDSOCKET_SINCE:<offset>\n" reads back only what follows offset
+#define       EVICTED_REPLY          "EVICTED:"             // "EVICTED:<oldest offset>\n" answers a since command whose records the char device dropped
+#define       SINCE_MAX_DIGITS       18
+#define       SUBSCRIBE_COMMAND      "AESDSOCKET_SUBSCRIBE"    // "AESDSOCKET_SUBSCRIBE\n" streams every record appended from now on
+#define       GREP_COMMAND           "AESDSOCKET_GREP:"     // "AESDSOCKET_GREP:<pattern>\n" reads back only the records containing pattern
+#define       CHANNEL_COMMAND        "AESDSOCKET_CHANNEL:"  // "AESDSOCKET_CHANNEL:<name>\n" sends the connection's records to a named channel
+#define       CHANNEL_DIR            "/var/tmp/aesdsocketdata.channels"    // data files of the named channels
+#define       GROUP_COMMIT_MAX_BATCH 256        // records written per writev() by the committer
+#define       BATCH_STATS_BUCKETS    9          // batch sizes 1, 2-3, 4-7 ... 256
+#define       STATS_REQUEST_WAIT_MS  100        // how long a stats client may take to send an HTTP request
+#define       STATS_REQUEST_SIZE     1024
+#define       TIMESTAMP_INTERVAL_S   10         // seconds between timestamp records
+#define       TIMESTAMP_SIZE         100
+#define       SEGMENT_DIR            "/var/tmp/aesdsocketdata.d"    // segment files of the segmented file backend
+#define       OUTPUT_INDEX           "/var/tmp/aesdsocketdata.idx"  // sidecar index of the file backend kept for warm restarts
+#define       SEGMENT_SIZE           (64 << 20) // default segment size of the segmented log
+#define       RETENTION_INTERVAL_MS  1000       // how often segments outside the retention are looked for
+#define       BINARY_MAGIC           "AESDBIN1" // first bytes of a connection that sends length-prefixed frames
+#define       BINARY_MAGIC_LEN       8
+#define       FRAME_HEADER_SIZE      8          // record count and data length, 32 bit each in network byte order
+#define       FRAME_MAX_RECORDS      1024
+#define       FRAME_MAX_DATA         (64 << 20)
+#define       FRAME_INVALID          ((size_t)-1)    // next_record_len() of a frame that breaks the protocol
+#define       FRAME_ACK_SIZE         8          // log length after the frame, 64 bit in network byte order
+#define       DGRAM_BATCH            64         // datagrams received per recvmmsg()
+#define       DGRAM_MAX_SIZE         65536      // longer datagrams are cut short by the kernel and dropped
+#define       DGRAM_RCVBUF           (4 << 20)  // socket receive buffer asked for, absorbs bursts between batches
+
+
+
+
 
+// bounded MPMC queue of accepted client sockets feeding the worker pool
+typedef struct
+{
+    int*              fds;
+    uint64_t*         accepted;     // aesd_metrics_clock() when each queued socket was accepted
+    int               size;         // number of slots in fds
+    int               head;         // next slot to pop
+    int               count;        // sockets currently queued
+    bool              closed;
+    pthread_mutex_t   lock;
+    pthread_cond_t    not_empty;
+    pthread_cond_t    not_full;
+    
+}conn_queue_t;
 
 
+typedef enum
+{
+    BACKPRESSURE_DELAY,    // stop accepting until a worker frees a queue slot
+    BACKPRESSURE_SHED      // accept and immediately close connections that do not fit
+    
+}backpressure_t;
 
 
 typedef struct
 {
     pthread_t     thread;
     int           thread_id;
-    int           client_fd;
+    int           client_fd;    // connection being served, -1 while idle. Protected by queue->lock
+    uint64_t      accepted;     // aesd_metrics_clock() when client_fd was accepted
     int           fd;
-    char*         read_buf;
-    char*         write_buf;
+    struct aesd_conn_buffer buffer;    // receive buffer of the connection being served
     sigset_t      mask;
-    bool          is_completed;
+    conn_queue_t* queue;
 
 }threadParams_t;
 
-typedef struct slist_data_s   slist_data_t;
-struct slist_data_s
+
+typedef struct
+{
+    int           fd;
+    int           timer_fd;     // timerfd driving the timestamps
+    int           stop_fd;      // eventfd stopping timer_thread at shutdown
+    pthread_t     thread;
+    
+}timer_data_t;
+
+
+typedef enum
+{
+    SERVER_MODE_THREAD,    // one pthread per accepted connection
+    SERVER_MODE_EPOLL      // single non-blocking, edge-triggered epoll loop
+    
+}server_mode_t;
+
+
+// one epoll reactor, owns a listener on PORT and every connection accepted on it
+typedef struct
+{
+    pthread_t     thread;
+    int           id;
+    int           cpu;          // CPU the reactor thread is pinned to, -1 to leave it unpinned
+    int           listen_fd;
+    int           signal_fd;    // shutdown signals, only watched by reactor 0
+
+}reactor_t;
+
+
+// progress of streaming OUTPUT_FILE back to one client
+typedef struct
 {
+    off_t           offset;        // next byte of OUTPUT_FILE to send
+    off_t           limit;         // committed length of OUTPUT_FILE when the readback started
+    size_t          seq;           // next record to send when serving from the record store
+    size_t          record_off;    // bytes of record seq already sent
+    char*           buf;           // staging block, only allocated by the char device backend
+    size_t          buf_len;       // bytes staged in buf
+    size_t          buf_off;       // bytes of buf already sent
+    bool            eof;           // OUTPUT_FILE has been read to the end
+    size_t          sent_bytes;
+    unsigned int    syscalls;      // read()/send()/sendfile() calls issued so far
+    uint64_t        started;       // aesd_metrics_clock() at readback_init()
+    off_t           base;          // log offset of the oldest byte the char device held when last checked, 0 for the files
+    bool            evicted;       // the char device evicted rb->offset before it was read, the readback stopped there
+    int             segment_fd;    // segment being sent by the segmented log, -1 if none
+    off_t           segment_base;  // log offset of the first byte of segment_fd
+    off_t           segment_end;   // log offset just past the bytes of segment_fd committed when it was opened
+    const struct aesd_match* filter;    // only records containing this pattern are sent, NULL to send everything
+    struct aesd_channel* channel;  // channel being read back, NULL for the default log
+    off_t           line_start;    // log offset of the record a filtered readback is scanning
+    bool            line_match;    // the record at offset matched in an earlier block, send it up to its newline
+    size_t          scanned_bytes; // bytes of the log a filtered readback has looked at
+    
+}readback_t;
 
-    threadParams_t threadParams;
-    SLIST_ENTRY(slist_data_s) entries;
+
+// one record waiting for the group commit stage, lives on the appender's stack
+typedef struct log_request_s   log_request_t;
+struct log_request_s
+{
+    const char*         buf;
+    size_t              len;
+    ssize_t             result;      // bytes written, -1 on failure
+    off_t               end;         // committed length right after this record
+    bool                done;
+    struct timespec     enqueued;
+    STAILQ_ENTRY(log_request_s) entries;
 };
 
+STAILQ_HEAD(log_request_list_s, log_request_s);
 
+
+// group commit counters for one range of batch sizes
 typedef struct
 {
-    int fd;
+    unsigned long         batches;
+    unsigned long         records;
+    unsigned long         bytes;
+    long long             commit_ns;    // time spent in writev() and fdatasync()
+    long long             wait_ns;      // sum of enqueue to publish latency over all records
     
-}timer_data_t;
+}batch_stats_t;
+
+
+// how a connection delimits its records, decided by its first bytes
+typedef enum
+{
+    FRAMING_UNKNOWN,       // every byte so far matches the start of BINARY_MAGIC
+    FRAMING_TEXT,          // newline terminated lines
+    FRAMING_BINARY         // frames of length-prefixed records, see frame_append()
+    
+}framing_t;
+
+
+// per-connection state machine used by the epoll mode
+typedef enum
+{
+    CONN_STATE_RECV,       // collecting bytes until a newline completes the packet
+    CONN_STATE_SEND,       // sending the reply (readback and/or ACK or cursor) for the last record
+    CONN_STATE_TAIL        // subscribed, sending records as they are appended until the peer leaves
+    
+}conn_state_t;
+
+typedef struct conn_s   conn_t;
+struct conn_s
+{
+    int               client_fd;
+    int               fd;
+    int               epoll_fd;      // reactor the connection belongs to
+    conn_state_t      state;
+    framing_t         framing;
+    uint64_t          accepted;      // aesd_metrics_clock() at accept, 0 once the first bytes arrived
+    uint64_t          line_started;  // aesd_metrics_clock() when the pending line started, 0 between lines
+    struct aesd_conn_buffer buffer;  // received bytes, buffer.start is the next record
+    bool              peer_closed;   // recv() returned 0, only buffered records are left
+    bool              readback_pending;    // readback still has to be streamed
+    bool              cursor_reply;        // follow the readback with the new cursor
+    char              reply[REPLY_SIZE];
+    size_t            reply_len;           // bytes of reply to send after the readback
+    size_t            reply_off;
+    readback_t        readback;
+    struct aesd_match filter;        // pattern of a grep command, readback.filter points here
+    struct aesd_channel* channel;    // records go to and are read back from this channel, NULL for the default log
+    bool              channel_reply;       // the reply confirms a channel command, the connection waits for its records
+    struct aesd_fanout_subscriber* subscriber;    // live tail of a subscribed connection, NULL otherwise
+    LIST_ENTRY(conn_s) entries;
+};
+
+LIST_HEAD(conn_list_s, conn_s);
 
 
 static inline void timespec_add( struct timespec *result,
@@ -91,40 +295,122 @@ static inline void timespec_add( struct timespec *result,
     }
 }
 
-unsigned char* realloc_memory(const unsigned char* buf, int old_size, int new_size);
-void* send_receive_packet(void* threadp);
+bool send_receive_packet(threadParams_t* threadParams);
+static void* worker_thread(void* threadp);
+static int run_thread_server(sigset_t* mask);
+static int run_epoll_server(sigset_t* mask);
+static int open_listener(void);
+static int unix_socket_bind(const char* path, int type);
+static void log_accepted(int listen_fd, struct sockaddr_in* addr);
 void sig_handler(int signo);
 void* get_in_addr(struct sockaddr *sa);
-static void timer_thread(union sigval sigval);
+static size_t next_record_len(struct aesd_conn_buffer* buffer, framing_t* framing);
+static size_t record_space(struct aesd_conn_buffer* buffer, framing_t framing);
+static bool frame_append(struct aesd_channel* channel, int output_fd, const char* buf, size_t len, char* ack);
+static bool parse_since_command(const char* buf, size_t len, off_t* cursor);
+static bool parse_subscribe_command(const char* buf, size_t len);
+static bool parse_grep_command(const char* buf, size_t len, struct aesd_match* filter);
+static bool parse_channel_command(const char* buf, size_t len, struct aesd_channel** channel, char* reply, size_t* reply_len);
+static struct aesd_fanout_subscriber* log_subscribe(struct aesd_channel* channel, off_t* cursor);
+static void log_unsubscribe(struct aesd_channel* channel, struct aesd_fanout_subscriber* subscriber);
+static bool run_subscriber(struct aesd_channel* channel, int client_fd);
+static bool process_record(struct aesd_channel* channel, int output_fd, int client_fd, const char* buf, size_t len);
+static ssize_t log_append(struct aesd_channel* channel, int output_fd, const char* buf, size_t len, off_t* end);
+static off_t log_snapshot(struct aesd_channel* channel, off_t* base);
+static void log_sync_device(void);
+static void log_flush_index(void);
+static int log_open(void);
+static int committer_start(int* output_fd);
+static void committer_finish(void);
+static void log_lock(void);
+static void lock_recorded(pthread_mutex_t* mutex);
+static int stats_start(void);
+static void stats_finish(void);
+static void readback_init(readback_t* rb, struct aesd_channel* channel, off_t limit);
+static void readback_seek(readback_t* rb, off_t offset);
+static void readback_start(readback_t* rb, struct aesd_channel* channel);
+static bool readback_since(readback_t* rb, off_t cursor);
+static ssize_t readback_pread(readback_t* rb, int fd, char* buf, size_t size, off_t offset);
+static int readback_run(readback_t* rb, int fd, int client_fd);
+static int readback_run_store(readback_t* rb, const struct aesd_record_store* store, int client_fd);
+static int readback_run_filter(readback_t* rb, int fd, int client_fd);
+static void readback_finish(readback_t* rb);
+static void* timer_thread(void* arg);
+static int timer_start(timer_data_t* td, int output_fd);
+static void timer_finish(timer_data_t* td);
+static int retention_start(void);
+static void retention_finish(void);
+static int dgram_start(void);
+static void dgram_finish(void);
 
-pthread_mutex_t locker = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t locker = PTHREAD_MUTEX_INITIALIZER;    // serializes appends to OUTPUT_FILE
+off_t                 committed_bytes = 0;             // bytes appended to OUTPUT_FILE so far, protected by locker
+bool                  use_record_store = false;        // serve readbacks from memory instead of OUTPUT_FILE
+struct aesd_record_store record_store;                 // appended under locker, read without it
 struct sockaddr_in    server_addr;
 struct sockaddr_in    client_addr;
 int                   server_fd;
 int                   client_fd;
 int                   fd;
 bool                  shut_down_flag = false;
+server_mode_t         server_mode = SERVER_MODE_THREAD;
+int                   worker_count = WORKER_COUNT;
+int                   conn_queue_size = CONN_QUEUE_SIZE;
+int                   acceptor_count = 1;              // epoll reactors, each with its own listener and CPU
+int                   reactor_stop_fd = -1;            // eventfd telling every reactor to shut down
+backpressure_t        backpressure = BACKPRESSURE_DELAY;
+bool                  keep_alive = false;              // keep connections open and treat every line as a record
+bool                  ack_replies = false;             // with keep_alive, answer each record with an ACK instead of a readback
+bool                  group_commit = false;            // batch concurrent appends through committer_thread
+unsigned long         sync_every_records = 0;          // fdatasync() OUTPUT_FILE after this many records, 0 to never
+long                  sync_every_usec = 0;             // fdatasync() OUTPUT_FILE at least this often, 0 to never
+pthread_t             committer;
+bool                  committer_running = false;       // protected by locker, like everything below
+bool                  committer_stop = false;
+struct log_request_list_s pending_records = STAILQ_HEAD_INITIALIZER(pending_records);
+pthread_cond_t        commit_pending = PTHREAD_COND_INITIALIZER;    // signals committer_thread
+pthread_cond_t        commit_done = PTHREAD_COND_INITIALIZER;       // wakes appenders after a batch is published
+batch_stats_t         batch_stats[BATCH_STATS_BUCKETS];
+const char*           stats_addr = NULL;               // -S port or Unix socket path serving the metrics
+int                   stats_fd = -1;
+int                   stats_stop_fd = -1;              // eventfd waking stats_thread at shutdown
+pthread_t             stats_thread_id;
+bool                  segmented_log = false;           // file backend split into SEGMENT_DIR segments
+off_t                 segment_size = SEGMENT_SIZE;
+off_t                 retain_bytes = 0;                // delete the oldest segments past this many bytes, 0 to keep them
+time_t                retain_seconds = 0;              // delete segments not written for this long, 0 to keep them
+struct aesd_segment_log segment_log;                   // written under locker
+int                   retention_stop_fd = -1;          // eventfd waking retention_thread at shutdown
+pthread_t             retention_thread_id;
+bool                  warm_restart = false;            // keep the file backend across restarts, indexed for a fast recovery
+struct aesd_log_index log_index;                       // index of OUTPUT_FILE with warm_restart, written under locker
+const char*           unix_path = NULL;                // -U Unix stream socket served like PORT
+int                   unix_listen_fd = -1;
+const char*           dgram_addr = NULL;               // -D UDP port or Unix datagram socket path records are received on
+int                   dgram_fd = -1;
+int                   dgram_stop_fd = -1;              // eventfd waking dgram_thread at shutdown
+pthread_t             dgram_thread_id;
+struct aesd_fanout    fanout;                          // live tail subscribers, published to under locker
+enum aesd_fanout_policy fanout_policy = AESD_FANOUT_DISCONNECT;
+struct aesd_channel_set channels;                      // named channels next to the default log, each with its own lock
+const char*           listener_channel_name = NULL;    // -C channel of the -U and -D listeners
+struct aesd_channel*  listener_channel = NULL;         // NULL while they feed the default log
 
 
 int main(int argc, char *argv[])
 {
     pid_t          pid = 0;
     bool           daemon_flag = false;
-    socklen_t      addr_size;
     sigset_t       mask;
-    int            thread_id = 1;
+    int            opt;
     char           buf[BUFFER_SIZE];
+    timer_data_t   td;
 
     memset(buf, 0, sizeof(buf));
     printf("%s\n", OUTPUT_FILE);
-    slist_data_t *datap = NULL;
-    
-
-    int clock_id = CLOCK_MONOTONIC;
     
-    SLIST_HEAD(slisthead, slist_data_s) head;
-    SLIST_INIT(&head);
-
+    td.timer_fd = -1;
+    td.stop_fd = -1;
     
     // setup syslog
     openlog(NULL, 0, LOG_USER);
@@ -133,71 +419,310 @@ int main(int argc, char *argv[])
     signal(SIGINT, sig_handler);
     signal(SIGTERM, sig_handler);
     
+    // sendfile() has no MSG_NOSIGNAL, a client leaving mid-readback must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    
     // signals to be masked
     sigemptyset(&mask);
     sigaddset(&mask, SIGINT);
     sigaddset(&mask, SIGTERM);
 
-    if(argc == 2)
+    // -d runs as a daemon, -m selects how connections are served
+    // -w, -q and -b size the thread mode worker pool and pick its backpressure policy
+    // -r keeps every record in memory and serves readbacks from there, only with a backend that keeps every record too
+    // -k keeps connections open for pipelined lines, answering each with a readback or an ACK
+    // -g batches appends through one committer, -s and -u make it fdatasync() every N records or M microseconds
+    // -S serves counters and latency histograms in text exposition format on a local port or Unix socket
+    // -a runs the epoll mode as that many CPU pinned reactors with SO_REUSEPORT listeners, 0 for one per CPU
+    // -L splits the file backend into segments of that many bytes, -R and -T keep only the newest bytes or seconds of them
+    // -W keeps the file backend across restarts, recovering it from a checksummed sidecar index
+    // -U also serves connections on a Unix stream socket, -D appends every datagram received on a UDP port or
+    // Unix datagram socket as a record, without a reply
+    // -F picks what happens to a live tail subscriber that falls behind, disconnect it or drop records for it
+    // -C sends what arrives on the -U and -D listeners to a named channel instead of the default log
+    while((opt = getopt(argc, argv, "dm:w:q:b:rk:gs:u:S:a:L:R:T:WU:D:F:C:")) != -1)
     {
-        if(strcmp(argv[1], "-d") == 0)
+        switch(opt)
         {
-            daemon_flag = true;
+            case 'd':
+                daemon_flag = true;
+                break;
+                
+            case 'm':
+                if(strcmp(optarg, "epoll") == 0)
+                {
+                    server_mode = SERVER_MODE_EPOLL;
+                }
+                
+                else if(strcmp(optarg, "thread") == 0)
+                {
+                    server_mode = SERVER_MODE_THREAD;
+                }
+                
+                else
+                {
+                    printf("Unknown mode %s, expected thread or epoll\n", optarg);
+                    return -1;
+                }
+                break;
+                
+            case 'w':
+                worker_count = atoi(optarg);
+                break;
+                
+            case 'q':
+                conn_queue_size = atoi(optarg);
+                break;
+                
+            case 'b':
+                if(strcmp(optarg, "shed") == 0)
+                {
+                    backpressure = BACKPRESSURE_SHED;
+                }
+                
+                else if(strcmp(optarg, "delay") == 0)
+                {
+                    backpressure = BACKPRESSURE_DELAY;
+                }
+                
+                else
+                {
+                    printf("Unknown backpressure policy %s, expected delay or shed\n", optarg);
+                    return -1;
+                }
+                break;
+                
+            case 'r':
+                use_record_store = true;
+                break;
+                
+            case 'k':
+                keep_alive = true;
+                
+                if(strcmp(optarg, "ack") == 0)
+                {
+                    ack_replies = true;
+                }
+                
+                else if(strcmp(optarg, "readback") != 0)
+                {
+                    printf("Unknown reply %s, expected readback or ack\n", optarg);
+                    return -1;
+                }
+                break;
+                
+            case 'g':
+                group_commit = true;
+                break;
+                
+            case 's':
+                group_commit = true;
+                sync_every_records = strtoul(optarg, NULL, 10);
+                break;
+                
+            case 'u':
+                group_commit = true;
+                sync_every_usec = strtol(optarg, NULL, 10);
+                break;
+                
+            case 'S':
+                stats_addr = optarg;
+                break;
+                
+            case 'a':
+                server_mode = SERVER_MODE_EPOLL;
+                acceptor_count = atoi(optarg);
+                
+                if(acceptor_count == 0)
+                {
+                    acceptor_count = sysconf(_SC_NPROCESSORS_ONLN);
+                }
+                break;
+                
+            case 'L':
+                segmented_log = true;
+                segment_size = strtoll(optarg, NULL, 10);
+                break;
+                
+            case 'R':
+                segmented_log = true;
+                retain_bytes = strtoll(optarg, NULL, 10);
+                break;
+                
+            case 'T':
+                segmented_log = true;
+                retain_seconds = strtol(optarg, NULL, 10);
+                break;
+                
+            case 'W':
+                warm_restart = true;
+                break;
+                
+            case 'U':
+                unix_path = optarg;
+                break;
+                
+            case 'D':
+                dgram_addr = optarg;
+                break;
+                
+            case 'F':
+                if(strcmp(optarg, "drop") == 0)
+                {
+                    fanout_policy = AESD_FANOUT_DROP;
+                }
+                
+                else if(strcmp(optarg, "disconnect") == 0)
+                {
+                    fanout_policy = AESD_FANOUT_DISCONNECT;
+                }
+                
+                else
+                {
+                    printf("Unknown subscriber policy %s, expected disconnect or drop\n", optarg);
+                    return -1;
+                }
+                break;
+                
+            case 'C':
+                listener_channel_name = optarg;
+                break;
+                
+            default:
+                printf("Usage: %s [-d] [-m thread|epoll] [-w workers] [-q queue_size] [-b delay|shed] [-r] [-k readback|ack] "
+                       "[-g] [-s sync_records] [-u sync_usec] [-S stats_port|stats_path] [-a acceptors] "
+                       "[-L segment_bytes] [-R retain_bytes] [-T retain_seconds] [-W] [-U unix_path] [-D udp_port|dgram_path] "
+                       "[-F disconnect|drop] [-C channel]\n", argv[0]);
+                return -1;
         }
     }
     
-    server_fd = socket(PF_INET, SOCK_STREAM, 0);
+    if(worker_count <= 0 || conn_queue_size <= 0 || acceptor_count <= 0)
+    {
+        printf("Worker count, queue size and acceptor count must be positive\n");
+        return -1;
+    }
     
-    if(server_fd == -1)
+    if(segmented_log && (USE_AESD_CHAR_DEVICE || segment_size <= 0 || retain_bytes < 0 || retain_seconds < 0))
     {
-    	perror("Socket is not created successfully\n");
-    	return -1;
+        printf("The segmented log needs the file backend, a positive segment size and non-negative retention\n");
+        return -1;
     }
     
-    int option = 1;
+    // the record store only holds what was appended since the start, it would not match a kept log
+    if(warm_restart && (USE_AESD_CHAR_DEVICE || use_record_store))
+    {
+        printf("Warm restart needs the file backend and can not be combined with -r\n");
+        return -1;
+    }
     
-    // attaching socket to the port 9000 to avoid bind error
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &option, sizeof(option)) == -1)
+    // the store never drops a record, the char device and the retention do, so readbacks would depend on -r
+    if(use_record_store && (USE_AESD_CHAR_DEVICE || retain_bytes > 0 || retain_seconds > 0))
     {
-        perror("setsockopt failed");
-       	exit(-1);
+        printf("The record store needs the file backend without retention (-R, -T)\n");
+        return -1;
     }
-
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(PORT);
-    server_addr.sin_addr.s_addr = INADDR_ANY;
     
-    // Bind to the set port and IP:
-    if(bind(server_fd, (struct sockaddr*)&server_addr, sizeof(server_addr))<0)
+    if(listener_channel_name != NULL && !aesd_channel_name_valid(listener_channel_name, strlen(listener_channel_name)))
     {
-        printf("Couldn't bind to the port\n");
+        printf("Channel names are 1 to %d letters, digits, '-' or '_'\n", AESD_CHANNEL_NAME_MAX);
         return -1;
     }
-
-    else
+    
+    aesd_record_store_init(&record_store);
+    aesd_fanout_init(&fanout, fanout_policy);
+    
+    // metrics are only recorded when someone can read them
+    if(stats_addr != NULL)
     {
-        printf("Done with binding\n");
+        aesd_metrics_enable();
     }
     
+    server_fd = open_listener();
     
-    if(listen(server_fd, MAX_CONNECTION) == -1)
+    if(server_fd == -1)
     {
-    	perror("Server listen failed\n");
     	return -1;
     }
     
+    if(unix_path != NULL)
+    {
+        unix_listen_fd = unix_socket_bind(unix_path, SOCK_STREAM);
+        
+        if(unix_listen_fd == -1 || listen(unix_listen_fd, MAX_CONNECTION) == -1)
+        {
+            perror("Unix listener setup failed\n");
+            return -1;
+        }
+    }
+    
+    printf("Done with binding\n");
+    
     printf("here 4\n");
     
-    // create output file
-    fd = open(OUTPUT_FILE, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    // create output file, appending so timestamps never overwrite client data
+    // the segmented log opens its own segment files instead
+    if(segmented_log)
+    {
+        fd = -1;
+        
+        if(aesd_segment_log_open(&segment_log, SEGMENT_DIR, segment_size, retain_bytes, retain_seconds,
+                                 sync_every_records > 0 || sync_every_usec > 0, warm_restart) != 0)
+        {
+            perror("segmented log setup failed\n");
+            return -1;
+        }
+        
+        committed_bytes = aesd_segment_log_end(&segment_log);
+    }
+    
+    else
+    {
+        // a warm restart continues the existing file after recovering its index
+        fd = open(OUTPUT_FILE, O_RDWR | O_CREAT | (warm_restart ? 0 : O_TRUNC) | O_APPEND, 0644);
+        
+        //printf("fd = %d\n",fd);
+        if(fd < 0)
+        {
+            perror("open() failed\n");
+            return -1;
+        }
+        
+        if(warm_restart && aesd_log_index_open(&log_index, OUTPUT_INDEX, fd, 0) != 0)
+        {
+            perror("index recovery failed\n");
+            return -1;
+        }
+        
+        committed_bytes = warm_restart ? log_index.end : 0;
+        log_sync_device();    // the char device may hold records already
+    }
     
-    //printf("fd = %d\n",fd);
-    if(fd < 0)
+    // named channels are kept across restarts along with the default log
+    if(aesd_channel_set_open(&channels, CHANNEL_DIR, warm_restart, use_record_store, fanout_policy) != 0)
     {
-        perror("open() failed\n");
+        perror("channel setup failed\n");
         return -1;
     }
     
+    if(listener_channel_name != NULL)
+    {
+        listener_channel = aesd_channel_get(&channels, listener_channel_name, strlen(listener_channel_name));
+        
+        if(listener_channel == NULL)
+        {
+            return -1;
+        }
+        
+        aesd_metrics_gauge_set(AESD_METRICS_CHANNELS, aesd_channel_count(&channels));
+    }
+    
+    if(warm_restart)
+    {
+        syslog(LOG_INFO, "Warm restart with %lld bytes of history, crc32c using %s",
+               (long long)committed_bytes, aesd_crc32c_impl());
+    }
+    
     printf("here 1\n");
     
     if(daemon_flag == true)
@@ -236,377 +761,3687 @@ int main(int argc, char *argv[])
     }
 
     
-    struct sigevent    sev;
+    // threads do not survive the fork, start the committer, the stats listener and the timer in the daemon
+    // SIGINT/SIGTERM stay with the main thread
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
     
-    memset(&sev,0,sizeof(struct sigevent));
-    
-    timer_data_t       td;
-    td.fd = fd;
+    if(group_commit)
+    {
+        committer_start(&fd);
+    }
     
-    //Setup a call to timer_thread passing in the td structure as the sigev_value argument
-
-    sev.sigev_notify = SIGEV_THREAD;
-    sev.sigev_value.sival_ptr = &td;
-    sev.sigev_notify_function = timer_thread;
+    if(stats_addr != NULL)
+    {
+        stats_start();
+    }
     
-    struct timespec     start_time;
-    timer_t             timerid;
+    // the char device only holds client records, timestamps are written to the file backend
+    if(!USE_AESD_CHAR_DEVICE)
+    {
+        timer_start(&td, fd);
+    }
     
+    if(segmented_log && (retain_bytes > 0 || retain_seconds > 0))
+    {
+        retention_start();
+    }
     
-    if ( timer_create(clock_id, &sev, &timerid) != 0 )
+    if(dgram_addr != NULL)
     {
-        printf("Error %d (%s) creating timer!\n",errno,strerror(errno));
+        dgram_start();
     }
     
-    //printf("timer_create\n");
+    pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
     
-    //start_time.tv_sec += 10;
+    // fd stays open until shutdown, the timer keeps writing timestamps through it
+    if(server_mode == SERVER_MODE_EPOLL)
+    {
+        run_epoll_server(&mask);
+    }
     
-    if ( clock_gettime(clock_id, &start_time) != 0 ) 
+    else
     {
-        printf("Error %d (%s) getting clock %d time\n", errno, strerror(errno), clock_id);
+        run_thread_server(&mask);
     }
-    //printf("clock_gettime\n");
     
+    // datagrams may still be going through the committer
+    dgram_finish();
+    timer_finish(&td);
     
-    struct itimerspec itimerspec;
-    itimerspec.it_interval.tv_sec = 10;
-    itimerspec.it_interval.tv_nsec = 0;
+    if(group_commit)
+    {
+        committer_finish();
+    }
     
-    timespec_add(&itimerspec.it_value,&start_time,&itimerspec.it_interval);
+    stats_finish();
+    retention_finish();
+
+    close(server_fd);
     
-    if( timer_settime(timerid, TIMER_ABSTIME, &itimerspec, NULL ) != 0 ) 
+    if(unix_listen_fd >= 0)
     {
-        printf("Error %d (%s) setting timer\n",errno,strerror(errno));
+        close(unix_listen_fd);
+        unlink(unix_path);
     }
     
-    //printf("timer_settime\n");
-    close(fd);
+    if(segmented_log)
+    {
+        aesd_segment_log_close(&segment_log);
+    }
     
-    addr_size = sizeof(struct sockaddr);
-    memset(&client_addr, 0, addr_size);
-    printf("here 2\n");
-    while(!shut_down_flag)
+    else if(warm_restart)
     {
-        
-        client_fd = accept(server_fd, (struct sockaddr*)&client_addr, &addr_size);
-        
-        if(client_fd == -1)
-    	{
-    	    perror("socket is not accepting successfully\n");
-    	    printf("socket is not accepting successfully\n");
-    	    break;
-    	    //return -1;
-    	}
-        
-        if(shut_down_flag == true)
-        {
-            break;
-        }
-        
-        
-    	else
-    	{
-    	    char client_ip6[INET6_ADDRSTRLEN]; // space to hold the IPv6 string
-    	    inet_ntop(AF_INET, get_in_addr((struct sockaddr*)&client_addr), client_ip6, sizeof client_ip6);
-    	    syslog(LOG_DEBUG, "Accepted connection from %s", client_ip6);
-    	    //printf("Accepted connection from %s\n", client_ip6);
-    	    
-    	    // create new thread
-    	    datap = malloc(sizeof(slist_data_t));
-    	    datap->threadParams.thread_id = thread_id;
-    	    datap->threadParams.client_fd = client_fd;
-    	    //datap->threadParams.fd = fd;
-    	    datap->threadParams.mask = mask;
-    	    datap->threadParams.is_completed = false;
-    	    
-    	    thread_id++;
-    	    
-    	    SLIST_INSERT_HEAD(&head, datap, entries);
-    	    
-    	    pthread_create(&(datap->threadParams.thread), NULL, send_receive_packet,(void*)&(datap->threadParams));
-    	    
-    	    SLIST_FOREACH(datap, &head, entries)
-    	    {
-    	        if((datap->threadParams).is_completed == true)
-	        {
-              	     pthread_join((datap->threadParams).thread, NULL);	
-		}
-    	    
-    	    }
-    	}
+        aesd_log_index_close(&log_index);
+        close(fd);
     }
     
-
-    close(fd);
-    close(client_fd);
-    close(server_fd);
-    remove(OUTPUT_FILE);
-
-    while (!SLIST_EMPTY(&head))
+    else
     {
-        datap = SLIST_FIRST(&head);
-	SLIST_REMOVE_HEAD(&head, entries);
-	free(datap);
+        close(fd);
+        remove(OUTPUT_FILE);
     }
     
+    aesd_channel_set_close(&channels);
+    aesd_record_store_free(&record_store);
+    aesd_fanout_destroy(&fanout);
+    aesd_metrics_free();
+    aesd_conn_buffer_pool_free();
+    
     return 0;
 }
 
 
-// get sockaddr, IPv4 or IPv6:
-void* get_in_addr(struct sockaddr* sa)
+static int conn_queue_init(conn_queue_t* queue, int size)
 {
-    if (sa->sa_family == AF_INET) 
+    memset(queue, 0, sizeof(conn_queue_t));
+    
+    queue->fds = malloc(sizeof(int) * size);
+    queue->accepted = malloc(sizeof(uint64_t) * size);
+    
+    if(queue->fds == NULL || queue->accepted == NULL)
     {
-    	return &(((struct sockaddr_in*)sa)->sin_addr);
+        free(queue->fds);
+        free(queue->accepted);
+        return -1;
     }
+    
+    queue->size = size;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+    
+    return 0;
+}
 
-    return &(((struct sockaddr_in6*)sa)->sin6_addr);
+
+static void conn_queue_destroy(conn_queue_t* queue)
+{
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_cond_destroy(&queue->not_full);
+    free(queue->fds);
+    free(queue->accepted);
 }
 
 
-void* send_receive_packet(void* threadp)
+// block until the queue has a free slot, the queue is closed or a shutdown is requested
+// return true if a slot is free
+static bool conn_queue_wait_space(conn_queue_t* queue)
 {
-    threadParams_t        *threadParams = (threadParams_t *)threadp;
-    int                   current_in_buf_bytes = 0;   // overwrite content buf
-    int                   received_bytes = 0;
-    char*                 tmp = NULL;
-    int                   content_buf_size = BUFFER_SIZE;
-    bool                  newline_flag = false;
-    char                  buf[BUFFER_SIZE];
-    bool                  rc = true;
+    struct timespec    deadline;
+    bool               has_space;
     
+    pthread_mutex_lock(&queue->lock);
     
- 
-    if(sigprocmask(SIG_BLOCK, &threadParams->mask, NULL) == -1)
-    {
-        printf("failed blocking signal\n");
-    	exit(-1);
-    } 
-
-		
-    if( NULL == (threadParams->read_buf = (char*)malloc(sizeof(char) * BUFFER_SIZE)) )
-    {
-        printf("failed to allocate read buffer\n");
-    	exit(-1);
-    }
-
-    if( NULL == (threadParams->write_buf = (char*)malloc(sizeof(char) * BUFFER_SIZE)) )
+    while(queue->count == queue->size && !queue->closed && !shut_down_flag)
     {
-        printf("failed to allocate write buffer\n");
-    	exit(-1);
+        // timed wait, sig_handler can not signal the condition variable
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += QUEUE_WAIT_MS * 1000000L;
+        if(deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_nsec -= 1000000000L;
+            deadline.tv_sec++;
+        }
+        
+        pthread_cond_timedwait(&queue->not_full, &queue->lock, &deadline);
     }
-
-    threadParams->fd = open(OUTPUT_FILE, O_RDWR | O_CREAT | O_APPEND, 0644);
-	// both read/write buffers are allocated
     
-    do	// receive a line
-    {
-        received_bytes = recv(threadParams->client_fd, buf, BUFFER_SIZE-1, 0);
-	    
-	if(received_bytes == -1)
-	{
-	    printf("recv failed\n");
-	    rc = false;
-	    break;
-	}
-	
-	buf[received_bytes] = 0;
-	
-	if(strchr(buf, '\n') != NULL)
-	{
-	    newline_flag = true;
-	}
-	    
-	// check if malloced size is enough to hold new appended contents, otherwise realloc
-	if( (received_bytes + current_in_buf_bytes) >= content_buf_size )
-	{
-	    tmp = (char*)realloc_memory((unsigned char*)threadParams->read_buf, content_buf_size, content_buf_size+BUFFER_SIZE);
-            if(tmp == NULL)
-	    {
-	        printf("readBuf realloc failed\n");
-		rc = false;
-		break;
-	    }            
-			
-	    else
-	    {
-	        content_buf_size += BUFFER_SIZE;
-		threadParams->read_buf = tmp;
-	    }
-	}
-	 
-	// append received bytes into read_buf
-	memcpy(threadParams->read_buf+current_in_buf_bytes, buf, received_bytes);    		 
-	current_in_buf_bytes += received_bytes;
-    	 
-    }while(!newline_flag);
+    has_space = (queue->count < queue->size);
+    pthread_mutex_unlock(&queue->lock);
     
+    return has_space;
+}
 
-    if(sigprocmask(SIG_UNBLOCK, &threadParams->mask, NULL) == -1)
-    {
-        printf("failed unblocking signal\n");
-    } 
 
-    if( rc ) // got a good buf of bytes
-    {
-        pthread_mutex_lock(&locker);
-	ssize_t write_bytes = write(threadParams->fd, threadParams->read_buf, current_in_buf_bytes);    // append to file
-	pthread_mutex_unlock(&locker);
+// return false if the queue is full or closed, the caller still owns client_fd in that case
+static bool conn_queue_push(conn_queue_t* queue, int client_fd, uint64_t accepted)
+{
+    bool    pushed = false;
     
-	//printf("write bytes %ld\n", write_bytes);
-	if(write_bytes != current_in_buf_bytes)
-	{
-	    printf("not completely written\n");
-	}
-    }
+    pthread_mutex_lock(&queue->lock);
     
-    // Unmask signals after receive/send
-    if (sigprocmask(SIG_UNBLOCK,&(threadParams->mask),NULL) == -1)
+    if(queue->count < queue->size && !queue->closed)
     {
-        perror("\nERROR sigprocmask():");
+        queue->fds[(queue->head + queue->count) % queue->size] = client_fd;
+        queue->accepted[(queue->head + queue->count) % queue->size] = accepted;
+        queue->count++;
+        pushed = true;
+        pthread_cond_signal(&queue->not_empty);
     }
-
-    if( rc ) // write succeeded
-    {      
-        lseek(threadParams->fd, 0, SEEK_SET);
     
-	//read one byte at a time and sending one packet with newline at a time
-	char byte_content;
-	int nbytes = 0;
-	int send_buf_size = BUFFER_SIZE;
-	int packet_size = 0;
-    
-	pthread_mutex_lock(&locker);
-	while( (nbytes = read(threadParams->fd, &byte_content,1)) > 0 )
-	{
-	    if(packet_size >= send_buf_size)   // reallocate memory if not enough space
-	    {
-	        tmp = (char*)realloc_memory((unsigned char*)threadParams->write_buf, send_buf_size, send_buf_size+BUFFER_SIZE);
-
-		if(tmp == NULL)
-		{
-		    printf("writeBuf realloc failed\n");
-		    rc = false;
-		    break;
-		}            
-		
-		else
-		{
-		    send_buf_size += BUFFER_SIZE;
-		    threadParams->write_buf = tmp;
-		}
-	    }
-        
-	    threadParams->write_buf[packet_size++] = byte_content;
-	    if(byte_content == '\n')    // read in newline, send the packet
-	    {   
-	        // Block signals to avoid partial send
-		if(sigprocmask(SIG_BLOCK, &(threadParams->mask), NULL) == -1)
-		{
-		    printf("failed blocking signal\n");
-    		    break;
-		}
-		
-		ssize_t send_bytes = send(threadParams->client_fd, threadParams->write_buf, packet_size, 0);
-            
-		if (sigprocmask(SIG_UNBLOCK,&(threadParams->mask),NULL) == -1)
-		{
-		    perror("\nERROR sigprocmask():");
-		    break;
-		}
-            
-		if(send_bytes == -1)
-		{
-		    printf("send() failed\n");
-		    break;
-		}
-            
-	            packet_size = 0;
-	    }
-	}
-    }
+    pthread_mutex_unlock(&queue->lock);
     
-    // single point exit, clean up
+    return pushed;
+}
 
-    if(threadParams->read_buf)
-    {
-        free(threadParams->read_buf);
-    }
 
-    if(threadParams->write_buf)
+// wait for a queued connection and hand it to the calling worker
+// the popped socket is published in *active_fd under the queue lock so shutdown can wake the worker
+// *accepted receives the time it was accepted
+// return -1 once the queue is closed
+static int conn_queue_pop(conn_queue_t* queue, int* active_fd, uint64_t* accepted)
+{
+    int    client_fd = -1;
+    
+    pthread_mutex_lock(&queue->lock);
+    
+    while(queue->count == 0 && !queue->closed)
     {
-        free(threadParams->write_buf);
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
     }
     
-    pthread_mutex_unlock(&locker);
-
-    close(threadParams->client_fd);
-    
-    close(threadParams->fd);
+    if(!queue->closed)
+    {
+        client_fd = queue->fds[queue->head];
+        *accepted = queue->accepted[queue->head];
+        queue->head = (queue->head + 1) % queue->size;
+        queue->count--;
+        pthread_cond_signal(&queue->not_full);
+    }
     
-    threadParams->is_completed = rc;
+    *active_fd = client_fd;
+    pthread_mutex_unlock(&queue->lock);
     
-    return NULL;
-    //pthread_exit(threadParams);
+    return client_fd;
 }
 
 
-// from timer_thread.c example code in lecture 9
-static void timer_thread(union sigval sigval)
+// stop the workers: queued connections are closed unserved and
+// connections in progress are shut down so their recv()/send() return
+static void conn_queue_close(conn_queue_t* queue, threadParams_t* workers, int count)
 {
-#if USE_AESD_CHAR_DEVICE
-
-#else
-    timer_data_t* td = (timer_data_t*) sigval.sival_ptr;
-    char buf[BUFFER_SIZE];
-    time_t time_now;
-    struct tm *time_info;
-    time(&time_now);
-    time_info = localtime(&time_now);
-    
-    size_t nbytes = strftime(buf,100,"timestamp:%a, %d %b %Y %T %z\n",time_info);
+    int    i = 0;
     
-    pthread_mutex_lock(&locker);
+    pthread_mutex_lock(&queue->lock);
     
-    ssize_t write_bytes = write(td->fd, buf, nbytes);
+    queue->closed = true;
     
-    pthread_mutex_unlock(&locker);
+    while(queue->count > 0)
+    {
+        close(queue->fds[queue->head]);
+        aesd_metrics_gauge_add(AESD_METRICS_ACTIVE_CONNECTIONS, -1);
+        queue->head = (queue->head + 1) % queue->size;
+        queue->count--;
+    }
     
-    if(write_bytes == -1)
+    for(i = 0; i < count; i++)
     {
-        perror("timer_thread write() failed\n");
-        exit(-1);
+        if(workers[i].client_fd >= 0)
+        {
+            shutdown(workers[i].client_fd, SHUT_RDWR);
+        }
     }
-#endif  
     
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_cond_broadcast(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
 }
 
 
-void sig_handler(int signo)
+// pool worker, serves one connection at a time until the queue is closed
+static void* worker_thread(void* threadp)
 {
-    if(signo == SIGINT || signo==SIGTERM) 
+    threadParams_t        *threadParams = (threadParams_t *)threadp;
+    int                   client_fd = -1;
+    
+    // only the main thread handles SIGINT/SIGTERM
+    pthread_sigmask(SIG_BLOCK, &threadParams->mask, NULL);
+    
+    while( (client_fd = conn_queue_pop(threadParams->queue, &threadParams->client_fd, &threadParams->accepted)) != -1 )
     {
-        shutdown(server_fd, SHUT_RDWR);
-        shut_down_flag = true;
+        send_receive_packet(threadParams);
+        
+        // the record is reusable right away, release the socket under the lock so shutdown never sees a stale fd
+        pthread_mutex_lock(&threadParams->queue->lock);
+        threadParams->client_fd = -1;
+        pthread_mutex_unlock(&threadParams->queue->lock);
+        
+        close(client_fd);
+        aesd_metrics_gauge_add(AESD_METRICS_ACTIVE_CONNECTIONS, -1);
     }
+    
+    return NULL;
 }
 
 
-// return null if reallocation failed
-// otherwise return pointer to new allocated memory of new_size
-// old size bytes of the buf is copied into new allocated memory
-// and the old buf is freed
-unsigned char* realloc_memory(const unsigned char* buf, int old_size, int new_size)
+// accept loop for the thread mode, connections are handed to a fixed pool of workers
+// connections on the Unix listener share the pool with the ones on PORT
+static int run_thread_server(sigset_t* mask)
 {
-    unsigned char* tmp = (unsigned char*)malloc(new_size);    // allocate new memory
+    socklen_t         addr_size;
+    conn_queue_t      queue;
+    threadParams_t*   workers = NULL;
+    struct pollfd     listeners[2];
+    int               listener_count = (unix_listen_fd >= 0) ? 2 : 1;
+    int               listen_fd = -1;
+    int               started = 0;
+    int               i = 0;
+    uint64_t          accepted = 0;
     
-    if(tmp != NULL)
+    if(conn_queue_init(&queue, conn_queue_size) != 0)
     {
-        memcpy(tmp, buf, old_size);
-        free((unsigned char*)buf);
+        printf("failed to allocate connection queue\n");
+        return -1;
     }
     
-    return tmp;
+    workers = calloc(worker_count, sizeof(threadParams_t));
+    
+    if(workers == NULL)
+    {
+        printf("failed to allocate workers\n");
+        conn_queue_destroy(&queue);
+        return -1;
+    }
+    
+    for(started = 0; started < worker_count; started++)
+    {
+        workers[started].thread_id = started + 1;
+        workers[started].client_fd = -1;
+        workers[started].mask = *mask;
+        workers[started].queue = &queue;
+        
+        if(pthread_create(&workers[started].thread, NULL, worker_thread, &workers[started]) != 0)
+        {
+            printf("failed to create worker %d\n", started + 1);
+            break;
+        }
+    }
+    
+    listeners[0].fd = server_fd;
+    listeners[0].events = POLLIN;
+    listeners[1].fd = unix_listen_fd;
+    listeners[1].events = POLLIN;
+    
+    addr_size = sizeof(struct sockaddr);
+    memset(&client_addr, 0, addr_size);
+    printf("here 2\n");
+    while(!shut_down_flag && started > 0)
+    {
+        // delayed accept keeps excess connections in the kernel backlog
+        if(backpressure == BACKPRESSURE_DELAY && !conn_queue_wait_space(&queue))
+        {
+            continue;
+        }
+        
+        // poll() is never restarted after sig_handler, unlike accept()
+        if(poll(listeners, listener_count, -1) == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            
+            perror("listener poll() failed");
+            break;
+        }
+        
+        // server_fd first, shutdown() in sig_handler makes it readable
+        listen_fd = (listeners[0].revents != 0) ? server_fd : unix_listen_fd;
+        addr_size = sizeof(struct sockaddr);
+        client_fd = accept(listen_fd, (struct sockaddr*)&client_addr, &addr_size);
+        accepted = aesd_metrics_clock();
+        
+        if(client_fd == -1)
+    	{
+    	    if(errno == EINTR && !shut_down_flag)
+    	    {
+    	        continue;
+    	    }
+    	    
+    	    perror("socket is not accepting successfully\n");
+    	    printf("socket is not accepting successfully\n");
+    	    break;
+    	}
+        
+        if(shut_down_flag == true)
+        {
+            close(client_fd);
+            break;
+        }
+        
+        log_accepted(listen_fd, &client_addr);
+        
+        aesd_metrics_add(AESD_METRICS_CONNECTIONS, 1);
+        aesd_metrics_gauge_add(AESD_METRICS_ACTIVE_CONNECTIONS, 1);
+        
+        if(!conn_queue_push(&queue, client_fd, accepted))
+        {
+            syslog(LOG_WARNING, "Worker pool saturated, dropping a connection");
+            close(client_fd);
+            aesd_metrics_gauge_add(AESD_METRICS_ACTIVE_CONNECTIONS, -1);
+        }
+    }
+    
+    conn_queue_close(&queue, workers, started);
+    
+    for(i = 0; i < started; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+    
+    free(workers);
+    conn_queue_destroy(&queue);
+    
+    return 0;
+}
+
+
+// epoll tags for the non-connection descriptors in the epoll mode
+static char listen_tag;
+static char unix_listen_tag;
+static char signal_tag;
+static char stop_tag;
+
+
+static void conn_close(conn_t* conn)
+{
+    LIST_REMOVE(conn, entries);
+    
+    if(conn->subscriber != NULL)
+    {
+        log_unsubscribe(conn->channel, conn->subscriber);
+    }
+    
+    close(conn->client_fd);
+    
+    if(conn->fd >= 0)
+    {
+        close(conn->fd);
+    }
+    
+    readback_finish(&conn->readback);
+    aesd_conn_buffer_release(&conn->buffer);
+    free(conn);
+    
+    aesd_metrics_gauge_add(AESD_METRICS_ACTIVE_CONNECTIONS, -1);
+}
+
+
+// drain the socket until it would block
+// return 1 once a record has been received or the peer closed, 0 if more data is needed and -1 if the connection failed
+static int conn_receive(conn_t* conn)
+{
+    ssize_t     received_bytes = 0;
+    
+    while(1)
+    {
+        // the records already appended are dropped first, the buffer only grows for a longer line or frame
+        if(aesd_conn_buffer_reserve(&conn->buffer, record_space(&conn->buffer, conn->framing)) != 0)
+        {
+            printf("readBuf realloc failed\n");
+            return -1;
+        }
+        
+        received_bytes = recv(conn->client_fd, conn->buffer.data+conn->buffer.len, conn->buffer.size-conn->buffer.len, 0);
+        
+        if(received_bytes == 0)    // peer closed, lines already buffered are still answered
+        {
+            conn->peer_closed = true;
+            return 1;
+        }
+        
+        if(received_bytes == -1)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
+            
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            
+            return -1;
+        }
+        
+        aesd_metrics_add(AESD_METRICS_RECEIVED_BYTES, received_bytes);
+        aesd_metrics_record_since(AESD_METRICS_ACCEPT_TO_FIRST_BYTE, conn->accepted);
+        conn->accepted = 0;
+        
+        if(conn->line_started == 0)
+        {
+            conn->line_started = aesd_metrics_clock();
+        }
+        
+        // only the newly received bytes need to be scanned, a frame is complete once its length is
+        aesd_conn_buffer_commit(&conn->buffer, received_bytes);
+        
+        if(next_record_len(&conn->buffer, &conn->framing) > 0)
+        {
+            aesd_metrics_record_since(AESD_METRICS_RECV_TO_NEWLINE, conn->line_started);
+            conn->line_started = 0;
+            return 1;
+        }
+    }
+}
+
+
+// send the pending reply until the socket would block
+// return 1 once the reply was sent, 0 if the socket is full and -1 if the connection failed
+static int conn_send(conn_t* conn)
+{
+    ssize_t    send_bytes = 0;
+    uint64_t   send_start = 0;
+    int        rc = 0;
+    
+    if(conn->readback_pending)
+    {
+        rc = readback_run(&conn->readback, conn->fd, conn->client_fd);
+        
+        if(rc <= 0)
+        {
+            return rc;
+        }
+        
+        conn->readback_pending = false;
+        
+        if(conn->cursor_reply)
+        {
+            conn->reply_len = conn->readback.evicted
+                ? snprintf(conn->reply, sizeof(conn->reply), EVICTED_REPLY "%lld\n", (long long)conn->readback.base)
+                : snprintf(conn->reply, sizeof(conn->reply), "CURSOR:%lld\n", (long long)conn->readback.offset);
+            conn->reply_off = 0;
+        }
+    }
+    
+    while(conn->reply_off < conn->reply_len)
+    {
+        send_start = aesd_metrics_clock();
+        send_bytes = send(conn->client_fd, conn->reply+conn->reply_off, conn->reply_len-conn->reply_off, MSG_NOSIGNAL);
+        aesd_metrics_record_since(AESD_METRICS_SEND, send_start);
+        
+        if(send_bytes == -1)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
+            
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            
+            return -1;
+        }
+        
+        conn->reply_off += send_bytes;
+    }
+    
+    return 1;
+}
+
+
+// turn the connection into a live tail subscriber, its eventfd joins the reactor next to the socket
+// the reply is the cursor its first record starts at
+static bool conn_subscribe(conn_t* conn)
+{
+    struct epoll_event    ev;
+    off_t                 cursor = 0;
+    
+    conn->subscriber = log_subscribe(conn->channel, &cursor);
+    
+    if(conn->subscriber == NULL)
+    {
+        return false;
+    }
+    
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = conn;
+    
+    if(epoll_ctl(conn->epoll_fd, EPOLL_CTL_ADD, conn->subscriber->event_fd, &ev) == -1)
+    {
+        perror("epoll_ctl subscriber failed");
+        return false;
+    }
+    
+    conn->reply_len = snprintf(conn->reply, sizeof(conn->reply), "CURSOR:%lld\n", (long long)cursor);
+    
+    return true;
+}
+
+
+// send what was appended since the last call to a subscribed connection
+// anything the subscriber sends is read and ignored, that is how it leaving is noticed
+// return true when the connection is finished and should be closed
+static bool conn_tail(conn_t* conn)
+{
+    char       discard[BUFFER_SIZE];
+    ssize_t    received_bytes = 0;
+    
+    while((received_bytes = recv(conn->client_fd, discard, sizeof(discard), 0)) > 0)
+    {
+    }
+    
+    if(received_bytes == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+    {
+        return true;
+    }
+    
+    return aesd_fanout_send(conn->subscriber, conn->client_fd, 0) < 0;
+}
+
+
+// handle the next record from the connection buffer and prepare its reply
+// return false if the connection has to be closed, on a malformed frame or a failed subscription
+static bool conn_process_record(conn_t* conn, size_t record_len)
+{
+    off_t      end = 0;
+    off_t      cursor = 0;
+    ssize_t    write_bytes = 0;
+    
+    conn->readback_pending = false;
+    conn->cursor_reply = false;
+    conn->channel_reply = false;
+    conn->reply_len = 0;
+    conn->reply_off = 0;
+    
+    if(conn->framing == FRAMING_BINARY)
+    {
+        // next_record_len() only hands out frames whose header is within bounds
+        if(!frame_append(conn->channel, conn->fd, conn->buffer.data+conn->buffer.start, record_len, conn->reply))
+        {
+            syslog(LOG_WARNING, "Malformed frame, closing the connection");
+            return false;
+        }
+        
+        conn->reply_len = FRAME_ACK_SIZE;
+    }
+    
+    else if(parse_subscribe_command(conn->buffer.data+conn->buffer.start, record_len))
+    {
+        if(!conn_subscribe(conn))
+        {
+            return false;
+        }
+    }
+    
+    else if(parse_channel_command(conn->buffer.data+conn->buffer.start, record_len, &conn->channel, conn->reply, &conn->reply_len))
+    {
+        if(conn->reply_len == 0)
+        {
+            return false;
+        }
+        
+        conn->channel_reply = true;
+    }
+    
+    else if(parse_since_command(conn->buffer.data+conn->buffer.start, record_len, &cursor))
+    {
+        readback_start(&conn->readback, conn->channel);
+        
+        if(!readback_since(&conn->readback, cursor))
+        {
+            conn->reply_len = snprintf(conn->reply, sizeof(conn->reply), EVICTED_REPLY "%lld\n", (long long)conn->readback.base);
+        }
+        
+        else
+        {
+            conn->readback_pending = true;
+            conn->cursor_reply = true;
+        }
+    }
+    
+    else if(parse_grep_command(conn->buffer.data+conn->buffer.start, record_len, &conn->filter))
+    {
+        readback_start(&conn->readback, conn->channel);
+        conn->readback.filter = &conn->filter;
+        conn->readback_pending = true;
+        conn->cursor_reply = true;
+    }
+    
+    else
+    {
+        write_bytes = log_append(conn->channel, conn->fd, conn->buffer.data+conn->buffer.start, record_len, &end);    // append to file
+        
+        if(write_bytes != record_len)
+        {
+            printf("not completely written\n");
+        }
+        
+        if(ack_replies)
+        {
+            conn->reply_len = snprintf(conn->reply, sizeof(conn->reply), "ACK %lld\n", (long long)end);
+        }
+        
+        else
+        {
+            readback_start(&conn->readback, conn->channel);
+            conn->readback_pending = true;
+        }
+    }
+    
+    aesd_conn_buffer_consume(&conn->buffer, record_len);
+    conn->state = CONN_STATE_SEND;
+    
+    return true;
+}
+
+
+// advance the connection state machine after an epoll event
+// pipelined lines and frames are answered in order, the socket is drained before waiting for the next edge
+// return true when the connection is finished and should be closed
+static bool conn_handle_event(conn_t* conn)
+{
+    int       rc = 0;
+    size_t    record_len = 0;
+    
+    while(1)
+    {
+        if(conn->state == CONN_STATE_TAIL)
+        {
+            return conn_tail(conn);
+        }
+        
+        if(conn->state == CONN_STATE_SEND)
+        {
+            rc = conn_send(conn);
+            
+            if(rc <= 0)
+            {
+                return rc < 0;
+            }
+            
+            readback_finish(&conn->readback);
+            
+            // the cursor of a subscription went out, the live tail follows
+            if(conn->subscriber != NULL)
+            {
+                conn->state = CONN_STATE_TAIL;
+                continue;
+            }
+            
+            // binary connections always stay open, a frame already carries its own boundaries
+            // a channel command is only the preamble of the records that follow it
+            if(!keep_alive && conn->framing != FRAMING_BINARY && !conn->channel_reply)
+            {
+                return true;
+            }
+            
+            conn->state = CONN_STATE_RECV;
+        }
+        
+        record_len = next_record_len(&conn->buffer, &conn->framing);
+        
+        if(record_len == FRAME_INVALID)
+        {
+            syslog(LOG_WARNING, "Malformed frame, closing the connection");
+            return true;
+        }
+        
+        if(record_len > 0)
+        {
+            if(!conn_process_record(conn, record_len))
+            {
+                return true;
+            }
+            
+            continue;
+        }
+        
+        if(conn->peer_closed)
+        {
+            return true;
+        }
+        
+        rc = conn_receive(conn);
+        
+        if(rc <= 0)
+        {
+            return rc < 0;
+        }
+    }
+}
+
+
+// accept every pending connection on listen_fd, the reactor's listener or the Unix one, into the calling reactor
+static void accept_connections(int epoll_fd, int listen_fd, struct conn_list_s* head)
+{
+    struct epoll_event            ev;
+    struct sockaddr_in            client_addr;
+    socklen_t                     addr_size;
+    conn_t*                       conn = NULL;
+    int                           new_fd = -1;
+    
+    while(1)
+    {
+        addr_size = sizeof(client_addr);
+        new_fd = accept4(listen_fd, (struct sockaddr*)&client_addr, &addr_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        
+        if(new_fd == -1)
+        {
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                perror("socket is not accepting successfully\n");
+            }
+            
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            
+            return;
+        }
+        
+        log_accepted(listen_fd, &client_addr);
+        
+        conn = calloc(1, sizeof(conn_t));
+        
+        if(conn == NULL)
+        {
+            printf("failed to allocate connection\n");
+            close(new_fd);
+            continue;
+        }
+        
+        aesd_metrics_add(AESD_METRICS_CONNECTIONS, 1);
+        aesd_metrics_gauge_add(AESD_METRICS_ACTIVE_CONNECTIONS, 1);
+        
+        conn->client_fd = new_fd;
+        conn->epoll_fd = epoll_fd;
+        conn->state = CONN_STATE_RECV;
+        conn->accepted = aesd_metrics_clock();
+        conn->channel = (listen_fd == unix_listen_fd) ? listener_channel : NULL;
+        readback_init(&conn->readback, NULL, 0);
+        conn->fd = log_open();
+        
+        LIST_INSERT_HEAD(head, conn, entries);
+        
+        if(conn->fd < 0 && !segmented_log)
+        {
+            printf("failed to set up connection\n");
+            conn_close(conn);
+            continue;
+        }
+        
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        
+        if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, new_fd, &ev) == -1)
+        {
+            perror("epoll_ctl client failed");
+            conn_close(conn);
+        }
+    }
+}
+
+
+// event loop of one epoll reactor
+// the reactor's listener and every client accepted on it are serviced here, reactor 0 also handles the shutdown signals
+static int reactor_run(reactor_t* reactor)
+{
+    struct epoll_event            ev;
+    struct epoll_event            events[MAX_EPOLL_EVENTS];
+    struct signalfd_siginfo       siginfo;
+    uint64_t                      stop = 1;
+    int                           epoll_fd = -1;
+    int                           nfds = 0;
+    int                           i = 0;
+    int                           j = 0;
+    int                           rc = -1;
+    conn_t*                       conn = NULL;
+    struct conn_list_s            head;
+    
+    LIST_INIT(&head);
+    
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    
+    if(epoll_fd == -1)
+    {
+        perror("epoll setup failed");
+        goto out;
+    }
+    
+    if(fcntl(reactor->listen_fd, F_SETFL, fcntl(reactor->listen_fd, F_GETFL) | O_NONBLOCK) == -1)
+    {
+        perror("fcntl O_NONBLOCK failed");
+        goto out;
+    }
+    
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &listen_tag;
+    
+    if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, reactor->listen_fd, &ev) == -1)
+    {
+        perror("epoll_ctl listener failed");
+        goto out;
+    }
+    
+    // the Unix listener is only served by reactor 0, local producers do not need SO_REUSEPORT spreading
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &unix_listen_tag;
+    
+    if(reactor->signal_fd >= 0 && unix_listen_fd >= 0 &&
+       (fcntl(unix_listen_fd, F_SETFL, fcntl(unix_listen_fd, F_GETFL) | O_NONBLOCK) == -1 ||
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, unix_listen_fd, &ev) == -1))
+    {
+        perror("Unix listener setup failed");
+        goto out;
+    }
+    
+    // level triggered and never drained, once written every reactor keeps seeing it
+    ev.events = EPOLLIN;
+    ev.data.ptr = &stop_tag;
+    
+    if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, reactor_stop_fd, &ev) == -1)
+    {
+        perror("epoll_ctl stop eventfd failed");
+        goto out;
+    }
+    
+    ev.events = EPOLLIN;
+    ev.data.ptr = &signal_tag;
+    
+    if(reactor->signal_fd >= 0 && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, reactor->signal_fd, &ev) == -1)
+    {
+        perror("epoll_ctl signalfd failed");
+        goto out;
+    }
+    
+    rc = 0;
+    
+    while(!shut_down_flag)
+    {
+        nfds = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+        
+        if(nfds == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            
+            perror("epoll_wait failed");
+            rc = -1;
+            break;
+        }
+        
+        for(i = 0; i < nfds; i++)
+        {
+            if(events[i].data.ptr == &signal_tag)
+            {
+                if(read(reactor->signal_fd, &siginfo, sizeof(siginfo)) == sizeof(siginfo))
+                {
+                    shut_down_flag = true;
+                }
+            }
+            
+            else if(events[i].data.ptr == &stop_tag)
+            {
+                shut_down_flag = true;
+            }
+            
+            else if(events[i].data.ptr == &listen_tag)
+            {
+                accept_connections(epoll_fd, reactor->listen_fd, &head);
+            }
+            
+            else if(events[i].data.ptr == &unix_listen_tag)
+            {
+                accept_connections(epoll_fd, unix_listen_fd, &head);
+            }
+            
+            // a subscriber's eventfd may report in the same batch as its socket, after the connection was closed
+            else if(events[i].data.ptr != NULL)
+            {
+                conn = events[i].data.ptr;
+                
+                if(conn_handle_event(conn))
+                {
+                    conn_close(conn);
+                    
+                    for(j = i + 1; j < nfds; j++)
+                    {
+                        if(events[j].data.ptr == conn)
+                        {
+                            events[j].data.ptr = NULL;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    
+    out:
+    // wake the other reactors, this one may also be leaving on an error
+    if(write(reactor_stop_fd, &stop, sizeof(stop)) != sizeof(stop))
+    {
+        perror("failed to stop the reactors");
+    }
+    
+    while(!LIST_EMPTY(&head))
+    {
+        conn_close(LIST_FIRST(&head));
+    }
+    
+    if(epoll_fd >= 0)
+    {
+        close(epoll_fd);
+    }
+    
+    return rc;
+}
+
+
+// reactors after the first run on their own thread, pinned to their CPU
+static void* reactor_thread(void* arg)
+{
+    reactor_t*    reactor = arg;
+    cpu_set_t     cpus;
+    
+    if(reactor->cpu >= 0)
+    {
+        CPU_ZERO(&cpus);
+        CPU_SET(reactor->cpu, &cpus);
+        
+        if(pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+        {
+            printf("failed to pin reactor %d to CPU %d\n", reactor->id, reactor->cpu);
+        }
+    }
+    
+    reactor_run(reactor);
+    
+    return NULL;
+}
+
+
+// the epoll mode: acceptor_count reactors, each with its own SO_REUSEPORT listener on PORT
+// the kernel spreads new connections over the listeners, so a connection stays on the reactor that accepted it
+// and reactors only share the log. The main thread runs reactor 0, which owns server_fd and the shutdown signals
+static int run_epoll_server(sigset_t* mask)
+{
+    reactor_t*       reactors = NULL;
+    cpu_set_t        allowed;
+    int              cpus[CPU_SETSIZE];
+    int              cpu_count = 0;
+    int              signal_fd = -1;
+    int              started = 1;
+    int              cpu = 0;
+    int              rc = -1;
+    
+    // SIGINT and SIGTERM are delivered through signal_fd instead of sig_handler
+    // blocked before the reactor threads start so they inherit the mask
+    if(sigprocmask(SIG_BLOCK, mask, NULL) == -1)
+    {
+        printf("failed blocking signal\n");
+        return -1;
+    }
+    
+    signal_fd = signalfd(-1, mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    reactor_stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    reactors = calloc(acceptor_count, sizeof(reactor_t));
+    
+    if(signal_fd == -1 || reactor_stop_fd == -1 || reactors == NULL)
+    {
+        perror("epoll setup failed");
+        goto out;
+    }
+    
+    // one reactor per CPU we may run on, wrapping around when there are more reactors than CPUs
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    
+    for(cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if(CPU_ISSET(cpu, &allowed))
+        {
+            cpus[cpu_count++] = cpu;
+        }
+    }
+    
+    reactors[0].listen_fd = server_fd;
+    reactors[0].signal_fd = signal_fd;
+    reactors[0].cpu = -1;
+    
+    for(started = 1; started < acceptor_count; started++)
+    {
+        reactors[started].id = started;
+        reactors[started].signal_fd = -1;
+        reactors[started].cpu = (cpu_count > 0) ? cpus[started % cpu_count] : -1;
+        reactors[started].listen_fd = open_listener();
+        
+        if(reactors[started].listen_fd == -1)
+        {
+            break;
+        }
+        
+        if(pthread_create(&reactors[started].thread, NULL, reactor_thread, &reactors[started]) != 0)
+        {
+            printf("failed to create reactor %d\n", started);
+            close(reactors[started].listen_fd);
+            break;
+        }
+    }
+    
+    // a single reactor keeps the main thread unpinned, as before
+    if(started > 1 && cpu_count > 0)
+    {
+        CPU_ZERO(&allowed);
+        CPU_SET(cpus[0], &allowed);
+        pthread_setaffinity_np(pthread_self(), sizeof(allowed), &allowed);
+    }
+    
+    rc = reactor_run(&reactors[0]);
+    
+    while(--started > 0)
+    {
+        pthread_join(reactors[started].thread, NULL);
+        close(reactors[started].listen_fd);
+    }
+    
+    out:
+    free(reactors);
+    
+    if(reactor_stop_fd >= 0)
+    {
+        close(reactor_stop_fd);
+    }
+    
+    if(signal_fd >= 0)
+    {
+        close(signal_fd);
+    }
+    
+    return rc;
+}
+
+
+// create a socket listening on PORT
+// SO_REUSEPORT lets every epoll reactor bind its own listener, the kernel balances connections between them
+static int open_listener(void)
+{
+    int    listen_fd = socket(PF_INET, SOCK_STREAM, 0);
+    int    option = 1;
+    
+    if(listen_fd == -1)
+    {
+    	perror("Socket is not created successfully\n");
+    	return -1;
+    }
+    
+    // attaching socket to the port 9000 to avoid bind error
+    if( setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option)) == -1 ||
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &option, sizeof(option)) == -1 )
+    {
+        perror("setsockopt failed");
+        close(listen_fd);
+        return -1;
+    }
+
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(PORT);
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    
+    // Bind to the set port and IP:
+    if(bind(listen_fd, (struct sockaddr*)&server_addr, sizeof(server_addr))<0)
+    {
+        printf("Couldn't bind to the port\n");
+        close(listen_fd);
+        return -1;
+    }
+    
+    if(listen(listen_fd, MAX_CONNECTION) == -1)
+    {
+    	perror("Server listen failed\n");
+    	close(listen_fd);
+    	return -1;
+    }
+    
+    return listen_fd;
+}
+
+
+// get sockaddr, IPv4 or IPv6:
+void* get_in_addr(struct sockaddr* sa)
+{
+    if (sa->sa_family == AF_INET) 
+    {
+    	return &(((struct sockaddr_in*)sa)->sin_addr);
+    }
+
+    return &(((struct sockaddr_in6*)sa)->sin6_addr);
+}
+
+
+// syslog a new connection, peers on the Unix listener have no address worth logging
+static void log_accepted(int listen_fd, struct sockaddr_in* addr)
+{
+    char client_ip6[INET6_ADDRSTRLEN]; // space to hold the IPv6 string
+    
+    if(listen_fd == unix_listen_fd)
+    {
+        syslog(LOG_DEBUG, "Accepted connection on %s", unix_path);
+        return;
+    }
+    
+    inet_ntop(AF_INET, get_in_addr((struct sockaddr*)addr), client_ip6, sizeof client_ip6);
+    syslog(LOG_DEBUG, "Accepted connection from %s", client_ip6);
+}
+
+
+// bind a socket of type (SOCK_STREAM or SOCK_DGRAM) to the Unix socket path
+// return the socket or -1 on error
+static int unix_socket_bind(const char* path, int type)
+{
+    struct sockaddr_un    unix_addr;
+    int                   sock = -1;
+    
+    if(strlen(path) >= sizeof(unix_addr.sun_path))
+    {
+        printf("Socket path %s is too long\n", path);
+        return -1;
+    }
+    
+    sock = socket(AF_UNIX, type | SOCK_CLOEXEC, 0);
+    
+    if(sock == -1)
+    {
+        perror("Unix socket() failed");
+        return -1;
+    }
+    
+    memset(&unix_addr, 0, sizeof(unix_addr));
+    unix_addr.sun_family = AF_UNIX;
+    strcpy(unix_addr.sun_path, path);
+    
+    unlink(path);    // left behind by a previous run
+    
+    if(bind(sock, (struct sockaddr*)&unix_addr, sizeof(unix_addr)) == -1)
+    {
+        perror("Unix socket bind() failed");
+        close(sock);
+        return -1;
+    }
+    
+    return sock;
+}
+
+
+// serve one connection: receive a line, append it and send the whole file back
+// SIGINT/SIGTERM are blocked for the lifetime of the calling worker
+// the caller owns and closes threadParams->client_fd
+bool send_receive_packet(threadParams_t* threadParams)
+{
+    struct aesd_conn_buffer*    buffer = &threadParams->buffer;
+    ssize_t                     received_bytes = 0;
+    bool                        rc = true;
+    size_t                      record_len = 0;
+    uint64_t                    line_started = 0;
+    framing_t                   framing = FRAMING_UNKNOWN;
+    char                        ack[FRAME_ACK_SIZE];
+    struct aesd_channel*        channel = NULL;
+    bool                        channel_reply = false;    // the last line was a channel command, its records follow
+    char                        reply[REPLY_SIZE];
+    size_t                      reply_len = 0;
+    struct sockaddr_storage     addr;
+    socklen_t                   addr_len = sizeof(addr);
+    
+    aesd_conn_buffer_init(buffer);
+    
+    // connections accepted on the Unix listener start on its channel
+    if(getsockname(threadParams->client_fd, (struct sockaddr*)&addr, &addr_len) == 0 && addr.ss_family == AF_UNIX)
+    {
+        channel = listener_channel;
+    }
+
+    threadParams->fd = log_open();
+    
+    while( rc )
+    {
+        // a pipelined client may have sent the next line along with the previous one
+        record_len = next_record_len(buffer, &framing);
+        
+        while(record_len == 0)	// receive a line or frame
+        {
+            // a frame gets room for all of its missing bytes at once
+            if(aesd_conn_buffer_reserve(buffer, record_space(buffer, framing)) != 0)
+            {
+                printf("readBuf realloc failed\n");
+                rc = false;
+                break;
+            }
+            
+            // straight into the connection buffer, as much as it has room for
+            received_bytes = recv(threadParams->client_fd, buffer->data+buffer->len, buffer->size-buffer->len, 0);
+	    
+	    if(received_bytes == -1)
+	    {
+	        printf("recv failed\n");
+	        rc = false;
+	        break;
+	    }
+	    
+	    if(received_bytes == 0)    // peer closed or shut down before completing a line
+	    {
+	        rc = false;
+	        break;
+	    }
+	    
+	    aesd_metrics_add(AESD_METRICS_RECEIVED_BYTES, received_bytes);
+	    aesd_metrics_record_since(AESD_METRICS_ACCEPT_TO_FIRST_BYTE, threadParams->accepted);
+	    threadParams->accepted = 0;
+	    
+	    if(line_started == 0)
+	    {
+	        line_started = aesd_metrics_clock();
+	    }
+	    
+	    // only the newly received bytes are searched for the newline
+	    aesd_conn_buffer_commit(buffer, received_bytes);
+	    record_len = next_record_len(buffer, &framing);
+	    
+	    if(record_len > 0)
+	    {
+	        aesd_metrics_record_since(AESD_METRICS_RECV_TO_NEWLINE, line_started);
+	        line_started = 0;
+	    }
+        }
+        
+        if( !rc )
+        {
+            break;
+        }
+        
+        // got a good buf of bytes, handle every complete record in order, the partial line stays for the next round
+        while( rc && record_len > 0 )
+        {
+            if(record_len == FRAME_INVALID)
+            {
+                syslog(LOG_WARNING, "Malformed frame, closing the connection");
+                rc = false;
+                break;
+            }
+            
+            if(framing == FRAMING_BINARY)
+            {
+                rc = frame_append(channel, threadParams->fd, buffer->data+buffer->start, record_len, ack) &&
+                     send(threadParams->client_fd, ack, FRAME_ACK_SIZE, MSG_NOSIGNAL) == FRAME_ACK_SIZE;
+            }
+            
+            else if(parse_channel_command(buffer->data+buffer->start, record_len, &channel, reply, &reply_len))
+            {
+                channel_reply = true;
+                rc = reply_len > 0 && send(threadParams->client_fd, reply, reply_len, MSG_NOSIGNAL) == (ssize_t)reply_len;
+            }
+            
+            else
+            {
+                channel_reply = false;
+	        rc = process_record(channel, threadParams->fd, threadParams->client_fd, buffer->data+buffer->start, record_len);
+	    }
+	    
+	    aesd_conn_buffer_consume(buffer, record_len);
+	    record_len = next_record_len(buffer, &framing);
+        }
+        
+        // binary connections always stay open, a frame already carries its own boundaries
+        // a channel command is only the preamble of the records that follow it
+        if( !keep_alive && framing != FRAMING_BINARY && !channel_reply )
+        {
+            break;
+        }
+    }
+    
+    // single point exit, clean up, the buffer goes back to the pool for the next connection
+    aesd_conn_buffer_release(buffer);
+    
+    if(threadParams->fd >= 0)
+    {
+        close(threadParams->fd);
+    }
+    
+    return rc;
+}
+
+
+// total length of the frame at the start of the unconsumed bytes of buffer, 0 while its header is incomplete
+// FRAME_INVALID if the header is out of bounds
+static size_t frame_len(struct aesd_conn_buffer* buffer)
+{
+    uint32_t    header[2];
+    uint32_t    count = 0;
+    uint32_t    data_len = 0;
+    
+    if(buffer->len - buffer->start < FRAME_HEADER_SIZE)
+    {
+        return 0;
+    }
+    
+    memcpy(header, buffer->data+buffer->start, FRAME_HEADER_SIZE);
+    count = ntohl(header[0]);
+    data_len = ntohl(header[1]);
+    
+    if(count == 0 || count > FRAME_MAX_RECORDS || data_len > FRAME_MAX_DATA)
+    {
+        return FRAME_INVALID;
+    }
+    
+    return FRAME_HEADER_SIZE + count * sizeof(uint32_t) + data_len;
+}
+
+
+// length of the record at the start of the unconsumed bytes of buffer, 0 while it is incomplete
+// with keep_alive every line is a record, otherwise everything received along with the newline is.
+// A connection starting with BINARY_MAGIC sends frames instead, their length comes from the header
+// and no byte is scanned
+static size_t next_record_len(struct aesd_conn_buffer* buffer, framing_t* framing)
+{
+    size_t    available = buffer->len - buffer->start;
+    size_t    line_len = 0;
+    
+    if(*framing == FRAMING_UNKNOWN)
+    {
+        if(available == 0)
+        {
+            return 0;
+        }
+        
+        // the magic holds no newline, so a complete line always tells the two apart
+        line_len = (available < BINARY_MAGIC_LEN) ? available : BINARY_MAGIC_LEN;
+        
+        if(memcmp(buffer->data+buffer->start, BINARY_MAGIC, line_len) != 0)
+        {
+            *framing = FRAMING_TEXT;
+        }
+        
+        else if(line_len < BINARY_MAGIC_LEN)
+        {
+            return 0;
+        }
+        
+        else
+        {
+            *framing = FRAMING_BINARY;
+            aesd_conn_buffer_consume(buffer, BINARY_MAGIC_LEN);
+            available -= BINARY_MAGIC_LEN;
+        }
+    }
+    
+    if(*framing == FRAMING_BINARY)
+    {
+        line_len = frame_len(buffer);
+        return (line_len != FRAME_INVALID && line_len > available) ? 0 : line_len;
+    }
+    
+    line_len = aesd_conn_buffer_line(buffer);
+    
+    if(line_len == 0)
+    {
+        return 0;
+    }
+    
+    return keep_alive ? line_len : buffer->len - buffer->start;
+}
+
+
+// room to reserve before the next recv(): the missing bytes of a frame whose header has arrived,
+// so a large frame is received without growing the buffer step by step
+static size_t record_space(struct aesd_conn_buffer* buffer, framing_t framing)
+{
+    size_t    len = (framing == FRAMING_BINARY) ? frame_len(buffer) : 0;
+    size_t    available = buffer->len - buffer->start;
+    
+    if(len == FRAME_INVALID || len <= available + AESD_CONN_BUFFER_MIN_SPACE)
+    {
+        return AESD_CONN_BUFFER_MIN_SPACE;
+    }
+    
+    return len - available;
+}
+
+
+// append the records of the complete frame at buf, whose header frame_len() has checked, in one write
+//   u32 record count, u32 data length, u32 length of each record, the records back to back
+// every record has to end with its newline so the log stays line oriented for readbacks and cursors.
+// ack receives the log length after the frame
+// return false if the frame is malformed, nothing is appended then
+static bool frame_append(struct aesd_channel* channel, int output_fd, const char* buf, size_t len, char* ack)
+{
+    uint32_t       header[2];
+    uint32_t       record_len = 0;
+    uint32_t       i = 0;
+    size_t         offset = 0;
+    size_t         data_len = 0;
+    const char*    data = NULL;
+    off_t          end = 0;
+    uint64_t       end_be = 0;
+    
+    memcpy(header, buf, FRAME_HEADER_SIZE);
+    header[0] = ntohl(header[0]);
+    data_len = ntohl(header[1]);
+    data = buf + FRAME_HEADER_SIZE + header[0] * sizeof(uint32_t);
+    
+    for(i = 0; i < header[0]; i++)
+    {
+        memcpy(&record_len, buf + FRAME_HEADER_SIZE + i * sizeof(uint32_t), sizeof(uint32_t));
+        record_len = ntohl(record_len);
+        
+        if(record_len == 0 || record_len > data_len - offset || data[offset + record_len - 1] != '\n')
+        {
+            return false;
+        }
+        
+        offset += record_len;
+    }
+    
+    if(offset != data_len || data + data_len != buf + len)
+    {
+        return false;
+    }
+    
+    if(log_append(channel, output_fd, data, data_len, &end) != (ssize_t)data_len)
+    {
+        printf("not completely written\n");
+    }
+    
+    // log_append() counted the frame as one record
+    aesd_metrics_add(AESD_METRICS_RECORDS, header[0] - 1);
+    
+    end_be = htobe64(end);
+    memcpy(ack, &end_be, FRAME_ACK_SIZE);
+    
+    return true;
+}
+
+
+// recognize "AESDSOCKET_SINCE:<offset>\n", a request for everything appended after offset
+static bool parse_since_command(const char* buf, size_t len, off_t* cursor)
+{
+    size_t    prefix_len = strlen(SINCE_COMMAND);
+    size_t    i = prefix_len;
+    off_t     value = 0;
+    
+    if(len <= prefix_len || memcmp(buf, SINCE_COMMAND, prefix_len) != 0)
+    {
+        return false;
+    }
+    
+    while(i < len && i - prefix_len < SINCE_MAX_DIGITS && buf[i] >= '0' && buf[i] <= '9')
+    {
+        value = value * 10 + (buf[i] - '0');
+        i++;
+    }
+    
+    if(i == prefix_len)
+    {
+        return false;
+    }
+    
+    // nothing but the line ending may follow the offset
+    while(i < len && (buf[i] == '\r' || buf[i] == '\n'))
+    {
+        i++;
+    }
+    
+    if(i != len)
+    {
+        return false;
+    }
+    
+    *cursor = value;
+    return true;
+}
+
+
+// recognize "AESDSOCKET_SUBSCRIBE\n", a request for a live tail of the log
+static bool parse_subscribe_command(const char* buf, size_t len)
+{
+    size_t    prefix_len = strlen(SUBSCRIBE_COMMAND);
+    size_t    i = prefix_len;
+    
+    if(len <= prefix_len || memcmp(buf, SUBSCRIBE_COMMAND, prefix_len) != 0)
+    {
+        return false;
+    }
+    
+    while(i < len && (buf[i] == '\r' || buf[i] == '\n'))
+    {
+        i++;
+    }
+    
+    return i == len;
+}
+
+
+// recognize "AESDSOCKET_GREP:<pattern>\n", a request for the records containing pattern
+// the pattern is everything up to the line ending, it may hold spaces
+static bool parse_grep_command(const char* buf, size_t len, struct aesd_match* filter)
+{
+    size_t    prefix_len = strlen(GREP_COMMAND);
+    
+    if(len <= prefix_len || memcmp(buf, GREP_COMMAND, prefix_len) != 0)
+    {
+        return false;
+    }
+    
+    while(len > prefix_len && (buf[len-1] == '\r' || buf[len-1] == '\n'))
+    {
+        len--;
+    }
+    
+    // an empty or too long pattern is stored as an ordinary record
+    return aesd_match_init(filter, buf+prefix_len, len-prefix_len) == 0;
+}
+
+
+// recognize "AESDSOCKET_CHANNEL:<name>\n", which switches the connection to the named channel,
+// created on first use, or back to the default log without a name. reply receives "CHANNEL:<name>\n",
+// reply_len is 0 if the channel can not be used and the connection should be closed
+static bool parse_channel_command(const char* buf, size_t len, struct aesd_channel** channel, char* reply, size_t* reply_len)
+{
+    size_t    prefix_len = strlen(CHANNEL_COMMAND);
+    
+    if(len < prefix_len || memcmp(buf, CHANNEL_COMMAND, prefix_len) != 0)
+    {
+        return false;
+    }
+    
+    while(len > prefix_len && (buf[len-1] == '\r' || buf[len-1] == '\n'))
+    {
+        len--;
+    }
+    
+    *reply_len = 0;
+    *channel = NULL;
+    
+    if(len > prefix_len)
+    {
+        *channel = aesd_channel_get(&channels, buf+prefix_len, len-prefix_len);
+        
+        if(*channel == NULL)
+        {
+            syslog(LOG_WARNING, "Channel %.*s can not be used, closing the connection", (int)(len-prefix_len), buf+prefix_len);
+            return true;
+        }
+        
+        aesd_metrics_gauge_set(AESD_METRICS_CHANNELS, aesd_channel_count(&channels));
+    }
+    
+    *reply_len = snprintf(reply, REPLY_SIZE, "CHANNEL:%s\n", (*channel != NULL) ? (*channel)->name : "");
+    
+    return true;
+}
+
+
+// add a live tail subscriber of channel, cursor receives the log offset its first record starts at
+// registered under the channel's lock, so every record is either in the log before cursor or queued for the subscriber
+static struct aesd_fanout_subscriber* log_subscribe(struct aesd_channel* channel, off_t* cursor)
+{
+    struct aesd_fanout_subscriber*    subscriber = NULL;
+    
+    if(channel != NULL)
+    {
+        lock_recorded(&channel->lock);
+        subscriber = aesd_fanout_subscribe(&channel->fanout);
+        *cursor = channel->committed_bytes;
+        pthread_mutex_unlock(&channel->lock);
+    }
+    
+    else
+    {
+        log_lock();
+        log_sync_device();
+        subscriber = aesd_fanout_subscribe(&fanout);
+        *cursor = committed_bytes;
+        pthread_mutex_unlock(&locker);
+    }
+    
+    if(subscriber == NULL)
+    {
+        printf("failed to add a subscriber\n");
+        return NULL;
+    }
+    
+    aesd_metrics_gauge_add(AESD_METRICS_SUBSCRIBERS, 1);
+    
+    return subscriber;
+}
+
+
+static void log_unsubscribe(struct aesd_channel* channel, struct aesd_fanout_subscriber* subscriber)
+{
+    aesd_fanout_unsubscribe((channel != NULL) ? &channel->fanout : &fanout, subscriber);
+    aesd_metrics_gauge_add(AESD_METRICS_SUBSCRIBERS, -1);
+}
+
+
+// live tail on a blocking socket: "CURSOR:<log offset>\n", then every record appended afterwards
+// the worker stays with the subscriber until it leaves, whatever else it sends is ignored
+// return false, the connection is done afterwards
+static bool run_subscriber(struct aesd_channel* channel, int client_fd)
+{
+    struct aesd_fanout_subscriber*    subscriber = NULL;
+    struct pollfd                     pfds[2];
+    char                              discard[BUFFER_SIZE];
+    char                              reply[REPLY_SIZE];
+    int                               reply_len = 0;
+    off_t                             cursor = 0;
+    
+    subscriber = log_subscribe(channel, &cursor);
+    
+    if(subscriber == NULL)
+    {
+        return false;
+    }
+    
+    reply_len = snprintf(reply, sizeof(reply), "CURSOR:%lld\n", (long long)cursor);
+    
+    pfds[0].fd = client_fd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = subscriber->event_fd;
+    pfds[1].events = POLLIN;
+    
+    if(send(client_fd, reply, reply_len, MSG_NOSIGNAL) != reply_len)
+    {
+        log_unsubscribe(channel, subscriber);
+        return false;
+    }
+    
+    while(1)
+    {
+        if(poll(pfds, 2, -1) == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            
+            break;
+        }
+        
+        // the shutdown at exit also shows up here
+        if(pfds[0].revents != 0 && recv(client_fd, discard, sizeof(discard), 0) <= 0)
+        {
+            break;
+        }
+        
+        if(pfds[1].revents != 0 && aesd_fanout_send(subscriber, client_fd, 0) < 0)
+        {
+            break;
+        }
+    }
+    
+    log_unsubscribe(channel, subscriber);
+    
+    return false;
+}
+
+
+// handle one complete record on a blocking socket
+// a since command is answered with the records after its cursor followed by "CURSOR:<new cursor>\n",
+// a grep command with the records containing its pattern followed by the same cursor line,
+// anything else is appended and answered with an ACK or the whole readback
+static bool process_record(struct aesd_channel* channel, int output_fd, int client_fd, const char* buf, size_t len)
+{
+    readback_t    readback;
+    struct aesd_match    filter;
+    char          reply[REPLY_SIZE];
+    int           reply_len = 0;
+    off_t         end = 0;
+    off_t         cursor = 0;
+    bool          since = parse_since_command(buf, len, &cursor);
+    bool          grep = !since && parse_grep_command(buf, len, &filter);
+    bool          rc = true;
+    uint64_t      send_start = 0;
+    
+    if(parse_subscribe_command(buf, len))
+    {
+        return run_subscriber(channel, client_fd);
+    }
+    
+    if( !since && !grep )
+    {
+        ssize_t write_bytes = log_append(channel, output_fd, buf, len, &end);    // append to file
+        
+        if(write_bytes != len)
+        {
+            printf("not completely written\n");
+        }
+        
+        if(ack_replies)
+        {
+            reply_len = snprintf(reply, sizeof(reply), "ACK %lld\n", (long long)end);
+            
+            send_start = aesd_metrics_clock();
+            rc = (send(client_fd, reply, reply_len, MSG_NOSIGNAL) == reply_len);
+            aesd_metrics_record_since(AESD_METRICS_SEND, send_start);
+            
+            return rc;
+        }
+    }
+    
+    readback_start(&readback, channel);
+    
+    if(since && !readback_since(&readback, cursor))
+    {
+        reply_len = snprintf(reply, sizeof(reply), EVICTED_REPLY "%lld\n", (long long)readback.base);
+        send_start = aesd_metrics_clock();
+        rc = (send(client_fd, reply, reply_len, MSG_NOSIGNAL) == reply_len);
+        aesd_metrics_record_since(AESD_METRICS_SEND, send_start);
+        
+        readback_finish(&readback);
+        
+        return rc;
+    }
+    
+    if(grep)
+    {
+        readback.filter = &filter;
+    }
+    
+    // no lock is held while streaming, writers keep appending past the snapshot
+    // blocking socket, readback_run only returns once the file is sent or the client is gone
+    if(readback_run(&readback, output_fd, client_fd) < 0)
+    {
+        printf("send() failed\n");
+        rc = false;
+    }
+    
+    if(rc && (since || grep))
+    {
+        reply_len = readback.evicted
+            ? snprintf(reply, sizeof(reply), EVICTED_REPLY "%lld\n", (long long)readback.base)
+            : snprintf(reply, sizeof(reply), "CURSOR:%lld\n", (long long)readback.offset);
+        send_start = aesd_metrics_clock();
+        rc = (send(client_fd, reply, reply_len, MSG_NOSIGNAL) == reply_len);
+        aesd_metrics_record_since(AESD_METRICS_SEND, send_start);
+    }
+    
+    readback_finish(&readback);
+    
+    return rc;
+}
+
+
+// descriptor a connection appends to and reads back from
+// the segmented log hands out its segment descriptors itself, connections get -1
+static int log_open(void)
+{
+    if(segmented_log)
+    {
+        return -1;
+    }
+    
+    return open(OUTPUT_FILE, O_RDWR | O_CREAT | O_APPEND, 0644);
+}
+
+
+// descriptor the next len bytes of the log go to, locker must be held
+// with the segmented log this is the newest segment, rotated first when it is full
+static int log_output_fd(int output_fd, size_t len)
+{
+    log_sync_device();
+    
+    if(segmented_log)
+    {
+        return aesd_segment_log_writer(&segment_log, len);
+    }
+    
+    return output_fd;
+}
+
+
+// make a written record visible to readers, locker must be held
+static void log_publish(const char* buf, ssize_t write_bytes)
+{
+    if(write_bytes > 0 && use_record_store && aesd_record_store_append(&record_store, buf, write_bytes) < 0)
+    {
+        // a record missing from memory would silently diverge from OUTPUT_FILE
+        syslog(LOG_ERR, "Record store allocation failed, serving readbacks from %s", OUTPUT_FILE);
+        use_record_store = false;
+    }
+    
+    if(write_bytes > 0)
+    {
+        if(segmented_log)
+        {
+            aesd_segment_log_commit(&segment_log, buf, write_bytes);
+        }
+        
+        else if(warm_restart && aesd_log_index_add(&log_index, buf, write_bytes) != 0)
+        {
+            perror("index checkpoint failed");
+        }
+        
+        committed_bytes += write_bytes;
+        aesd_metrics_add(AESD_METRICS_RECORDS, 1);
+        aesd_metrics_gauge_set(AESD_METRICS_STORED_BYTES, committed_bytes);
+        aesd_metrics_add(AESD_METRICS_FANOUT_DROPS, aesd_fanout_publish(&fanout, buf, write_bytes));
+    }
+}
+
+
+// write the index entries of the records just published, locker must still be held
+// so with warm restarts every record is indexed, with its boundaries, before anyone can see it
+static void log_flush_index(void)
+{
+    if(segmented_log)
+    {
+        aesd_segment_log_flush(&segment_log);
+    }
+    
+    else if(warm_restart && aesd_log_index_flush(&log_index) != 0)
+    {
+        perror("index checkpoint failed");
+    }
+}
+
+
+// take locker, an uncontended lock is recorded as a zero wait without reading the clock
+static void log_lock(void)
+{
+    lock_recorded(&locker);
+}
+
+
+#if USE_AESD_CHAR_DEVICE
+// log offsets of the oldest byte the char device holds and of its end, counted over every write since the
+// driver was loaded, so they do not move when it evicts entries. Without AESDCHAR_IOCGETRANGE, e.g. a regular
+// file standing in for the device, nothing is ever evicted
+static void device_range(int output_fd, off_t* head, off_t* end)
+{
+    struct aesd_range    range;
+    
+    if(ioctl(output_fd, AESDCHAR_IOCGETRANGE, &range) == 0)
+    {
+        *head = range.head;
+        *end = range.end;
+        return;
+    }
+    
+    *head = 0;
+    *end = lseek(output_fd, 0, SEEK_END);
+}
+#endif
+
+
+// on the char device, continue committed_bytes from the end of the device, locker must be held
+// so ACK and CURSOR offsets count what other writers added too, in the log offsets of device_range()
+static void log_sync_device(void)
+{
+#if USE_AESD_CHAR_DEVICE
+    off_t    head = 0;
+    
+    device_range(fd, &head, &committed_bytes);
+#endif
+}
+
+
+// take mutex, locker or the lock of a channel, and record the wait
+static void lock_recorded(pthread_mutex_t* mutex)
+{
+    uint64_t    start = 0;
+    
+    if(pthread_mutex_trylock(mutex) == 0)
+    {
+        aesd_metrics_record(AESD_METRICS_LOCK_WAIT, 0);
+        return;
+    }
+    
+    start = aesd_metrics_clock();
+    pthread_mutex_lock(mutex);
+    aesd_metrics_record_since(AESD_METRICS_LOCK_WAIT, start);
+}
+
+
+// log_append() for a named channel: one write() to its data file under its own lock
+// the group commit, the segments and the index only serve the default log
+static ssize_t channel_append(struct aesd_channel* channel, const char* buf, size_t len, off_t* end)
+{
+    ssize_t     write_bytes = 0;
+    uint64_t    write_start = 0;
+    
+    lock_recorded(&channel->lock);
+    
+    write_start = aesd_metrics_clock();
+    write_bytes = write(channel->fd, buf, len);
+    aesd_metrics_record_since(AESD_METRICS_WRITE, write_start);
+    
+    if(write_bytes > 0 && channel->use_store && aesd_record_store_append(&channel->store, buf, write_bytes) < 0)
+    {
+        syslog(LOG_ERR, "Record store allocation failed, serving readbacks of channel %s from its file", channel->name);
+        channel->use_store = false;
+    }
+    
+    if(write_bytes > 0)
+    {
+        channel->committed_bytes += write_bytes;
+        aesd_metrics_add(AESD_METRICS_RECORDS, 1);
+        aesd_metrics_add(AESD_METRICS_FANOUT_DROPS, aesd_fanout_publish(&channel->fanout, buf, write_bytes));
+    }
+    
+    if(end != NULL)
+    {
+        *end = channel->committed_bytes;
+    }
+    
+    pthread_mutex_unlock(&channel->lock);
+    
+    return write_bytes;
+}
+
+
+// append one record to OUTPUT_FILE, or to channel if it is not NULL, and publish it to readers
+// OUTPUT_FILE stays the durable copy, the record store only mirrors what was written to it
+// with group commit the record is queued for committer_thread and this call waits until it is written
+// end, if not NULL, receives the committed length right after this record
+static ssize_t log_append(struct aesd_channel* channel, int output_fd, const char* buf, size_t len, off_t* end)
+{
+    ssize_t          write_bytes = 0;
+    log_request_t    request;
+    uint64_t         write_start = 0;
+    
+    if(channel != NULL)
+    {
+        return channel_append(channel, buf, len, end);
+    }
+    
+    log_lock();
+    
+    if(committer_running)
+    {
+        memset(&request, 0, sizeof(request));
+        request.buf = buf;
+        request.len = len;
+        clock_gettime(CLOCK_MONOTONIC, &request.enqueued);
+        
+        STAILQ_INSERT_TAIL(&pending_records, &request, entries);
+        pthread_cond_signal(&commit_pending);
+        
+        while(!request.done)
+        {
+            pthread_cond_wait(&commit_done, &locker);
+        }
+        
+        write_bytes = request.result;
+        
+        if(end != NULL)
+        {
+            *end = request.end;
+        }
+        
+        pthread_mutex_unlock(&locker);
+        
+        return write_bytes;
+    }
+    
+    write_start = aesd_metrics_clock();
+    write_bytes = write(log_output_fd(output_fd, len), buf, len);
+    aesd_metrics_record_since(AESD_METRICS_WRITE, write_start);
+    
+    log_publish(buf, write_bytes);
+    log_flush_index();
+    
+    if(end != NULL)
+    {
+        *end = committed_bytes;
+    }
+    
+    pthread_mutex_unlock(&locker);
+    
+    return write_bytes;
+}
+
+
+static long long elapsed_ns(const struct timespec* start, const struct timespec* stop)
+{
+    return (stop->tv_sec - start->tv_sec) * 1000000000LL + (stop->tv_nsec - start->tv_nsec);
+}
+
+
+// write every iovec, resuming after partial writes
+// return the number of bytes written before the first error
+static size_t writev_all(int output_fd, struct iovec* iov, int count)
+{
+    ssize_t    nbytes = 0;
+    size_t     total = 0;
+    
+    while(count > 0)
+    {
+        nbytes = writev(output_fd, iov, count);
+        
+        if(nbytes == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            
+            perror("committer writev() failed");
+            break;
+        }
+        
+        total += nbytes;
+        
+        while(count > 0 && (size_t)nbytes >= iov->iov_len)
+        {
+            nbytes -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        
+        if(count > 0)
+        {
+            iov->iov_base = (char*)iov->iov_base + nbytes;
+            iov->iov_len -= nbytes;
+        }
+    }
+    
+    return total;
+}
+
+
+// flush OUTPUT_FILE to the disk, the char device keeps its data in memory and has nothing to sync
+static void log_sync(int output_fd)
+{
+#if !USE_AESD_CHAR_DEVICE
+    if(fdatasync(output_fd) == -1)
+    {
+        perror("fdatasync() failed");
+    }
+#endif
+}
+
+
+// group commit stage: drain every queued record with one writev(), publish them in order and wake the appenders
+// OUTPUT_FILE is synced every sync_every_records records and/or sync_every_usec microseconds when configured
+static void* committer_thread(void* arg)
+{
+    int                 output_fd = *(int*)arg;
+    int                 batch_fd = output_fd;    // where the last batch went, the newest segment with the segmented log
+    struct iovec        iov[GROUP_COMMIT_MAX_BATCH];
+    log_request_t*      batch[GROUP_COMMIT_MAX_BATCH];
+    struct timespec     last_sync;
+    struct timespec     start;
+    struct timespec     now;
+    struct timespec     deadline;
+    unsigned long       unsynced = 0;
+    size_t              written = 0;
+    size_t              bytes = 0;
+    int                 count = 0;
+    int                 bucket = 0;
+    int                 i = 0;
+    
+    clock_gettime(CLOCK_MONOTONIC, &last_sync);
+    
+    pthread_mutex_lock(&locker);
+    
+    while(1)
+    {
+        while(STAILQ_EMPTY(&pending_records) && !committer_stop)
+        {
+            if(unsynced > 0 && sync_every_usec > 0)    // idle with unsynced records, sync when the interval expires
+            {
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += sync_every_usec / 1000000;
+                deadline.tv_nsec += (sync_every_usec % 1000000) * 1000;
+                if(deadline.tv_nsec >= 1000000000L)
+                {
+                    deadline.tv_nsec -= 1000000000L;
+                    deadline.tv_sec++;
+                }
+                
+                if(pthread_cond_timedwait(&commit_pending, &locker, &deadline) == ETIMEDOUT && STAILQ_EMPTY(&pending_records))
+                {
+                    pthread_mutex_unlock(&locker);
+                    log_sync(batch_fd);
+                    pthread_mutex_lock(&locker);
+                    
+                    clock_gettime(CLOCK_MONOTONIC, &last_sync);
+                    unsynced = 0;
+                }
+            }
+            
+            else
+            {
+                pthread_cond_wait(&commit_pending, &locker);
+            }
+        }
+        
+        if(STAILQ_EMPTY(&pending_records))    // stopping and nothing left to write
+        {
+            break;
+        }
+        
+        count = 0;
+        bytes = 0;
+        
+        while(count < GROUP_COMMIT_MAX_BATCH && !STAILQ_EMPTY(&pending_records))
+        {
+            batch[count] = STAILQ_FIRST(&pending_records);
+            STAILQ_REMOVE_HEAD(&pending_records, entries);
+            
+            iov[count].iov_base = (void*)batch[count]->buf;
+            iov[count].iov_len = batch[count]->len;
+            bytes += batch[count]->len;
+            count++;
+        }
+        
+        // a batch is never split across segments, only the committer writes while it runs
+        batch_fd = log_output_fd(output_fd, bytes);
+        
+        // appenders keep queueing the next batch while this one is written
+        pthread_mutex_unlock(&locker);
+        
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        written = writev_all(batch_fd, iov, count);
+        unsynced += count;
+        
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        aesd_metrics_record(AESD_METRICS_WRITE, elapsed_ns(&start, &now));
+        
+        if( (sync_every_records > 0 && unsynced >= sync_every_records) ||
+            (sync_every_usec > 0 && elapsed_ns(&last_sync, &now) >= sync_every_usec * 1000LL) )
+        {
+            log_sync(batch_fd);
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            last_sync = now;
+            unsynced = 0;
+        }
+        
+        log_lock();
+        
+        bucket = 0;
+        while( (count >> (bucket + 1)) > 0 && bucket < BATCH_STATS_BUCKETS-1 )
+        {
+            bucket++;
+        }
+        
+        batch_stats[bucket].batches++;
+        batch_stats[bucket].records += count;
+        batch_stats[bucket].bytes += bytes;
+        batch_stats[bucket].commit_ns += elapsed_ns(&start, &now);
+        
+        // publish in queue order, a record counts as written only up to the bytes writev() got out
+        for(i = 0; i < count; i++)
+        {
+            batch[i]->result = (written >= batch[i]->len) ? (ssize_t)batch[i]->len : (ssize_t)written;
+            written -= batch[i]->result;
+            
+            if(batch[i]->result == 0 && batch[i]->len > 0)
+            {
+                batch[i]->result = -1;
+            }
+            
+            log_publish(batch[i]->buf, batch[i]->result);
+            
+            batch[i]->end = committed_bytes;
+            batch[i]->done = true;
+            batch_stats[bucket].wait_ns += elapsed_ns(&batch[i]->enqueued, &now);
+        }
+        
+        log_flush_index();
+        pthread_cond_broadcast(&commit_done);
+    }
+    
+    pthread_mutex_unlock(&locker);
+    
+    return NULL;
+}
+
+
+static int committer_start(int* output_fd)
+{
+    committer_stop = false;
+    
+    if(pthread_create(&committer, NULL, committer_thread, output_fd) != 0)
+    {
+        printf("failed to create committer thread\n");
+        return -1;
+    }
+    
+    pthread_mutex_lock(&locker);
+    committer_running = true;
+    pthread_mutex_unlock(&locker);
+    
+    return 0;
+}
+
+
+// write out what is still queued, stop the committer and report throughput and latency per batch size
+static void committer_finish(void)
+{
+    int                   bucket = 0;
+    batch_stats_t*        stats = NULL;
+    
+    pthread_mutex_lock(&locker);
+    committer_running = false;    // later appends are written directly
+    committer_stop = true;
+    pthread_cond_signal(&commit_pending);
+    pthread_mutex_unlock(&locker);
+    
+    pthread_join(committer, NULL);
+    
+    for(bucket = 0; bucket < BATCH_STATS_BUCKETS; bucket++)
+    {
+        stats = &batch_stats[bucket];
+        
+        if(stats->batches == 0)
+        {
+            continue;
+        }
+        
+        syslog(LOG_INFO, "Group commit batches of %d-%d records: %lu batches, %lu records, %lu bytes, "
+               "%.1f us per commit, %.1f us average record latency, %.1f MB/s",
+               1 << bucket, (1 << (bucket + 1)) - 1, stats->batches, stats->records, stats->bytes,
+               stats->commit_ns / 1000.0 / stats->batches, stats->wait_ns / 1000.0 / stats->records,
+               (stats->commit_ns > 0) ? stats->bytes * 1000.0 / stats->commit_ns : 0.0);
+    }
+}
+
+
+// open the stats listener: a decimal port is served on 127.0.0.1, anything else is a Unix socket path
+static int stats_open(const char* addr)
+{
+    struct sockaddr_in    inet_addr;
+    char*                 end = NULL;
+    long                  port = strtol(addr, &end, 10);
+    int                   option = 1;
+    int                   listen_fd = -1;
+    int                   rc = -1;
+    
+    if(*addr != '\0' && *end == '\0')
+    {
+        if(port <= 0 || port > 65535)
+        {
+            printf("Invalid stats port %s\n", addr);
+            return -1;
+        }
+        
+        listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        
+        if(listen_fd == -1)
+        {
+            perror("stats socket() failed");
+            return -1;
+        }
+        
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option));
+        
+        memset(&inet_addr, 0, sizeof(inet_addr));
+        inet_addr.sin_family = AF_INET;
+        inet_addr.sin_port = htons(port);
+        inet_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        
+        rc = bind(listen_fd, (struct sockaddr*)&inet_addr, sizeof(inet_addr));
+    }
+    
+    else
+    {
+        listen_fd = unix_socket_bind(addr, SOCK_STREAM);
+        
+        if(listen_fd == -1)
+        {
+            return -1;
+        }
+        
+        rc = 0;
+    }
+    
+    if(rc == -1 || listen(listen_fd, MAX_CONNECTION) == -1)
+    {
+        perror("stats listener setup failed");
+        close(listen_fd);
+        return -1;
+    }
+    
+    return listen_fd;
+}
+
+
+// answer one stats client, an HTTP GET (e.g. a Prometheus scrape) gets a response header,
+// a client that sends nothing within STATS_REQUEST_WAIT_MS gets the bare text
+static void stats_serve(int stats_client_fd)
+{
+    struct pollfd    pfd;
+    char             request[STATS_REQUEST_SIZE];
+    ssize_t          nbytes = 0;
+    const char*      header = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n";
+    
+    pfd.fd = stats_client_fd;
+    pfd.events = POLLIN;
+    
+    if(poll(&pfd, 1, STATS_REQUEST_WAIT_MS) == 1)
+    {
+        nbytes = recv(stats_client_fd, request, sizeof(request), 0);
+        
+        if(nbytes >= 4 && memcmp(request, "GET ", 4) == 0 &&
+           send(stats_client_fd, header, strlen(header), MSG_NOSIGNAL) == -1)
+        {
+            return;
+        }
+    }
+    
+    aesd_metrics_dump(stats_client_fd);
+}
+
+
+// serve the stats listener one client at a time until stats_finish()
+static void* stats_thread(void* arg)
+{
+    struct pollfd    pfds[2];
+    int              stats_client_fd = -1;
+    
+    pfds[0].fd = stats_fd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = stats_stop_fd;
+    pfds[1].events = POLLIN;
+    
+    while(1)
+    {
+        if(poll(pfds, 2, -1) == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            
+            perror("stats poll() failed");
+            break;
+        }
+        
+        if(pfds[1].revents != 0)
+        {
+            break;
+        }
+        
+        stats_client_fd = accept4(stats_fd, NULL, NULL, SOCK_CLOEXEC);
+        
+        if(stats_client_fd == -1)
+        {
+            continue;
+        }
+        
+        stats_serve(stats_client_fd);
+        close(stats_client_fd);
+    }
+    
+    return NULL;
+}
+
+
+static int stats_start(void)
+{
+    stats_fd = stats_open(stats_addr);
+    stats_stop_fd = eventfd(0, EFD_CLOEXEC);
+    
+    if(stats_fd == -1 || stats_stop_fd == -1 || pthread_create(&stats_thread_id, NULL, stats_thread, NULL) != 0)
+    {
+        printf("failed to start the stats listener\n");
+        
+        if(stats_fd >= 0)
+        {
+            close(stats_fd);
+        }
+        
+        if(stats_stop_fd >= 0)
+        {
+            close(stats_stop_fd);
+        }
+        
+        stats_fd = -1;
+        stats_stop_fd = -1;
+        return -1;
+    }
+    
+    return 0;
+}
+
+
+static void stats_finish(void)
+{
+    uint64_t    stop = 1;
+    
+    if(stats_fd < 0)
+    {
+        return;
+    }
+    
+    if(write(stats_stop_fd, &stop, sizeof(stop)) == sizeof(stop))
+    {
+        pthread_join(stats_thread_id, NULL);
+    }
+    
+    close(stats_fd);
+    close(stats_stop_fd);
+    
+    if(strtol(stats_addr, NULL, 10) <= 0)    // Unix socket path
+    {
+        unlink(stats_addr);
+    }
+}
+
+
+// length of OUTPUT_FILE, or of channel if it is not NULL, a readback may send, everything before it is fully written
+// the char device is read up to EOF instead: its offsets start at the oldest entry it still holds, which
+// includes data written before this process started or by other writers, and committed_bytes bounds neither
+// base receives the log offset of device offset 0, 0 for the files
+static off_t log_snapshot(struct aesd_channel* channel, off_t* base)
+{
+    off_t    snapshot = 0;
+    
+    *base = 0;
+    
+    if(channel != NULL)
+    {
+        lock_recorded(&channel->lock);
+        snapshot = channel->committed_bytes;
+        pthread_mutex_unlock(&channel->lock);
+        
+        return snapshot;
+    }
+    
+#if USE_AESD_CHAR_DEVICE
+    log_lock();
+    device_range(fd, base, &snapshot);
+    pthread_mutex_unlock(&locker);
+    
+    return READBACK_TO_EOF;
+#endif
+    
+    log_lock();
+    snapshot = committed_bytes;
+    pthread_mutex_unlock(&locker);
+    
+    return snapshot;
+}
+
+
+// readback_init() with the snapshot of the log the readback belongs to, starting at its oldest byte
+static void readback_start(readback_t* rb, struct aesd_channel* channel)
+{
+    off_t    base = 0;
+    off_t    limit = log_snapshot(channel, &base);
+    
+    readback_init(rb, channel, limit);
+    rb->base = base;
+    rb->offset = base;    // only the char device has a base, and never the record store
+}
+
+
+// start the readback at cursor, a log offset from a CURSOR or ACK reply
+// return false if the char device evicted records after cursor, the readback would silently skip them
+static bool readback_since(readback_t* rb, off_t cursor)
+{
+    if(cursor < rb->base)
+    {
+        return false;
+    }
+    
+    readback_seek(rb, (cursor < rb->limit) ? cursor : rb->limit);
+    
+    return true;
+}
+
+
+// pread() of size bytes at log offset of the log being read back
+// the char device numbers its bytes from the oldest one it holds, which moves forward whenever a write evicts
+// entries, by this process or any other. offset is read at offset - rb->base, and the range is checked again
+// afterwards: a block read while the oldest byte moved is read again at the new device offset
+// return the bytes read, 0 at the end of the log or, with rb->evicted set, once offset was evicted, -1 on error
+static ssize_t readback_pread(readback_t* rb, int fd, char* buf, size_t size, off_t offset)
+{
+    ssize_t    nbytes = 0;
+#if USE_AESD_CHAR_DEVICE
+    off_t      head = 0;
+    off_t      end = 0;
+    
+    while(rb->channel == NULL)
+    {
+        if(offset < rb->base)
+        {
+            rb->evicted = true;
+            return 0;
+        }
+        
+        rb->syscalls++;
+        nbytes = pread(fd, buf, size, offset - rb->base);
+        
+        if(nbytes == -1)
+        {
+            return -1;
+        }
+        
+        device_range(fd, &head, &end);
+        
+        if(head == rb->base)
+        {
+            return nbytes;
+        }
+        
+        rb->base = head;
+    }
+#endif
+    
+    rb->syscalls++;
+    nbytes = pread(fd, buf, size, offset);
+    
+    return nbytes;
+}
+
+
+// a readback sends OUTPUT_FILE, or the data file of channel, up to limit
+// limit is taken from log_snapshot() without holding the lock afterwards
+static void readback_init(readback_t* rb, struct aesd_channel* channel, off_t limit)
+{
+    memset(rb, 0, sizeof(readback_t));
+    rb->channel = channel;
+    rb->limit = limit;
+    rb->started = aesd_metrics_clock();
+    rb->segment_fd = -1;
+}
+
+
+// record store the readback is served from, NULL to read the files
+static const struct aesd_record_store* readback_store(readback_t* rb)
+{
+    if(rb->channel != NULL)
+    {
+        return rb->channel->use_store ? &rb->channel->store : NULL;
+    }
+    
+    return use_record_store ? &record_store : NULL;
+}
+
+
+// start the readback at byte offset of the log instead of at the beginning
+static void readback_seek(readback_t* rb, off_t offset)
+{
+    const struct aesd_record_store*    store = readback_store(rb);
+    const struct aesd_record_entry*    entry = NULL;
+    
+    rb->offset = offset;
+    
+    if(store != NULL)
+    {
+        rb->seq = aesd_record_store_find(store, offset);
+        entry = aesd_record_store_get(store, rb->seq);
+        rb->record_off = (entry != NULL) ? (size_t)(offset - entry->offset) : 0;
+    }
+}
+
+
+#if !USE_AESD_CHAR_DEVICE
+// switch the readback to the segment holding rb->offset
+// bytes deleted by the retention are skipped, the readback continues with the oldest segment still kept
+// return 0 on success and -1 if nothing at or after rb->offset is stored
+static int readback_open_segment(readback_t* rb)
+{
+    if(rb->segment_fd >= 0)
+    {
+        close(rb->segment_fd);
+    }
+    
+    rb->segment_fd = aesd_segment_log_reader(&segment_log, rb->offset, &rb->segment_base, &rb->segment_end);
+    
+    if(rb->segment_fd < 0)
+    {
+        return -1;
+    }
+    
+    // never past the snapshot, a segment started after it has nothing to send
+    if(rb->segment_base > rb->offset)
+    {
+        rb->offset = (rb->segment_base < rb->limit) ? rb->segment_base : rb->limit;
+    }
+    
+    return 0;
+}
+#endif
+
+
+// stream OUTPUT_FILE from rb->offset up to rb->limit to client_fd, or until the socket would block
+// the regular file backend is sent straight from the page cache with sendfile(), one segment at a time with the segmented log
+// the char device is read into one large block per send(), the driver fills it across entries in a single read()
+// reads are positioned with pread(), the driver maps rb->offset to its entry with aesd_circular_buffer_find_entry_offset_for_fpos
+// return 1 once the whole snapshot was sent, 0 if the socket would block and -1 on error
+static int readback_run(readback_t* rb, int fd, int client_fd)
+{
+    const struct aesd_record_store*    store = readback_store(rb);
+    ssize_t    send_bytes = 0;
+    uint64_t   send_start = 0;
+    
+    // a channel is read from its own data file, whichever descriptor the connection has
+    if(rb->channel != NULL)
+    {
+        fd = rb->channel->fd;
+    }
+    
+    if(rb->filter != NULL)
+    {
+        return readback_run_filter(rb, fd, client_fd);
+    }
+    
+    if(store != NULL)
+    {
+        return readback_run_store(rb, store, client_fd);
+    }
+    
+#if USE_AESD_CHAR_DEVICE
+    ssize_t    nbytes = 0;
+    
+    if(rb->buf == NULL)
+    {
+        rb->buf = malloc(READBACK_BLOCK_SIZE);
+        
+        if(rb->buf == NULL)
+        {
+            return -1;
+        }
+    }
+    
+    while(1)
+    {
+        if(rb->buf_off == rb->buf_len)    // staged block fully sent, gather the next one
+        {
+            if(rb->eof)
+            {
+                return 1;
+            }
+            
+            rb->buf_len = 0;
+            rb->buf_off = 0;
+            
+            while(rb->buf_len < READBACK_BLOCK_SIZE && rb->offset < rb->limit)
+            {
+                size_t    to_read = READBACK_BLOCK_SIZE - rb->buf_len;
+                
+                if( (off_t)to_read > (rb->limit - rb->offset) )
+                {
+                    to_read = rb->limit - rb->offset;
+                }
+                
+                nbytes = readback_pread(rb, fd, rb->buf+rb->buf_len, to_read, rb->offset);
+                
+                if(nbytes == 0)
+                {
+                    rb->eof = true;
+                    break;
+                }
+                
+                if(nbytes == -1)
+                {
+                    if(errno == EINTR)
+                    {
+                        continue;
+                    }
+                    
+                    return -1;
+                }
+                
+                rb->buf_len += nbytes;
+                rb->offset += nbytes;
+            }
+            
+            if(rb->offset >= rb->limit)
+            {
+                rb->eof = true;
+            }
+            
+            if(rb->buf_len == 0)
+            {
+                return 1;
+            }
+        }
+        
+        rb->syscalls++;
+        send_start = aesd_metrics_clock();
+        send_bytes = send(client_fd, rb->buf+rb->buf_off, rb->buf_len-rb->buf_off, MSG_NOSIGNAL);
+        aesd_metrics_record_since(AESD_METRICS_SEND, send_start);
+        
+        if(send_bytes == -1)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
+            
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            
+            return -1;
+        }
+        
+        rb->buf_off += send_bytes;
+        rb->sent_bytes += send_bytes;
+    }
+    
+#else
+    off_t    file_offset = 0;
+    bool     segmented = segmented_log && rb->channel == NULL;    // channels are single files
+    
+    while(1)
+    {
+        size_t    to_send = READBACK_SENDFILE_MAX;
+        
+        if(segmented && rb->offset < rb->limit && rb->offset >= rb->segment_end && readback_open_segment(rb) != 0)
+        {
+            rb->eof = true;
+            return 1;
+        }
+        
+        if( (off_t)to_send > (rb->limit - rb->offset) )
+        {
+            to_send = rb->limit - rb->offset;
+        }
+        
+        if(segmented && (off_t)to_send > (rb->segment_end - rb->offset))
+        {
+            to_send = rb->segment_end - rb->offset;
+        }
+        
+        if(to_send == 0)    // sent the whole snapshot
+        {
+            rb->eof = true;
+            return 1;
+        }
+        
+        file_offset = segmented ? rb->offset - rb->segment_base : rb->offset;
+        
+        rb->syscalls++;
+        send_start = aesd_metrics_clock();
+        send_bytes = sendfile(client_fd, segmented ? rb->segment_fd : fd, &file_offset, to_send);
+        aesd_metrics_record_since(AESD_METRICS_SEND, send_start);
+        
+        if(send_bytes == 0)    // file shorter than the snapshot
+        {
+            rb->eof = true;
+            return 1;
+        }
+        
+        if(send_bytes == -1)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
+            
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            
+            return -1;
+        }
+        
+        rb->offset += send_bytes;
+        rb->sent_bytes += send_bytes;
+    }
+#endif
+}
+
+
+// readback_run() for the record store: whole records are gathered straight from memory
+// into one sendmsg() per READBACK_IOV_MAX records, no copy and no read() of OUTPUT_FILE
+static int readback_run_store(readback_t* rb, const struct aesd_record_store* store, int client_fd)
+{
+    struct iovec                        iov[READBACK_IOV_MAX];
+    struct msghdr                       msg;
+    const struct aesd_record_entry*     entry = NULL;
+    ssize_t                             send_bytes = 0;
+    uint64_t                            send_start = 0;
+    size_t                              seq = 0;
+    size_t                              skip = 0;
+    int                                 count = 0;
+    
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    
+    while(1)
+    {
+        seq = rb->seq;
+        skip = rb->record_off;
+        count = 0;
+        
+        while(count < READBACK_IOV_MAX)
+        {
+            entry = aesd_record_store_get(store, seq);
+            
+            if(entry == NULL || entry->offset >= rb->limit)    // past the snapshot
+            {
+                break;
+            }
+            
+            iov[count].iov_base = (void*)(entry->data + skip);
+            iov[count].iov_len = entry->size - skip;
+            skip = 0;
+            seq++;
+            count++;
+        }
+        
+        if(count == 0)
+        {
+            rb->eof = true;
+            return 1;
+        }
+        
+        msg.msg_iovlen = count;
+        
+        rb->syscalls++;
+        send_start = aesd_metrics_clock();
+        send_bytes = sendmsg(client_fd, &msg, MSG_NOSIGNAL);
+        aesd_metrics_record_since(AESD_METRICS_SEND, send_start);
+        
+        if(send_bytes == -1)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
+            
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            
+            return -1;
+        }
+        
+        rb->sent_bytes += send_bytes;
+        rb->offset += send_bytes;
+        
+        // advance the cursor past every fully sent record
+        while(send_bytes > 0)
+        {
+            entry = aesd_record_store_get(store, rb->seq);
+            
+            if( (size_t)send_bytes < (entry->size - rb->record_off) )
+            {
+                rb->record_off += send_bytes;
+                break;
+            }
+            
+            send_bytes -= entry->size - rb->record_off;
+            rb->record_off = 0;
+            rb->seq++;
+        }
+    }
+}
+
+
+// copy up to size bytes of the log at rb->offset, but not past rb->limit, into buf whatever the backend
+// the segmented log may first move rb->offset past bytes deleted by the retention, and stops at the end
+// of a segment, which is a record boundary
+// return the number of bytes copied, fewer than size only at a record boundary or the end of the log, -1 on error
+static ssize_t readback_read(readback_t* rb, int fd, char* buf, size_t size)
+{
+    const struct aesd_record_store*    store = readback_store(rb);
+    const struct aesd_record_entry*    entry = NULL;
+    size_t     len = 0;
+    size_t     skip = 0;
+    size_t     seq = 0;
+    ssize_t    nbytes = 0;
+    off_t      offset = rb->offset;
+    
+#if !USE_AESD_CHAR_DEVICE
+    if(segmented_log && rb->channel == NULL && store == NULL && rb->offset < rb->limit && (rb->offset < rb->segment_base || rb->offset >= rb->segment_end))
+    {
+        if(readback_open_segment(rb) != 0)
+        {
+            return 0;
+        }
+        
+        // the record being scanned was deleted, start over with the first one kept
+        if(rb->offset != offset)
+        {
+            rb->line_start = rb->offset;
+            rb->line_match = false;
+        }
+    }
+#endif
+    
+    if( (off_t)size > (rb->limit - rb->offset) )
+    {
+        size = rb->limit - rb->offset;
+    }
+    
+    if(store != NULL)
+    {
+        for(seq = aesd_record_store_find(store, rb->offset); len < size; seq++)
+        {
+            entry = aesd_record_store_get(store, seq);
+            
+            if(entry == NULL)
+            {
+                break;
+            }
+            
+            skip = rb->offset + len - entry->offset;
+            nbytes = (entry->size - skip < size - len) ? entry->size - skip : size - len;
+            memcpy(buf+len, entry->data+skip, nbytes);
+            len += nbytes;
+        }
+        
+        return len;
+    }
+    
+    offset = rb->offset;
+    
+    if(rb->channel != NULL)
+    {
+        fd = rb->channel->fd;
+    }
+    
+#if !USE_AESD_CHAR_DEVICE
+    else if(segmented_log)
+    {
+        if( (off_t)size > (rb->segment_end - rb->offset) )
+        {
+            size = rb->segment_end - rb->offset;
+        }
+        
+        fd = rb->segment_fd;
+        offset = rb->offset - rb->segment_base;
+    }
+#endif
+    
+    // pread() may still return less than asked for, e.g. a driver that copies one entry per call
+    while(len < size)
+    {
+        nbytes = readback_pread(rb, fd, buf+len, size-len, offset+len);
+        
+        if(nbytes == 0)
+        {
+            break;
+        }
+        
+        if(nbytes == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            
+            return -1;
+        }
+        
+        len += nbytes;
+    }
+    
+    return len;
+}
+
+
+// read the next block of the log and keep only the records containing rb->filter, moved to the front of rb->buf
+// a record longer than the block is looked at in block sized pieces that overlap by the pattern length,
+// once one of them matches the record is read again from its start and sent up to its newline
+// return 0 on success, rb->buf_len is 0 when nothing in the block matched, -1 on error
+static int readback_filter_block(readback_t* rb, int fd)
+{
+    char*          block = rb->buf;
+    const char*    scan = NULL;         // next byte to look for the pattern at, always at a record start
+    const char*    scan_end = NULL;     // end of the records complete in the block
+    const char*    hit = NULL;
+    const char*    line = NULL;
+    const char*    line_end = NULL;
+    ssize_t        nbytes = 0;
+    off_t          base = 0;            // log offset of block[0]
+    bool           whole = false;       // the block ends at a record boundary
+    
+    rb->buf_len = 0;
+    rb->buf_off = 0;
+    
+    nbytes = readback_read(rb, fd, block, READBACK_BLOCK_SIZE);
+    
+    if(nbytes <= 0)
+    {
+        rb->eof = true;
+        return (int)nbytes;
+    }
+    
+    base = rb->offset;
+    whole = (nbytes < READBACK_BLOCK_SIZE);
+    rb->scanned_bytes += nbytes;
+    
+    if(rb->line_match)
+    {
+        line_end = memchr(block, '\n', nbytes);
+        rb->buf_len = (line_end != NULL) ? (size_t)(line_end + 1 - block) : (size_t)nbytes;
+        rb->offset = base + rb->buf_len;
+        
+        if(line_end != NULL || whole)
+        {
+            rb->line_match = false;
+            rb->line_start = rb->offset;
+        }
+        
+        return 0;
+    }
+    
+    line_end = memrchr(block, '\n', nbytes);
+    scan_end = (whole || line_end == NULL) ? block + nbytes : line_end + 1;
+    scan = block;
+    
+    while(scan < scan_end && (hit = aesd_match_find(rb->filter, scan, scan_end - scan)) != NULL)
+    {
+        line = memrchr(scan, '\n', hit - scan);
+        line = (line != NULL) ? line + 1 : scan;
+        
+        // the record started in an earlier block, nothing of this block was kept yet
+        if(line == block && rb->line_start < base)
+        {
+            rb->offset = rb->line_start;
+            rb->line_match = true;
+            return 0;
+        }
+        
+        line_end = memchr(hit, '\n', scan_end - hit);
+        
+        // no newline at all in the block, or the last record of a whole block lacks it
+        if(line_end == NULL)
+        {
+            memmove(block+rb->buf_len, line, scan_end - line);
+            rb->buf_len += scan_end - line;
+            rb->offset = base + nbytes;
+            rb->line_match = !whole;
+            rb->line_start = whole ? rb->offset : base + (line - block);
+            return 0;
+        }
+        
+        memmove(block+rb->buf_len, line, line_end + 1 - line);
+        rb->buf_len += line_end + 1 - line;
+        scan = line_end + 1;
+    }
+    
+    if(!whole && memchr(block, '\n', nbytes) == NULL)
+    {
+        // the record goes on past the block, the pattern may straddle the two
+        rb->offset = base + nbytes - (rb->filter->len - 1);
+    }
+    
+    else
+    {
+        rb->offset = base + (scan_end - block);
+        rb->line_start = rb->offset;
+    }
+    
+    return 0;
+}
+
+
+// readback_run() of a grep command: the log is read block by block, whatever the backend, and
+// only the records containing rb->filter are staged and sent
+static int readback_run_filter(readback_t* rb, int fd, int client_fd)
+{
+    ssize_t    send_bytes = 0;
+    uint64_t   send_start = 0;
+    
+    if(rb->buf == NULL)
+    {
+        rb->buf = malloc(READBACK_BLOCK_SIZE);
+        
+        if(rb->buf == NULL)
+        {
+            return -1;
+        }
+        
+        rb->line_start = rb->offset;
+    }
+    
+    while(1)
+    {
+        if(rb->buf_off == rb->buf_len)    // staged records fully sent, filter the next block
+        {
+            if(rb->eof)
+            {
+                return 1;
+            }
+            
+            if(readback_filter_block(rb, fd) != 0)
+            {
+                return -1;
+            }
+            
+            continue;
+        }
+        
+        rb->syscalls++;
+        send_start = aesd_metrics_clock();
+        send_bytes = send(client_fd, rb->buf+rb->buf_off, rb->buf_len-rb->buf_off, MSG_NOSIGNAL);
+        aesd_metrics_record_since(AESD_METRICS_SEND, send_start);
+        
+        if(send_bytes == -1)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
+            
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            
+            return -1;
+        }
+        
+        rb->buf_off += send_bytes;
+        rb->sent_bytes += send_bytes;
+    }
+}
+
+
+// report the cost of a readback and release its staging block
+static void readback_finish(readback_t* rb)
+{
+    if(rb->syscalls > 0)
+    {
+        syslog(LOG_DEBUG, "Readback sent %zu bytes using %u syscalls", rb->sent_bytes, rb->syscalls);
+        
+        if(rb->filter != NULL)
+        {
+            syslog(LOG_DEBUG, "Filtered readback scanned %zu bytes using %s", rb->scanned_bytes, aesd_match_impl());
+            aesd_metrics_add(AESD_METRICS_FILTER_SCANNED_BYTES, rb->scanned_bytes);
+        }
+        
+        aesd_metrics_record_since(AESD_METRICS_READBACK, rb->started);
+        aesd_metrics_add(AESD_METRICS_READBACKS, 1);
+        aesd_metrics_add(AESD_METRICS_READBACK_BYTES, rb->sent_bytes);
+        aesd_metrics_gauge_set(AESD_METRICS_READBACK_SIZE, rb->sent_bytes);
+    }
+    
+    free(rb->buf);
+    rb->buf = NULL;
+    rb->syscalls = 0;
+    
+    if(rb->segment_fd >= 0)
+    {
+        close(rb->segment_fd);
+        rb->segment_fd = -1;
+    }
+}
+
+
+// format the timestamp record for now, localtime_r() and strftime() only run when the second changed
+// only timer_thread calls this, the cache needs no lock
+static size_t timestamp_format(char* buf, size_t size)
+{
+    static char      cached[TIMESTAMP_SIZE];
+    static size_t    cached_len = 0;
+    static time_t    cached_second = -1;
+    struct tm        time_info;
+    time_t           time_now = time(NULL);
+    
+    if(time_now != cached_second)
+    {
+        localtime_r(&time_now, &time_info);
+        cached_len = strftime(cached, sizeof(cached), "timestamp:%a, %d %b %Y %T %z\n", &time_info);
+        cached_second = time_now;
+    }
+    
+    if(cached_len >= size)
+    {
+        return 0;
+    }
+    
+    memcpy(buf, cached, cached_len);
+    
+    return cached_len;
+}
+
+
+// appends a timestamp record every time timer_fd expires, until stop_fd is written
+// the record goes through log_append() like client data, so it is ordered and group committed with it
+static void* timer_thread(void* arg)
+{
+    timer_data_t*    td = arg;
+    struct pollfd    pfds[2];
+    uint64_t         expirations = 0;
+    char             buf[TIMESTAMP_SIZE];
+    size_t           nbytes = 0;
+    
+    pfds[0].fd = td->timer_fd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = td->stop_fd;
+    pfds[1].events = POLLIN;
+    
+    while(1)
+    {
+        if(poll(pfds, 2, -1) == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            
+            perror("timer_thread poll() failed");
+            break;
+        }
+        
+        if(pfds[1].revents != 0)
+        {
+            break;
+        }
+        
+        // expirations missed while blocked in log_append() collapse into one timestamp
+        if(read(td->timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+        {
+            continue;
+        }
+        
+        nbytes = timestamp_format(buf, sizeof(buf));
+        
+        if(log_append(NULL, td->fd, buf, nbytes, NULL) == -1)
+        {
+            perror("timer_thread write() failed\n");
+            exit(-1);
+        }
+    }
+    
+    return NULL;
+}
+
+
+// arm a timerfd firing every TIMESTAMP_INTERVAL_S seconds, the first timestamp is written one interval from now
+static int timer_start(timer_data_t* td, int output_fd)
+{
+    struct itimerspec    itimerspec;
+    struct timespec      start_time;
+    
+    td->fd = output_fd;
+    td->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    td->stop_fd = eventfd(0, EFD_CLOEXEC);
+    
+    if(td->timer_fd == -1 || td->stop_fd == -1)
+    {
+        printf("Error %d (%s) creating timer!\n",errno,strerror(errno));
+        goto fail;
+    }
+    
+    if ( clock_gettime(CLOCK_MONOTONIC, &start_time) != 0 ) 
+    {
+        printf("Error %d (%s) getting clock time\n", errno, strerror(errno));
+        goto fail;
+    }
+    
+    itimerspec.it_interval.tv_sec = TIMESTAMP_INTERVAL_S;
+    itimerspec.it_interval.tv_nsec = 0;
+    
+    timespec_add(&itimerspec.it_value,&start_time,&itimerspec.it_interval);
+    
+    if( timerfd_settime(td->timer_fd, TFD_TIMER_ABSTIME, &itimerspec, NULL) != 0 ) 
+    {
+        printf("Error %d (%s) setting timer\n",errno,strerror(errno));
+        goto fail;
+    }
+    
+    if(pthread_create(&td->thread, NULL, timer_thread, td) != 0)
+    {
+        printf("failed to create timer thread\n");
+        goto fail;
+    }
+    
+    return 0;
+    
+    fail:
+    if(td->timer_fd >= 0)
+    {
+        close(td->timer_fd);
+    }
+    
+    if(td->stop_fd >= 0)
+    {
+        close(td->stop_fd);
+    }
+    
+    td->timer_fd = -1;
+    td->stop_fd = -1;
+    
+    return -1;
+}
+
+
+static void timer_finish(timer_data_t* td)
+{
+    uint64_t    stop = 1;
+    
+    if(td->timer_fd < 0)
+    {
+        return;
+    }
+    
+    if(write(td->stop_fd, &stop, sizeof(stop)) == sizeof(stop))
+    {
+        pthread_join(td->thread, NULL);
+    }
+    
+    close(td->timer_fd);
+    close(td->stop_fd);
+}
+
+
+// delete the segments that fell out of the retention every RETENTION_INTERVAL_MS until retention_finish()
+// unlink() runs here, never under locker, so appenders do not wait for the filesystem
+static void* retention_thread(void* arg)
+{
+    struct pollfd    pfd;
+    int              rc = 0;
+    
+    pfd.fd = retention_stop_fd;
+    pfd.events = POLLIN;
+    
+    while(1)
+    {
+        aesd_segment_log_expire(&segment_log, time(NULL));
+        aesd_metrics_gauge_set(AESD_METRICS_RETAINED_BYTES, aesd_segment_log_retained(&segment_log));
+        
+        rc = poll(&pfd, 1, RETENTION_INTERVAL_MS);
+        
+        if(rc == -1 && errno != EINTR)
+        {
+            perror("retention poll() failed");
+            break;
+        }
+        
+        if(rc > 0)
+        {
+            break;
+        }
+    }
+    
+    return NULL;
+}
+
+
+static int retention_start(void)
+{
+    retention_stop_fd = eventfd(0, EFD_CLOEXEC);
+    
+    if(retention_stop_fd == -1 || pthread_create(&retention_thread_id, NULL, retention_thread, NULL) != 0)
+    {
+        printf("failed to start the segment retention\n");
+        
+        if(retention_stop_fd >= 0)
+        {
+            close(retention_stop_fd);
+        }
+        
+        retention_stop_fd = -1;
+        return -1;
+    }
+    
+    return 0;
+}
+
+
+static void retention_finish(void)
+{
+    uint64_t    stop = 1;
+    
+    if(retention_stop_fd < 0)
+    {
+        return;
+    }
+    
+    if(write(retention_stop_fd, &stop, sizeof(stop)) == sizeof(stop))
+    {
+        pthread_join(retention_thread_id, NULL);
+    }
+    
+    close(retention_stop_fd);
+    retention_stop_fd = -1;
+}
+
+
+// open the datagram socket: a decimal port is a UDP socket on every address, anything else a Unix socket path
+static int dgram_open(const char* addr)
+{
+    struct sockaddr_in    inet_addr;
+    char*                 end = NULL;
+    long                  port = strtol(addr, &end, 10);
+    int                   size = DGRAM_RCVBUF;
+    int                   sock = -1;
+    
+    if(*addr != '\0' && *end == '\0')
+    {
+        if(port <= 0 || port > 65535)
+        {
+            printf("Invalid datagram port %s\n", addr);
+            return -1;
+        }
+        
+        sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        
+        if(sock == -1)
+        {
+            perror("datagram socket() failed");
+            return -1;
+        }
+        
+        memset(&inet_addr, 0, sizeof(inet_addr));
+        inet_addr.sin_family = AF_INET;
+        inet_addr.sin_port = htons(port);
+        inet_addr.sin_addr.s_addr = INADDR_ANY;
+        
+        if(bind(sock, (struct sockaddr*)&inet_addr, sizeof(inet_addr)) == -1)
+        {
+            perror("datagram bind() failed");
+            close(sock);
+            return -1;
+        }
+    }
+    
+    else
+    {
+        sock = unix_socket_bind(addr, SOCK_DGRAM);
+        
+        if(sock == -1)
+        {
+            return -1;
+        }
+    }
+    
+    // capped by net.core.rmem_max, a best effort
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    
+    return sock;
+}
+
+
+// append the datagrams received by recvmmsg(), every one holding whole lines
+// they are packed to the front of slab and appended with one log_append()
+// a datagram cut short by the kernel or not ending with a newline is dropped, there is nobody to tell
+static void dgram_append(int output_fd, char* slab, struct mmsghdr* msgs, int count)
+{
+    size_t    len = 0;
+    size_t    size = 0;
+    int       records = 0;
+    int       i = 0;
+    char*     data = NULL;
+    off_t     end = 0;
+    
+    for(i = 0; i < count; i++)
+    {
+        data = slab + (size_t)i * DGRAM_MAX_SIZE;
+        size = msgs[i].msg_len;
+        
+        aesd_metrics_add(AESD_METRICS_RECEIVED_BYTES, size);
+        
+        if(size == 0 || (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) || data[size-1] != '\n')
+        {
+            aesd_metrics_add(AESD_METRICS_DROPPED_DATAGRAMS, 1);
+            continue;
+        }
+        
+        memmove(slab + len, data, size);
+        len += size;
+        records++;
+    }
+    
+    if(records == 0)
+    {
+        return;
+    }
+    
+    if(log_append(listener_channel, output_fd, slab, len, &end) != (ssize_t)len)
+    {
+        printf("not completely written\n");
+    }
+    
+    // log_append() counted the batch as one record
+    aesd_metrics_add(AESD_METRICS_RECORDS, records - 1);
+}
+
+
+// drain dgram_fd in batches of DGRAM_BATCH datagrams whenever it becomes readable, until dgram_finish()
+static void* dgram_thread(void* arg)
+{
+    struct mmsghdr    msgs[DGRAM_BATCH];
+    struct iovec      iovs[DGRAM_BATCH];
+    struct pollfd     pfds[2];
+    char*             slab = malloc((size_t)DGRAM_BATCH * DGRAM_MAX_SIZE);
+    int               output_fd = log_open();
+    int               count = 0;
+    int               i = 0;
+    
+    if(slab == NULL || (output_fd < 0 && !segmented_log))
+    {
+        printf("failed to set up the datagram receiver\n");
+        goto out;
+    }
+    
+    memset(msgs, 0, sizeof(msgs));
+    
+    for(i = 0; i < DGRAM_BATCH; i++)
+    {
+        iovs[i].iov_base = slab + (size_t)i * DGRAM_MAX_SIZE;
+        iovs[i].iov_len = DGRAM_MAX_SIZE;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    
+    pfds[0].fd = dgram_fd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = dgram_stop_fd;
+    pfds[1].events = POLLIN;
+    
+    while(1)
+    {
+        if(poll(pfds, 2, -1) == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            
+            perror("datagram poll() failed");
+            break;
+        }
+        
+        if(pfds[1].revents != 0)
+        {
+            break;
+        }
+        
+        // a short batch means the socket is drained
+        do
+        {
+            count = recvmmsg(dgram_fd, msgs, DGRAM_BATCH, MSG_DONTWAIT, NULL);
+            
+            if(count > 0)
+            {
+                dgram_append(output_fd, slab, msgs, count);
+            }
+        }
+        while(count == DGRAM_BATCH);
+    }
+    
+    out:
+    free(slab);
+    
+    if(output_fd >= 0)
+    {
+        close(output_fd);
+    }
+    
+    return NULL;
+}
+
+
+static int dgram_start(void)
+{
+    dgram_fd = dgram_open(dgram_addr);
+    dgram_stop_fd = eventfd(0, EFD_CLOEXEC);
+    
+    if(dgram_fd == -1 || dgram_stop_fd == -1 || pthread_create(&dgram_thread_id, NULL, dgram_thread, NULL) != 0)
+    {
+        printf("failed to start the datagram receiver\n");
+        
+        if(dgram_fd >= 0)
+        {
+            close(dgram_fd);
+        }
+        
+        if(dgram_stop_fd >= 0)
+        {
+            close(dgram_stop_fd);
+        }
+        
+        dgram_fd = -1;
+        dgram_stop_fd = -1;
+        return -1;
+    }
+    
+    return 0;
+}
+
+
+static void dgram_finish(void)
+{
+    uint64_t    stop = 1;
+    
+    if(dgram_fd < 0)
+    {
+        return;
+    }
+    
+    if(write(dgram_stop_fd, &stop, sizeof(stop)) == sizeof(stop))
+    {
+        pthread_join(dgram_thread_id, NULL);
+    }
+    
+    close(dgram_fd);
+    close(dgram_stop_fd);
+    dgram_fd = -1;
+    dgram_stop_fd = -1;
+    
+    if(strtol(dgram_addr, NULL, 10) <= 0)    // Unix socket path
+    {
+        unlink(dgram_addr);
+    }
+}
+
+
+void sig_handler(int signo)
+{
+    if(signo == SIGINT || signo==SIGTERM) 
+    {
+        shutdown(server_fd, SHUT_RDWR);
+        shut_down_flag = true;
+    }
 }
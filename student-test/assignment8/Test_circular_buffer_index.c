@@ -0,0 +1,243 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+/**
+* Adds a copy of @param writestr to @param buffer and frees whatever the entry cap and the byte budget push out
+*/
+static void add_string(struct aesd_circular_buffer *buffer, const char *writestr)
+{
+    struct aesd_buffer_entry    entry;
+    const char*                 discard = NULL;
+    
+    entry.buffptr = strdup(writestr);
+    entry.size = strlen(writestr);
+    
+    discard = aesd_circular_buffer_add_entry(buffer, &entry);
+    free((void*)discard);
+    
+    while( (discard = aesd_circular_buffer_trim(buffer)) != NULL )
+    {
+        free((void*)discard);
+    }
+}
+
+/**
+* Checks that char_offset lands in the entry holding @param expected_str at @param expected_offset
+*/
+static void verify_fpos(struct aesd_circular_buffer *buffer, size_t char_offset, const char *expected_str, size_t expected_offset)
+{
+    struct aesd_buffer_entry*   entry = NULL;
+    size_t                      entry_offset = 0;
+    char                        message[80];
+    
+    snprintf(message, sizeof(message), "---> WRONG ENTRY AT OFFSET %zu <---", char_offset);
+    
+    entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, char_offset, &entry_offset);
+    
+    TEST_ASSERT_NOT_NULL_MESSAGE(entry, message);
+    TEST_ASSERT_EQUAL_STRING_MESSAGE(expected_str, entry->buffptr, message);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(expected_offset, entry_offset, message);
+}
+
+/**
+* Offsets past 255 bytes of history are found, the cumulative size is not truncated to 8 bits
+*/
+void test_circular_buffer_index_past_255_bytes()
+{
+    struct aesd_circular_buffer     buffer;
+    char                            writestr[10][48];
+    int                             i = 0;
+    
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init(&buffer));
+    
+    for(i = 0; i < 10; i++)
+    {
+        snprintf(writestr[i], sizeof(writestr[i]), "write%d with some padding to reach forty bytes\n", i);
+        add_string(&buffer, writestr[i]);
+    }
+    
+    verify_fpos(&buffer, 0, writestr[0], 0);
+    verify_fpos(&buffer, 6*strlen(writestr[0]) + 20, writestr[6], 20);
+    verify_fpos(&buffer, 10*strlen(writestr[0]) - 1, writestr[9], strlen(writestr[9]) - 1);
+    
+    aesd_circular_buffer_free(&buffer);
+}
+
+/**
+* The default ring holds one slot per entry, so once full the next write lands on the oldest entry
+*/
+void test_circular_buffer_index_full_default()
+{
+    struct aesd_circular_buffer     buffer;
+    int                             i = 0;
+    
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init(&buffer));
+    
+    for(i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++)
+    {
+        TEST_ASSERT_FALSE(buffer.full);
+        add_string(&buffer, "write\n");
+    }
+    
+    TEST_ASSERT_TRUE(buffer.full);
+    TEST_ASSERT_EQUAL_INT(buffer.out_offs, buffer.in_offs);
+    
+    add_string(&buffer, "wrapped\n");
+    
+    TEST_ASSERT_TRUE(buffer.full);
+    TEST_ASSERT_EQUAL_INT(1, buffer.out_offs);
+    TEST_ASSERT_EQUAL_INT(buffer.out_offs, buffer.in_offs);
+    verify_fpos(&buffer, 9*strlen("write\n"), "wrapped\n", 0);
+    
+    aesd_circular_buffer_free(&buffer);
+}
+
+/**
+* Every offset maps to the right entry after the ring wrapped many times with entries of different sizes
+*/
+void test_circular_buffer_index_after_wrap()
+{
+    struct aesd_circular_buffer     buffer;
+    char                            writestr[40];
+    size_t                          sizes[1000];
+    size_t                          char_offset = 0;
+    size_t                          entry_start = 0;
+    int                             i = 0;
+    int                             n = 0;
+    
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init_size(&buffer, 1000, 0));
+    
+    for(i = 0; i < 3500; i++)
+    {
+        n = snprintf(writestr, sizeof(writestr), "%d:%.*s\n", i, i % 23, "abcdefghijklmnopqrstuvw");
+        sizes[i % 1000] = n;
+        add_string(&buffer, writestr);
+    }
+    
+    TEST_ASSERT_EQUAL_INT(1000, buffer.count);
+    
+    // the buffer holds writes 2500 to 3499
+    for(i = 2500; i < 3500; i++)
+    {
+        snprintf(writestr, sizeof(writestr), "%d:%.*s\n", i, i % 23, "abcdefghijklmnopqrstuvw");
+        
+        for(char_offset = entry_start; char_offset < entry_start + sizes[i % 1000]; char_offset++)
+        {
+            verify_fpos(&buffer, char_offset, writestr, char_offset - entry_start);
+        }
+        
+        entry_start += sizes[i % 1000];
+    }
+    
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, entry_start, &char_offset),
+                             "---> OFFSET PAST THE END WAS FOUND <---");
+    
+    aesd_circular_buffer_free(&buffer);
+}
+
+/**
+* The byte budget evicts the oldest writes and offsets restart at the oldest one kept
+*/
+void test_circular_buffer_index_byte_budget()
+{
+    struct aesd_circular_buffer     buffer;
+    size_t                          entry_offset = 0;
+    
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init_size(&buffer, 8, 20));
+    
+    TEST_ASSERT_NULL(aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 0, &entry_offset));
+    
+    add_string(&buffer, "first1\n");
+    add_string(&buffer, "second\n");
+    add_string(&buffer, "third3\n");    // 21 bytes, first1 goes
+    
+    TEST_ASSERT_EQUAL_INT(2, buffer.count);
+    verify_fpos(&buffer, 0, "second\n", 0);
+    verify_fpos(&buffer, 8, "third3\n", 1);
+    TEST_ASSERT_NULL(aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 14, &entry_offset));
+    
+    // a single write above the budget is kept alone
+    add_string(&buffer, "a write longer than the budget\n");
+    
+    TEST_ASSERT_EQUAL_INT(1, buffer.count);
+    verify_fpos(&buffer, 2, "a write longer than the budget\n", 2);
+    
+    aesd_circular_buffer_free(&buffer);
+}
+
+/**
+* Entry caps out of range are refused
+*/
+void test_circular_buffer_index_invalid_size()
+{
+    struct aesd_circular_buffer     buffer;
+    
+    TEST_ASSERT_NOT_EQUAL(0, aesd_circular_buffer_init_size(&buffer, 0, 0));
+    TEST_ASSERT_NOT_EQUAL(0, aesd_circular_buffer_init_size(&buffer, AESDCHAR_MAX_ENTRIES_LIMIT + 1, 0));
+}
+
+/**
+* Walking on from the entry found for an offset visits every newer entry in order and stops after the newest,
+* as a multi-entry aesd_read does
+*/
+void test_circular_buffer_index_next_entry()
+{
+    struct aesd_circular_buffer     buffer;
+    struct aesd_buffer_entry*       entry = NULL;
+    size_t                          entry_offset = 0;
+    char                            writestr[16];
+    int                             i = 0;
+    
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init_size(&buffer, 4, 0));
+    
+    for(i = 0; i < 6; i++)    // writes 2 to 5 are kept, the ring wrapped
+    {
+        snprintf(writestr, sizeof(writestr), "write%d\n", i);
+        add_string(&buffer, writestr);
+    }
+    
+    entry = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 10, &entry_offset);
+    
+    for(i = 3; i < 6; i++)
+    {
+        snprintf(writestr, sizeof(writestr), "write%d\n", i);
+        TEST_ASSERT_NOT_NULL(entry);
+        TEST_ASSERT_EQUAL_STRING(writestr, entry->buffptr);
+        entry = aesd_circular_buffer_next_entry(&buffer, entry);
+    }
+    
+    TEST_ASSERT_NULL(entry);
+    
+    aesd_circular_buffer_free(&buffer);
+}
+
+/**
+* A write command and an offset within it map to the position aesd_circular_buffer_find_entry_offset_for_fpos
+* resolves back to them, as AESDCHAR_IOCSEEKTO does
+*/
+void test_circular_buffer_index_fpos_for_entry()
+{
+    struct aesd_circular_buffer     buffer;
+    size_t                          char_offset = 0;
+    
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init_size(&buffer, 2, 0));
+    
+    add_string(&buffer, "old\n");
+    add_string(&buffer, "write1\n");
+    add_string(&buffer, "write22\n");    // old is pushed out, write1 is write command 0
+    
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_fpos_for_entry(&buffer, 0, 0, &char_offset));
+    TEST_ASSERT_EQUAL_INT(0, char_offset);
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_fpos_for_entry(&buffer, 1, 3, &char_offset));
+    TEST_ASSERT_EQUAL_INT(10, char_offset);
+    verify_fpos(&buffer, char_offset, "write22\n", 3);
+    
+    TEST_ASSERT_NOT_EQUAL(0, aesd_circular_buffer_fpos_for_entry(&buffer, 1, 8, &char_offset));
+    TEST_ASSERT_NOT_EQUAL(0, aesd_circular_buffer_fpos_for_entry(&buffer, 2, 0, &char_offset));
+    
+    aesd_circular_buffer_free(&buffer);
+}
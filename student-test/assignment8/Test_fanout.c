@@ -0,0 +1,287 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include "../../server/aesd-fanout.h"
+
+#define TEST_FANOUT_RECORDS     200          // records streamed through the small socket buffer
+#define TEST_FANOUT_SNDBUF      4096         // SO_SNDBUF of the subscriber's socket, far below the records queued
+
+/**
+* @return true if the eventfd of @param subscriber was signalled, the signal is consumed
+*/
+static bool woken(struct aesd_fanout_subscriber *subscriber)
+{
+    uint64_t    events = 0;
+    
+    return read(subscriber->event_fd, &events, sizeof(events)) == sizeof(events);
+}
+
+/**
+* Publishes @param count records of @param len bytes filled with @param fill
+* @return the number of subscribers they were dropped for or that were cut off, summed over the records
+*/
+static size_t publish_many(struct aesd_fanout *fanout, size_t count, size_t len, char fill)
+{
+    char*     buf = malloc(len);
+    size_t    dropped = 0;
+    size_t    i = 0;
+    
+    TEST_ASSERT_NOT_NULL(buf);
+    memset(buf, fill, len);
+    
+    for(i = 0; i < count; i++)
+    {
+        dropped += aesd_fanout_publish(fanout, buf, len);
+    }
+    
+    free(buf);
+    
+    return dropped;
+}
+
+/**
+* Records stream through a socket that only takes part of them per sendmsg(), the bytes the peer receives
+* always match what the ring says was sent, including the part of a record sent before the socket filled up
+*/
+void test_fanout_partial_send()
+{
+    struct aesd_fanout                 fanout;
+    struct aesd_fanout_subscriber*     subscriber = NULL;
+    char*                              expected = NULL;
+    char*                              received = NULL;
+    size_t                             total = 0;
+    size_t                             received_len = 0;
+    size_t                             len = 0;
+    ssize_t                            nbytes = 0;
+    int                                sv[2];
+    int                                sndbuf = TEST_FANOUT_SNDBUF;
+    int                                blocked = 0;
+    int                                rc = 0;
+    int                                i = 0;
+    
+    aesd_fanout_init(&fanout, AESD_FANOUT_DISCONNECT);
+    subscriber = aesd_fanout_subscribe(&fanout);
+    TEST_ASSERT_NOT_NULL(subscriber);
+    
+    TEST_ASSERT_EQUAL_INT(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+    TEST_ASSERT_EQUAL_INT(0, setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)));
+    
+    expected = malloc(TEST_FANOUT_RECORDS * 1024);
+    received = malloc(TEST_FANOUT_RECORDS * 1024);
+    TEST_ASSERT_NOT_NULL(expected);
+    TEST_ASSERT_NOT_NULL(received);
+    
+    // sizes that never line up with the socket buffer, so sends stop inside records
+    for(i = 0; i < TEST_FANOUT_RECORDS; i++)
+    {
+        len = 300 + (i * 37) % 700;
+        memset(expected + total, 'a' + i % 26, len - 1);
+        expected[total + len - 1] = '\n';
+        TEST_ASSERT_EQUAL_INT(0, aesd_fanout_publish(&fanout, expected + total, len));
+        total += len;
+    }
+    
+    TEST_ASSERT_TRUE(woken(subscriber));
+    TEST_ASSERT_EQUAL_INT(total, subscriber->queued_bytes);
+    
+    do
+    {
+        rc = aesd_fanout_send(subscriber, sv[0], MSG_DONTWAIT);
+        TEST_ASSERT_TRUE(rc >= 0);
+        
+        if(rc == 0)
+        {
+            blocked++;
+        }
+        
+        while( (nbytes = recv(sv[1], received + received_len, total - received_len, MSG_DONTWAIT)) > 0 )
+        {
+            received_len += nbytes;
+        }
+        
+        TEST_ASSERT_EQUAL_INT(total - subscriber->queued_bytes + subscriber->sent, received_len);
+    }
+    while(rc == 0);
+    
+    TEST_ASSERT_TRUE(blocked > 0);
+    TEST_ASSERT_EQUAL_INT(total, received_len);
+    TEST_ASSERT_EQUAL_INT(0, subscriber->sent);
+    TEST_ASSERT_EQUAL_INT(0, subscriber->queued_bytes);
+    TEST_ASSERT_EQUAL_INT(0, memcmp(expected, received, total));
+    
+    aesd_fanout_unsubscribe(&fanout, subscriber);
+    aesd_fanout_destroy(&fanout);
+    close(sv[0]);
+    close(sv[1]);
+    free(expected);
+    free(received);
+}
+
+/**
+* A full ring of AESD_FANOUT_QUEUE_RECORDS skips the next record under AESD_FANOUT_DROP and keeps going
+*/
+void test_fanout_drop_on_records()
+{
+    struct aesd_fanout                 fanout;
+    struct aesd_fanout_subscriber*     subscriber = NULL;
+    
+    aesd_fanout_init(&fanout, AESD_FANOUT_DROP);
+    subscriber = aesd_fanout_subscribe(&fanout);
+    TEST_ASSERT_NOT_NULL(subscriber);
+    
+    TEST_ASSERT_EQUAL_INT(0, publish_many(&fanout, AESD_FANOUT_QUEUE_RECORDS, 8, 'a'));
+    TEST_ASSERT_EQUAL_INT(AESD_FANOUT_QUEUE_RECORDS, subscriber->tail - subscriber->head);
+    
+    TEST_ASSERT_EQUAL_INT(3, publish_many(&fanout, 3, 8, 'b'));
+    TEST_ASSERT_EQUAL_INT(3, subscriber->dropped);
+    TEST_ASSERT_FALSE(subscriber->cut_off);
+    TEST_ASSERT_EQUAL_INT(AESD_FANOUT_QUEUE_RECORDS, subscriber->tail - subscriber->head);
+    TEST_ASSERT_EQUAL_INT(AESD_FANOUT_QUEUE_RECORDS * 8, subscriber->queued_bytes);
+    
+    aesd_fanout_unsubscribe(&fanout, subscriber);
+    aesd_fanout_destroy(&fanout);
+}
+
+/**
+* A full ring of AESD_FANOUT_QUEUE_RECORDS cuts the subscriber off under AESD_FANOUT_DISCONNECT,
+* it is woken to notice and nothing is queued for it afterwards
+*/
+void test_fanout_disconnect_on_records()
+{
+    struct aesd_fanout                 fanout;
+    struct aesd_fanout_subscriber*     subscriber = NULL;
+    int                                sv[2];
+    
+    aesd_fanout_init(&fanout, AESD_FANOUT_DISCONNECT);
+    subscriber = aesd_fanout_subscribe(&fanout);
+    TEST_ASSERT_NOT_NULL(subscriber);
+    TEST_ASSERT_EQUAL_INT(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+    
+    TEST_ASSERT_EQUAL_INT(0, publish_many(&fanout, AESD_FANOUT_QUEUE_RECORDS, 8, 'a'));
+    TEST_ASSERT_TRUE(woken(subscriber));
+    
+    TEST_ASSERT_EQUAL_INT(1, publish_many(&fanout, 1, 8, 'b'));
+    TEST_ASSERT_TRUE(subscriber->cut_off);
+    TEST_ASSERT_EQUAL_INT(0, subscriber->dropped);
+    TEST_ASSERT_TRUE(woken(subscriber));
+    
+    TEST_ASSERT_EQUAL_INT(2, publish_many(&fanout, 2, 8, 'c'));
+    TEST_ASSERT_EQUAL_INT(AESD_FANOUT_QUEUE_RECORDS, subscriber->tail - subscriber->head);
+    
+    TEST_ASSERT_EQUAL_INT(-1, aesd_fanout_send(subscriber, sv[0], MSG_DONTWAIT));
+    TEST_ASSERT_EQUAL_INT(ENOBUFS, errno);
+    
+    aesd_fanout_unsubscribe(&fanout, subscriber);
+    aesd_fanout_destroy(&fanout);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+/**
+* AESD_FANOUT_QUEUE_BYTES limits the ring before it runs out of slots, under both policies
+*/
+void test_fanout_byte_budget()
+{
+    struct aesd_fanout                 fanout;
+    struct aesd_fanout_subscriber*     subscriber = NULL;
+    size_t                             len = AESD_FANOUT_QUEUE_BYTES / 4;
+    
+    aesd_fanout_init(&fanout, AESD_FANOUT_DROP);
+    subscriber = aesd_fanout_subscribe(&fanout);
+    TEST_ASSERT_NOT_NULL(subscriber);
+    
+    TEST_ASSERT_EQUAL_INT(0, publish_many(&fanout, 4, len, 'a'));
+    TEST_ASSERT_EQUAL_INT(AESD_FANOUT_QUEUE_BYTES, subscriber->queued_bytes);
+    TEST_ASSERT_EQUAL_INT(1, publish_many(&fanout, 1, 1, 'b'));
+    TEST_ASSERT_EQUAL_INT(1, subscriber->dropped);
+    TEST_ASSERT_EQUAL_INT(4, subscriber->tail - subscriber->head);
+    
+    aesd_fanout_unsubscribe(&fanout, subscriber);
+    aesd_fanout_destroy(&fanout);
+    
+    aesd_fanout_init(&fanout, AESD_FANOUT_DISCONNECT);
+    subscriber = aesd_fanout_subscribe(&fanout);
+    TEST_ASSERT_NOT_NULL(subscriber);
+    
+    TEST_ASSERT_EQUAL_INT(0, publish_many(&fanout, 4, len, 'a'));
+    TEST_ASSERT_EQUAL_INT(1, publish_many(&fanout, 1, 1, 'b'));
+    TEST_ASSERT_TRUE(subscriber->cut_off);
+    TEST_ASSERT_EQUAL_INT(4, subscriber->tail - subscriber->head);
+    
+    aesd_fanout_unsubscribe(&fanout, subscriber);
+    aesd_fanout_destroy(&fanout);
+}
+
+/**
+* A record larger than the whole byte budget is still queued into an empty ring, and fills it
+*/
+void test_fanout_oversized_record()
+{
+    struct aesd_fanout                 fanout;
+    struct aesd_fanout_subscriber*     subscriber = NULL;
+    
+    aesd_fanout_init(&fanout, AESD_FANOUT_DROP);
+    subscriber = aesd_fanout_subscribe(&fanout);
+    TEST_ASSERT_NOT_NULL(subscriber);
+    
+    TEST_ASSERT_EQUAL_INT(0, publish_many(&fanout, 1, AESD_FANOUT_QUEUE_BYTES + 1, 'a'));
+    TEST_ASSERT_EQUAL_INT(1, subscriber->tail - subscriber->head);
+    TEST_ASSERT_EQUAL_INT(AESD_FANOUT_QUEUE_BYTES + 1, subscriber->queued_bytes);
+    TEST_ASSERT_TRUE(woken(subscriber));
+    
+    // nothing else fits next to it
+    TEST_ASSERT_EQUAL_INT(1, publish_many(&fanout, 1, 1, 'b'));
+    TEST_ASSERT_EQUAL_INT(1, subscriber->tail - subscriber->head);
+    
+    aesd_fanout_unsubscribe(&fanout, subscriber);
+    aesd_fanout_destroy(&fanout);
+}
+
+/**
+* Leaving releases the references the ring still holds, a record shared with another subscriber
+* lives on until that one leaves too. Run under a leak checker to see the last release free it
+*/
+void test_fanout_unsubscribe_releases()
+{
+    struct aesd_fanout                 fanout;
+    struct aesd_fanout_subscriber*     first = NULL;
+    struct aesd_fanout_subscriber*     second = NULL;
+    struct aesd_fanout_record*         record = NULL;
+    int                                sv[2];
+    int                                sndbuf = TEST_FANOUT_SNDBUF;
+    
+    aesd_fanout_init(&fanout, AESD_FANOUT_DISCONNECT);
+    first = aesd_fanout_subscribe(&fanout);
+    second = aesd_fanout_subscribe(&fanout);
+    TEST_ASSERT_NOT_NULL(first);
+    TEST_ASSERT_NOT_NULL(second);
+    
+    TEST_ASSERT_EQUAL_INT(0, publish_many(&fanout, 16, 1000, 'a'));
+    
+    // the newest record, still queued for both after the first one sent what its socket took
+    record = second->queue[(second->tail - 1) % AESD_FANOUT_QUEUE_RECORDS];
+    TEST_ASSERT_EQUAL_INT(2, record->refs);
+    
+    // the first one stops partway through a record, nobody reads the socket
+    TEST_ASSERT_EQUAL_INT(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+    TEST_ASSERT_EQUAL_INT(0, setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)));
+    TEST_ASSERT_EQUAL_INT(0, aesd_fanout_send(first, sv[0], MSG_DONTWAIT));
+    TEST_ASSERT_TRUE(first->tail - first->head < 16);
+    
+    aesd_fanout_unsubscribe(&fanout, first);
+    TEST_ASSERT_EQUAL_INT(1, record->refs);
+    TEST_ASSERT_EQUAL_INT(16, second->tail - second->head);
+    
+    aesd_fanout_unsubscribe(&fanout, second);
+    TEST_ASSERT_TRUE(LIST_EMPTY(&fanout.subscribers));
+    
+    aesd_fanout_destroy(&fanout);
+    close(sv[0]);
+    close(sv[1]);
+}
@@ -0,0 +1,292 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "../../server/aesd-log-index.h"
+#include "../../server/aesd-crc32c.h"
+
+/**
+* A data file and the path of its index, both removed by close_log()
+*/
+struct test_log
+{
+    char    data_path[64];
+    char    index_path[72];
+    int     data_fd;
+};
+
+/**
+* Creates an empty data file for @param log, opened for appending like aesdsocket does
+*/
+static void create_log(struct test_log *log)
+{
+    int    fd = -1;
+    
+    strcpy(log->data_path, "/tmp/aesd-log-index-XXXXXX");
+    fd = mkstemp(log->data_path);
+    TEST_ASSERT_TRUE(fd >= 0);
+    close(fd);
+    
+    snprintf(log->index_path, sizeof(log->index_path), "%s.idx", log->data_path);
+    unlink(log->index_path);
+    
+    log->data_fd = open(log->data_path, O_RDWR | O_APPEND);
+    TEST_ASSERT_TRUE(log->data_fd >= 0);
+}
+
+static void close_log(struct test_log *log)
+{
+    close(log->data_fd);
+    unlink(log->data_path);
+    unlink(log->index_path);
+}
+
+/**
+* Appends @param str to the data file and stages its entry, like log_publish() does
+*/
+static void append(struct test_log *log, struct aesd_log_index *index, const char *str)
+{
+    TEST_ASSERT_EQUAL_INT(strlen(str), write(log->data_fd, str, strlen(str)));
+    TEST_ASSERT_EQUAL_INT(0, aesd_log_index_add(index, str, strlen(str)));
+}
+
+/**
+* Appends @param str to the data file without indexing it, an append the server died in
+*/
+static void append_unindexed(struct test_log *log, const char *str)
+{
+    TEST_ASSERT_EQUAL_INT(strlen(str), write(log->data_fd, str, strlen(str)));
+}
+
+/**
+* Closes the index without flushing its pending entries, as a crash would leave it
+*/
+static void crash(struct aesd_log_index *index)
+{
+    close(index->fd);
+    index->fd = -1;
+}
+
+/**
+* Checks that the data file holds exactly @param expected
+*/
+static void verify_data(struct test_log *log, const char *expected)
+{
+    char           buf[256];
+    struct stat    st;
+    
+    TEST_ASSERT_EQUAL_INT(0, fstat(log->data_fd, &st));
+    TEST_ASSERT_EQUAL_INT(strlen(expected), st.st_size);
+    TEST_ASSERT_EQUAL_INT(st.st_size, pread(log->data_fd, buf, sizeof(buf) - 1, 0));
+    buf[st.st_size] = '\0';
+    TEST_ASSERT_EQUAL_STRING(expected, buf);
+}
+
+/**
+* Overwrites the byte at @param offset of the file at @param path
+*/
+static void corrupt(const char *path, off_t offset)
+{
+    int     fd = open(path, O_RDWR);
+    char    byte = 0;
+    
+    TEST_ASSERT_TRUE(fd >= 0);
+    TEST_ASSERT_EQUAL_INT(1, pread(fd, &byte, 1, offset));
+    byte ^= 0x5a;
+    TEST_ASSERT_EQUAL_INT(1, pwrite(fd, &byte, 1, offset));
+    close(fd);
+}
+
+/**
+* Appends keep the boundaries they were written with across a restart, the bytes after the
+* last newline of an acknowledged append included
+*/
+void test_log_index_reopen()
+{
+    struct test_log          log;
+    struct aesd_log_index    index;
+    
+    create_log(&log);
+    
+    TEST_ASSERT_EQUAL_INT(0, aesd_log_index_open(&index, log.index_path, log.data_fd, 0));
+    append(&log, &index, "abc\ndef");
+    append(&log, &index, "ghi\n");
+    TEST_ASSERT_EQUAL_INT(0, aesd_log_index_flush(&index));
+    crash(&index);
+    
+    TEST_ASSERT_EQUAL_INT(0, aesd_log_index_open(&index, log.index_path, log.data_fd, 0));
+    TEST_ASSERT_EQUAL_INT(2, index.count);
+    TEST_ASSERT_EQUAL_INT(11, index.end);
+    verify_data(&log, "abc\ndefghi\n");
+    
+    append(&log, &index, "jkl\n");
+    aesd_log_index_close(&index);
+    
+    TEST_ASSERT_EQUAL_INT(0, aesd_log_index_open(&index, log.index_path, log.data_fd, 0));
+    TEST_ASSERT_EQUAL_INT(3, index.count);
+    TEST_ASSERT_EQUAL_INT(15, index.end);
+    aesd_log_index_close(&index);
+    
+    close_log(&log);
+}
+
+/**
+* Bytes past the newest flushed entry, torn or never indexed, are cut from the data file
+*/
+void test_log_index_torn_tail()
+{
+    struct test_log          log;
+    struct aesd_log_index    index;
+    
+    create_log(&log);
+    
+    TEST_ASSERT_EQUAL_INT(0, aesd_log_index_open(&index, log.index_path, log.data_fd, 0));
+    append(&log, &index, "abc\n");
+    TEST_ASSERT_EQUAL_INT(0, aesd_log_index_flush(&index));
+    append(&log, &index, "staged but never flushed\n");
+    append_unindexed(&log, "torn wri");
+    crash(&index);
+    
+    TEST_ASSERT_EQUAL_INT(0, aesd_log_index_open(&index, log.index_path, log.data_fd, 0));
+    TEST_ASSERT_EQUAL_INT(1, index.count);
+    TEST_ASSERT_EQUAL_INT(4, index.end);
+    verify_data(&log, "abc\n");
+    aesd_log_index_close(&index);
+    
+    close_log(&log);
+}
+
+/**
+* Entries whose data does not match are walked back over, the data file ends with the newest intact one
+*/
+void test_log_index_corrupted_last_entry()
+{
+    struct test_log          log;
+    struct aesd_log_index    index;
+    struct stat              st;
+    
+    create_log(&log);
+    
+    TEST_ASSERT_EQUAL_INT(0, aesd_log_index_open(&index, log.index_path, log.data_fd, 0));
+    append(&log, &index, "one\n");
+    append(&log, &index, "two\n");
+    append(&log, &index, "three\n");
+    aesd_log_index_close(&index);
+    
+    // the data of the last two appends did not make it to disk
+    corrupt(log.data_path, 5);
+    corrupt(log.data_path, 10);
+    
+    TEST_ASSERT_EQUAL_INT(0, aesd_log_index_open(&index, log.index_path, log.data_fd, 0));
+    TEST_ASSERT_EQUAL_INT(1, index.count);
+    TEST_ASSERT_EQUAL_INT(4, index.end);
+    verify_data(&log, "one\n");
+    aesd_log_index_close(&index);
+    
+    // the dropped entries are gone from the index file too
+    TEST_ASSERT_EQUAL_INT(0, stat(log.index_path, &st));
+    TEST_ASSERT_EQUAL_INT(sizeof(struct aesd_log_index_header) + sizeof(struct aesd_log_index_entry), st.st_size);
+    
+    // a torn index entry is no better than torn data
+    TEST_ASSERT_EQUAL_INT(0, aesd_log_index_open(&index, log.index_path, log.data_fd, 0));
+    append(&log, &index, "four\n");
+    aesd_log_index_close(&index);
+    corrupt(log.index_path, st.st_size + sizeof(struct aesd_log_index_entry) - 1);
+    
+    TEST_ASSERT_EQUAL_INT(0, aesd_log_index_open(&index, log.index_path, log.data_fd, 0));
+    TEST_ASSERT_EQUAL_INT(1, index.count);
+    verify_data(&log, "one\n");
+    aesd_log_index_close(&index);
+    
+    close_log(&log);
+}
+
+/**
+* An append longer than one entry covers is split, and the pieces come back as they were written
+*/
+void test_log_index_split_record()
+{
+    struct test_log          log;
+    struct aesd_log_index    index;
+    const char*              record = "a record longer than sixteen bytes ending here\n";
+    
+    create_log(&log);
+    
+    TEST_ASSERT_EQUAL_INT(0, aesd_log_index_open(&index, log.index_path, log.data_fd, 0));
+    index.max_record = 16;
+    append(&log, &index, record);
+    TEST_ASSERT_EQUAL_INT((strlen(record) + 15) / 16, index.count);
+    TEST_ASSERT_EQUAL_INT(strlen(record), index.end);
+    aesd_log_index_close(&index);
+    
+    TEST_ASSERT_EQUAL_INT(0, aesd_log_index_open(&index, log.index_path, log.data_fd, 0));
+    TEST_ASSERT_EQUAL_INT((strlen(record) + 15) / 16, index.count);
+    TEST_ASSERT_EQUAL_INT(strlen(record), index.end);
+    verify_data(&log, record);
+    aesd_log_index_close(&index);
+    
+    close_log(&log);
+}
+
+/**
+* A data file without an index keeps everything it holds, and its log offsets start at base
+*/
+void test_log_index_adopt()
+{
+    struct test_log          log;
+    struct aesd_log_index    index;
+    
+    create_log(&log);
+    append_unindexed(&log, "written before -W\nno newline");
+    
+    TEST_ASSERT_EQUAL_INT(0, aesd_log_index_open(&index, log.index_path, log.data_fd, 1000));
+    TEST_ASSERT_EQUAL_INT(1, index.count);
+    TEST_ASSERT_EQUAL_INT(1028, index.end);
+    crash(&index);
+    
+    TEST_ASSERT_EQUAL_INT(0, aesd_log_index_open(&index, log.index_path, log.data_fd, 1000));
+    TEST_ASSERT_EQUAL_INT(1028, index.end);
+    verify_data(&log, "written before -W\nno newline");
+    aesd_log_index_close(&index);
+    
+    close_log(&log);
+}
+
+/**
+* The slicing-by-8 fallback and the implementation picked for this CPU agree, whatever the alignment and length
+*/
+void test_log_index_crc32c_fallback()
+{
+    unsigned char    buf[1024 + 8];
+    size_t           offset = 0;
+    size_t           len = 0;
+    size_t           i = 0;
+    
+    // check value of the Castagnoli polynomial
+    TEST_ASSERT_EQUAL_HEX32(0xe3069283, aesd_crc32c(0, "123456789", 9));
+    TEST_ASSERT_EQUAL_HEX32(0xe3069283, aesd_crc32c_fallback(0, "123456789", 9));
+    
+    srand(8472);
+    
+    for(i = 0; i < sizeof(buf); i++)
+    {
+        buf[i] = rand();
+    }
+    
+    for(offset = 0; offset < 8; offset++)
+    {
+        for(len = 0; len <= 1024; len += 37)
+        {
+            TEST_ASSERT_EQUAL_HEX32(aesd_crc32c(0, buf + offset, len), aesd_crc32c_fallback(0, buf + offset, len));
+            
+            // continuing from the CRC of a prefix gives the CRC of the whole
+            TEST_ASSERT_EQUAL_HEX32(aesd_crc32c(0, buf + offset, len),
+                                    aesd_crc32c_fallback(aesd_crc32c(0, buf + offset, len / 3), buf + offset + len / 3, len - len / 3));
+        }
+    }
+}
@@ -0,0 +1,130 @@
+/**
+ * Benchmark of aesd_circular_buffer_find_entry_offset_for_fpos against a linear walk.
+ * Built as its own target, outside the autotest: it prints the timings and only fails
+ * when the two lookups disagree, the machine it runs on decides how fast either is.
+ */
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+#define BENCH_ENTRIES    4096       // ring capacity, the thousands of entries the offset index is meant for
+#define BENCH_LOOKUPS    200000     // lookups timed for each method
+
+/**
+* Reference lookup walking the entries from the oldest one, as aesd_circular_buffer_find_entry_offset_for_fpos used to
+*/
+static struct aesd_buffer_entry *linear_find(struct aesd_circular_buffer *buffer, size_t char_offset, size_t *entry_offset_byte_rtn)
+{
+    struct aesd_buffer_entry*   entry = &buffer->entry[buffer->out_offs];
+    
+    for(; buffer->count > 0 && entry != NULL; entry = aesd_circular_buffer_next_entry(buffer, entry))
+    {
+        if(char_offset < entry->size)
+        {
+            *entry_offset_byte_rtn = char_offset;
+            return entry;
+        }
+        
+        char_offset -= entry->size;
+    }
+    
+    return NULL;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec     ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+* Times random offset lookups in a full ring of BENCH_ENTRIES entries against the linear walk, after checking both agree
+* @return 0 if both lookups agree, 1 otherwise
+*/
+int main(void)
+{
+    struct aesd_circular_buffer     buffer;
+    struct aesd_buffer_entry        entry;
+    struct aesd_buffer_entry*       found = NULL;
+    size_t*                         offsets = malloc(BENCH_LOOKUPS * sizeof(size_t));
+    size_t                          entry_offset = 0;
+    size_t                          linear_offset = 0;
+    size_t                          checksum = 0;
+    uint64_t                        start = 0;
+    uint64_t                        index_ns = 0;
+    uint64_t                        linear_ns = 0;
+    char*                           writestr = NULL;
+    int                             i = 0;
+    
+    if(offsets == NULL || aesd_circular_buffer_init_size(&buffer, BENCH_ENTRIES, 0) != 0)
+    {
+        fprintf(stderr, "Out of memory for %d entries\n", BENCH_ENTRIES);
+        free(offsets);
+        return 1;
+    }
+    
+    // wrap the ring once so out_offs is not at slot 0
+    for(i = 0; i < BENCH_ENTRIES + BENCH_ENTRIES / 3; i++)
+    {
+        writestr = malloc(64);
+        entry.size = snprintf(writestr, 64, "record %d%.*s\n", i, i % 40, "........................................");
+        entry.buffptr = writestr;
+        free((void*)aesd_circular_buffer_add_entry(&buffer, &entry));
+    }
+    
+    srand(5713);
+    
+    for(i = 0; i < BENCH_LOOKUPS; i++)
+    {
+        offsets[i] = (size_t)rand() % buffer.total_bytes;
+        
+        found = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, offsets[i], &entry_offset);
+        
+        if(found != linear_find(&buffer, offsets[i], &linear_offset) || found == NULL || linear_offset != entry_offset)
+        {
+            fprintf(stderr, "Lookups disagree at offset %zu\n", offsets[i]);
+            aesd_circular_buffer_free(&buffer);
+            free(offsets);
+            return 1;
+        }
+    }
+    
+    start = now_ns();
+    
+    for(i = 0; i < BENCH_LOOKUPS; i++)
+    {
+        checksum += aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, offsets[i], &entry_offset)->size + entry_offset;
+    }
+    
+    index_ns = now_ns() - start;
+    start = now_ns();
+    
+    for(i = 0; i < BENCH_LOOKUPS; i++)
+    {
+        checksum -= linear_find(&buffer, offsets[i], &entry_offset)->size + entry_offset;
+    }
+    
+    linear_ns = now_ns() - start;
+    
+    printf("fpos lookup in %d entries: offset index %.1f ns, linear walk %.1f ns\n", BENCH_ENTRIES,
+           (double)index_ns / BENCH_LOOKUPS, (double)linear_ns / BENCH_LOOKUPS);
+    
+    aesd_circular_buffer_free(&buffer);
+    free(offsets);
+    
+    // both loops visited the same entries, anything left over means they did not
+    if(checksum != 0)
+    {
+        fprintf(stderr, "Lookup checksums differ\n");
+        return 1;
+    }
+    
+    return 0;
+}